@@ -0,0 +1,129 @@
+/*
+ * Compares context placement with many keys active: contexts from
+ * blowfish_new, each an aligned block of its own, against contexts
+ * packed into an arena.  Each operation encrypts one block with a
+ * randomly chosen context so the S-box loads are spread across every
+ * context's tables.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "blowfish.h"
+
+#define DEFAULT_CONTEXTS 8192
+#define DEFAULT_OPERATIONS 2000000
+
+static uint64_t
+next_random(uint64_t *seed)
+{
+    uint64_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *seed = x;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+make_key(size_t n, uint8_t *key)
+{
+    for (size_t i = 0; i < 16; ++i) {
+        key[i] = (uint8_t)((n >> ((i & 7) * 8)) ^ (i * 0x9d));
+    }
+}
+
+static double
+run(char const *label, blowfish_state **contexts, size_t num_contexts,
+    size_t operations)
+{
+    uint8_t const block[BLOWFISH_BLOCK_SIZE] = {0};
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    unsigned long checksum = 0;
+    double start, elapsed;
+
+    start = now();
+    for (size_t i = 0; i < operations; ++i) {
+        blowfish_state *state = contexts[next_random(&seed) % num_contexts];
+        size_t out_len;
+        uint8_t *out = blowfish_encrypt(state, block, sizeof(block), &out_len,
+                                        NULL, NULL);
+        checksum += out[0];
+        blowfish_release(out);
+    }
+    elapsed = now() - start;
+    printf("%-8s %8zu contexts %10zu ops %8.1f ns/op (checksum %lu)\n", label,
+           num_contexts, operations, elapsed * 1e9 / (double)operations,
+           checksum);
+    return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t num_contexts = DEFAULT_CONTEXTS;
+    size_t operations = DEFAULT_OPERATIONS;
+    blowfish_state **contexts;
+    blowfish_arena *arena;
+    uint8_t key[16];
+
+    if (argc > 1) {
+        num_contexts = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        operations = strtoul(argv[2], NULL, 10);
+    }
+    if (num_contexts == 0 || operations == 0) {
+        fprintf(stderr, "Usage: %s [CONTEXTS [OPERATIONS]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    contexts = (blowfish_state **)calloc(num_contexts, sizeof(*contexts));
+    if (contexts == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate context table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < num_contexts; ++i) {
+        make_key(i, &key[0]);
+        contexts[i] = blowfish_new(&key[0], sizeof(key), NULL, 0, MODE_ECB, 0,
+                                   NULL, NULL);
+        if (contexts[i] == NULL) {
+            fprintf(stderr, "ERROR: failed to create context %zu\n", i);
+            exit(EXIT_FAILURE);
+        }
+        contexts[i]->pkcs7padding = false;
+    }
+    run("new", contexts, num_contexts, operations);
+    for (size_t i = 0; i < num_contexts; ++i) {
+        blowfish_free(contexts[i]);
+    }
+
+    arena = blowfish_arena_new(num_contexts, NULL, NULL);
+    if (arena == NULL) {
+        fprintf(stderr, "ERROR: failed to create arena\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < num_contexts; ++i) {
+        make_key(i, &key[0]);
+        contexts[i] = blowfish_arena_new_state(
+            arena, &key[0], sizeof(key), NULL, 0, MODE_ECB, 0, NULL, NULL);
+        if (contexts[i] == NULL) {
+            fprintf(stderr, "ERROR: failed to create arena context %zu\n", i);
+            exit(EXIT_FAILURE);
+        }
+        contexts[i]->pkcs7padding = false;
+    }
+    run("arena", contexts, num_contexts, operations);
+    blowfish_arena_free(arena);
+    free(contexts);
+
+    return 0;
+}
@@ -0,0 +1,589 @@
+/*
+ * Throughput and latency matrix for every implemented mode.  Each case
+ * encrypts or decrypts one message of a given size with padding on or
+ * off, repeating it until the time budget is used up, and then times a
+ * sample of single operations for the latency percentiles.  Key setup
+ * and context creation are measured the same way.
+ *
+ * Cycles come from the time stamp counter where there is one.  It ticks
+ * at a constant reference rate, so with frequency scaling the figures
+ * are reference cycles rather than core cycles.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#    include <x86intrin.h>
+#    define HAVE_TSC 1
+#endif
+
+#include "blowfish.h"
+#include "perf-counters.h"
+
+#define DEFAULT_BUDGET 0.05
+#define DEFAULT_MIN_SIZE ((size_t)8)
+#define DEFAULT_MAX_SIZE ((size_t)64 * 1024 * 1024)
+#define SIZE_STEP 8
+#define LATENCY_SAMPLES 1001
+
+struct mode_spec {
+    char const *name;
+    blowfish_mode mode;
+    int segment;
+};
+
+static struct mode_spec const MODES[] = {
+    {"CBC", MODE_CBC, 0},     {"CFB8", MODE_CFB, 8},   {"CFB16", MODE_CFB, 16},
+    {"CFB24", MODE_CFB, 24},  {"CFB32", MODE_CFB, 32}, {"CFB40", MODE_CFB, 40},
+    {"CFB48", MODE_CFB, 48},  {"CFB56", MODE_CFB, 56}, {"CFB64", MODE_CFB, 64},
+    {"ECB", MODE_ECB, 0},     {"OFB", MODE_OFB, 0},
+};
+
+#define NUM_MODES (sizeof(MODES) / sizeof(MODES[0]))
+
+struct timing {
+    size_t ops;
+    double ns_per_op;
+    double cycles_per_op; /* zero without a cycle counter */
+    double p50_ns;
+    double p99_ns;
+    struct perf_sample perf; /* over the timed repetitions */
+};
+
+typedef void (*operation)(void *arg);
+
+struct options {
+    double budget;
+    size_t min_size;
+    size_t max_size;
+    char const *mode; /* NULL for every mode */
+    bool json;
+    bool counters;
+};
+
+static uint8_t const KEY[16] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab,
+                                0xcd, 0xef, 0xfe, 0xdc, 0xba, 0x98,
+                                0x76, 0x54, 0x32, 0x10};
+static uint8_t const LONG_KEY[56] = {0x2a};
+static uint8_t const IV[BLOWFISH_BLOCK_SIZE] = {0xf0, 0xe1, 0xd2, 0xc3,
+                                                0xb4, 0xa5, 0x96, 0x87};
+
+static struct perf_counters *counters; /* NULL when not counting */
+
+static void
+fail(void *context, char const *fmt, ...)
+{
+    va_list ap;
+
+    (void)context;
+    fputs("ERROR: ", stderr);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static uint64_t
+cycles(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Time stamp counter ticks per nanosecond, zero without one */
+static double
+cycle_rate(void)
+{
+#ifdef HAVE_TSC
+    struct timespec pause = {0, 50 * 1000 * 1000};
+    double start = now();
+    uint64_t start_cycles = cycles();
+
+    nanosleep(&pause, NULL);
+    return (double)(cycles() - start_cycles) / (now() - start);
+#else
+    return 0.0;
+#endif
+}
+
+static int
+compare_doubles(void const *a, void const *b)
+{
+    double x = *(double const *)a, y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Doubles the repetition count until one run takes at least `budget`
+ * seconds and reports that run, hardware counters included.  The
+ * latency sample is limited to as many operations as the final run, so
+ * large messages are timed once.
+ */
+static struct timing
+measure(operation op, void *arg, double budget)
+{
+    static double samples[LATENCY_SAMPLES];
+    struct timing timing;
+    size_t reps = 1, num_samples;
+    double elapsed;
+    uint64_t ticks;
+
+    memset(&timing, 0, sizeof(timing));
+    op(arg); /* warm the caches and fault the buffers in */
+    for (;;) {
+        double start;
+        uint64_t start_cycles;
+
+        if (counters != NULL) {
+            perf_counters_start(counters);
+        }
+        start = now();
+        start_cycles = cycles();
+        for (size_t i = 0; i < reps; ++i) {
+            op(arg);
+        }
+        ticks = cycles() - start_cycles;
+        elapsed = now() - start;
+        if (counters != NULL) {
+            perf_counters_stop(counters, &timing.perf);
+        }
+        if (elapsed >= budget * 1e9) {
+            break;
+        }
+        reps *= 2;
+    }
+    timing.ops = reps;
+    timing.ns_per_op = elapsed / (double)reps;
+    timing.cycles_per_op = (double)ticks / (double)reps;
+
+    num_samples = reps < LATENCY_SAMPLES ? reps : LATENCY_SAMPLES;
+    for (size_t i = 0; i < num_samples; ++i) {
+        double start = now();
+        op(arg);
+        samples[i] = now() - start;
+    }
+    qsort(samples, num_samples, sizeof(samples[0]), &compare_doubles);
+    timing.p50_ns = samples[num_samples / 2];
+    timing.p99_ns = samples[num_samples * 99 / 100];
+    return timing;
+}
+
+struct crypt_case {
+    blowfish_state *state;
+    bool encrypt;
+    uint8_t const *in;
+    size_t in_len;
+    uint8_t *out;
+    size_t out_size;
+};
+
+static void
+crypt_once(void *arg)
+{
+    struct crypt_case *c = arg;
+    size_t out_len;
+
+    blowfish_reset(c->state);
+    if (c->encrypt) {
+        blowfish_encrypt_into(c->state, c->in, c->in_len, c->out,
+                              c->out_size, &out_len, &fail, NULL);
+    } else {
+        blowfish_decrypt_into(c->state, c->in, c->in_len, c->out,
+                              c->out_size, &out_len, &fail, NULL);
+    }
+}
+
+struct setup_case {
+    blowfish_state *state;
+    uint8_t const *key;
+    size_t key_len;
+    blowfish_schedule const *schedule;
+};
+
+static void
+init_once(void *arg)
+{
+    struct setup_case *c = arg;
+    blowfish_init(c->state, c->key, c->key_len, IV, sizeof(IV), MODE_CBC, 0,
+                  &fail, NULL);
+}
+
+static void
+new_once(void *arg)
+{
+    struct setup_case *c = arg;
+    blowfish_free(blowfish_new(c->key, c->key_len, IV, sizeof(IV), MODE_CBC,
+                               0, &fail, NULL));
+}
+
+static void
+bind_once(void *arg)
+{
+    struct setup_case *c = arg;
+    blowfish_init_with_schedule(c->state, c->schedule, IV, sizeof(IV),
+                                MODE_CBC, 0, &fail, NULL);
+}
+
+static bool first_record = true;
+
+/* Count of `event` per `units`, negative when it was not counted */
+static double
+counted(struct timing const *timing, enum perf_event event, double units)
+{
+    if (!timing->perf.valid[event]) {
+        return -1.0;
+    }
+    return (double)timing->perf.value[event] / units;
+}
+
+static double
+instructions_per_cycle(struct timing const *timing)
+{
+    double cycles = counted(timing, PERF_CYCLES, 1.0);
+    double instructions = counted(timing, PERF_INSTRUCTIONS, 1.0);
+    return cycles > 0.0 && instructions >= 0.0 ? instructions / cycles : -1.0;
+}
+
+/* IPC and the other counters per `units`, as table columns */
+static void
+print_counters(struct timing const *timing, double units)
+{
+    double values[] = {instructions_per_cycle(timing),
+                       counted(timing, PERF_INSTRUCTIONS, units),
+                       counted(timing, PERF_L1D_MISSES, units),
+                       counted(timing, PERF_BRANCH_MISSES, units)};
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        if (values[i] < 0.0) {
+            printf(" %10s", "-");
+        } else {
+            printf(" %10.2f", values[i]);
+        }
+    }
+}
+
+/* The counters per operation as a JSON member, null where missing */
+static void
+print_counters_json(struct timing const *timing)
+{
+    static char const *const names[PERF_NUM_EVENTS] = {
+        [PERF_CYCLES] = "cycles",
+        [PERF_INSTRUCTIONS] = "instructions",
+        [PERF_L1D_MISSES] = "l1d_misses",
+        [PERF_BRANCH_MISSES] = "branch_misses",
+    };
+    double ipc = instructions_per_cycle(timing);
+
+    printf(", \"perf\": {");
+    for (int event = 0; event < PERF_NUM_EVENTS; ++event) {
+        double value = counted(timing, event, (double)timing->ops);
+        if (value < 0.0) {
+            printf("\"%s\": null, ", names[event]);
+        } else {
+            printf("\"%s\": %.2f, ", names[event], value);
+        }
+    }
+    if (ipc < 0.0) {
+        printf("\"ipc\": null}");
+    } else {
+        printf("\"ipc\": %.3f}", ipc);
+    }
+}
+
+static void
+report_setup(struct options const *options, char const *name,
+             struct timing const *timing)
+{
+    if (options->json) {
+        printf("%s\n    {\"name\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.1f, "
+               "\"cycles_per_op\": %.0f, \"p50_ns\": %.1f, \"p99_ns\": %.1f",
+               first_record ? "" : ",", name, timing->ops, timing->ns_per_op,
+               timing->cycles_per_op, timing->p50_ns, timing->p99_ns);
+        print_counters_json(timing);
+        printf("}");
+        first_record = false;
+    } else {
+        printf("%-22s %12.1f %12.0f %10.1f %10.1f", name, timing->ns_per_op,
+               timing->cycles_per_op, timing->p50_ns, timing->p99_ns);
+        if (counters != NULL) {
+            print_counters(timing, (double)timing->ops);
+        }
+        printf("\n");
+    }
+}
+
+static void
+report_crypt(struct options const *options, struct mode_spec const *mode,
+             bool padding, bool encrypt, size_t size,
+             struct timing const *timing)
+{
+    double mb_per_s = (double)size * 1e3 / timing->ns_per_op;
+    double cycles_per_byte = timing->cycles_per_op / (double)size;
+
+    if (options->json) {
+        printf("%s\n    {\"mode\": \"%s\", \"padding\": %s, \"op\": \"%s\", "
+               "\"size\": %zu, \"ops\": %zu, \"ns_per_op\": %.1f, "
+               "\"mb_per_s\": %.2f, \"cycles_per_byte\": %.2f, "
+               "\"p50_ns\": %.1f, \"p99_ns\": %.1f",
+               first_record ? "" : ",", mode->name, padding ? "true" : "false",
+               encrypt ? "encrypt" : "decrypt", size, timing->ops,
+               timing->ns_per_op, mb_per_s, cycles_per_byte, timing->p50_ns,
+               timing->p99_ns);
+        print_counters_json(timing);
+        printf("}");
+        first_record = false;
+    } else {
+        printf("%-6s %-3s %-7s %10zu %14.1f %10.2f %9.2f %12.1f %12.1f",
+               mode->name, padding ? "on" : "off",
+               encrypt ? "encrypt" : "decrypt", size, timing->ns_per_op,
+               mb_per_s, cycles_per_byte, timing->p50_ns, timing->p99_ns);
+        if (counters != NULL) {
+            /* per KiB of message */
+            print_counters(timing, (double)timing->ops * (double)size / 1024);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static void
+bench_setup(struct options const *options)
+{
+    blowfish_state *state = blowfish_new(KEY, sizeof(KEY), IV, sizeof(IV),
+                                         MODE_CBC, 0, &fail, NULL);
+    struct setup_case c = {state, KEY, sizeof(KEY), &state->schedule};
+    blowfish_state bound;
+    struct timing timing;
+
+    if (!options->json) {
+        printf("%-22s %12s %12s %10s %10s", "setup", "ns/op", "cycles/op",
+               "p50 ns", "p99 ns");
+        if (counters != NULL) {
+            printf(" %10s %10s %10s %10s", "IPC", "insns/op", "L1D/op",
+                   "brmiss/op");
+        }
+        printf("\n");
+    }
+    timing = measure(&init_once, &c, options->budget);
+    report_setup(options, "key setup 16 bytes", &timing);
+    c.key = LONG_KEY;
+    c.key_len = sizeof(LONG_KEY);
+    timing = measure(&init_once, &c, options->budget);
+    report_setup(options, "key setup 56 bytes", &timing);
+
+    c.key = KEY;
+    c.key_len = sizeof(KEY);
+    timing = measure(&new_once, &c, options->budget);
+    report_setup(options, "new context", &timing);
+    c.state = &bound;
+    timing = measure(&bind_once, &c, options->budget);
+    report_setup(options, "bind to schedule", &timing);
+
+    blowfish_free(state);
+}
+
+static void
+bench_mode(struct options const *options, struct mode_spec const *mode,
+           uint8_t *plain, uint8_t *cipher, uint8_t *out)
+{
+    bool has_iv = mode->mode != MODE_ECB;
+    size_t unit = mode->segment ? (size_t)mode->segment / 8
+                                : BLOWFISH_BLOCK_SIZE;
+    blowfish_state *state = blowfish_new(
+        KEY, sizeof(KEY), has_iv ? IV : NULL, has_iv ? sizeof(IV) : 0,
+        mode->mode, mode->segment, &fail, NULL);
+
+    for (int padding = 1; padding >= 0; --padding) {
+        state->pkcs7padding = padding;
+        for (size_t step = options->min_size; step <= options->max_size;) {
+            /* without padding the message is whole CFB segments */
+            size_t size = padding ? step : step - step % unit;
+            size_t cipher_len = blowfish_encrypted_size(state, size);
+            struct crypt_case c = {state, true, plain, size, cipher,
+                                   cipher_len};
+            struct timing timing;
+
+            timing = measure(&crypt_once, &c, options->budget);
+            report_crypt(options, mode, padding, true, size, &timing);
+
+            c.encrypt = false;
+            c.in = cipher;
+            c.in_len = cipher_len;
+            c.out = out;
+            c.out_size = cipher_len;
+            timing = measure(&crypt_once, &c, options->budget);
+            report_crypt(options, mode, padding, false, size, &timing);
+
+            if (step == options->max_size) {
+                break;
+            }
+            step = step * SIZE_STEP < options->max_size ? step * SIZE_STEP
+                                                        : options->max_size;
+        }
+    }
+    blowfish_free(state);
+}
+
+static size_t
+parse_size(char const *text)
+{
+    char *end;
+    size_t size = strtoul(text, &end, 10);
+
+    switch (*end) {
+    case 'k':
+    case 'K':
+        size *= 1024;
+        ++end;
+        break;
+    case 'm':
+    case 'M':
+        size *= 1024 * 1024;
+        ++end;
+        break;
+    }
+    if (*end != '\0' || size == 0 || size % BLOWFISH_BLOCK_SIZE) {
+        fail(NULL, "size must be a positive multiple of %d: %s",
+             BLOWFISH_BLOCK_SIZE, text);
+    }
+    return size;
+}
+
+static void
+usage(char const *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-j] [-m MODE] [-P] [-s MIN_SIZE] [-S MAX_SIZE] "
+            "[-t SECONDS]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct options options = {DEFAULT_BUDGET, DEFAULT_MIN_SIZE,
+                              DEFAULT_MAX_SIZE, NULL, false, true};
+    struct perf_counters perf_counters;
+    char error[BLOWFISH_ERROR_SIZE];
+    uint8_t *plain, *cipher, *out;
+    double rate;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jm:Ps:S:t:")) != -1) {
+        switch (opt) {
+        case 'j':
+            options.json = true;
+            break;
+        case 'm':
+            options.mode = optarg;
+            break;
+        case 'P':
+            options.counters = false;
+            break;
+        case 's':
+            options.min_size = parse_size(optarg);
+            break;
+        case 'S':
+            options.max_size = parse_size(optarg);
+            break;
+        case 't':
+            options.budget = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || options.budget <= 0.0
+        || options.min_size > options.max_size)
+    {
+        usage(argv[0]);
+    }
+    if (options.mode != NULL) {
+        bool known = false;
+        for (size_t i = 0; i < NUM_MODES; ++i) {
+            known = known || strcasecmp(options.mode, MODES[i].name) == 0;
+        }
+        if (!known) {
+            fail(NULL, "unknown mode %s", options.mode);
+        }
+    }
+
+    plain = malloc(options.max_size);
+    cipher = malloc(options.max_size + BLOWFISH_BLOCK_SIZE);
+    out = malloc(options.max_size + BLOWFISH_BLOCK_SIZE);
+    if (plain == NULL || cipher == NULL || out == NULL) {
+        fail(NULL, "failed to allocate buffers of %zu bytes",
+             options.max_size);
+    }
+    for (size_t i = 0; i < options.max_size; ++i) {
+        plain[i] = (uint8_t)(i * 0x9d);
+    }
+
+    if (options.counters) {
+        if (perf_counters_open(&perf_counters, error, sizeof(error))) {
+            counters = &perf_counters;
+        } else {
+            fprintf(stderr, "# hardware counters unavailable: %s\n", error);
+        }
+    }
+    rate = cycle_rate();
+    if (options.json) {
+        printf("{\n  \"cycles_per_ns\": %.4f,\n  \"budget_s\": %g,\n"
+               "  \"setup\": [",
+               rate, options.budget);
+    } else {
+        printf("# time stamp counter %.3f GHz, %g s per case\n", rate,
+               options.budget);
+    }
+    bench_setup(&options);
+
+    if (options.json) {
+        printf("\n  ],\n  \"cases\": [");
+        first_record = true;
+    } else {
+        printf("\n%-6s %-3s %-7s %10s %14s %10s %9s %12s %12s", "mode", "pad",
+               "op", "bytes", "ns/op", "MB/s", "cycles/B", "p50 ns",
+               "p99 ns");
+        if (counters != NULL) {
+            printf(" %10s %10s %10s %10s", "IPC", "insns/KB", "L1D/KB",
+                   "brmiss/KB");
+        }
+        printf("\n");
+    }
+    for (size_t i = 0; i < NUM_MODES; ++i) {
+        if (options.mode == NULL
+            || strcasecmp(options.mode, MODES[i].name) == 0)
+        {
+            bench_mode(&options, &MODES[i], plain, cipher, out);
+        }
+    }
+    if (options.json) {
+        printf("\n  ]\n}\n");
+    }
+
+    if (counters != NULL) {
+        perf_counters_close(counters);
+    }
+    free(plain);
+    free(cipher);
+    free(out);
+    return 0;
+}
@@ -0,0 +1,109 @@
+-- Per call cost of the Lua binding.  Every operation is repeated until it
+-- has used the time budget and then run once more with the collector
+-- stopped, which gives the CPU time per call, the bytes allocated per call
+-- and, from a full collection afterwards, the cost of reclaiming them.
+-- Messages are kept small because that is where the binding rather than
+-- the cipher decides the cost.  Each call gets a message of its own since
+-- Lua interns strings and a repeated result would cost no allocation.
+--
+-- Usage: lua bench/lua-bench.lua [SECONDS]
+local blowfish = require("blowfish")
+
+local BUDGET = tonumber(arg and arg[1]) or 0.2
+local KEY = "\1\35\69\103\137\171\205\239\254\220\186\152\118\84\50\16"
+local IV = "\240\225\210\195\180\165\150\135"
+local MODES = {"CBC", "CFB", "ECB", "OFB"}
+local SIZES = {8, 64, 1024, 16384}
+local MAX_BYTES = 64 * 1024 * 1024 -- of messages and results per case
+
+local clock = os.clock
+local has_jit, jit = pcall(require, "jit")
+
+local function collect_time()
+    local start = clock()
+    collectgarbage("collect")
+    return clock() - start
+end
+
+-- time of a collection with nothing to reclaim, subtracted from the GC cost
+collectgarbage("collect")
+local BASELINE = collect_time()
+
+-- `loop(ops, inputs)` performs `ops` calls, the i-th on `make_input(i)`
+local function measure(loop, size, make_input)
+    local limit = math.max(1, math.floor(MAX_BYTES / (2 * size + 64)))
+    local inputs = {}
+    local ops = 1
+    collectgarbage("collect")
+    while true do
+        for i = #inputs + 1, make_input and ops or 0 do
+            inputs[i] = make_input(i)
+        end
+        local start = clock()
+        loop(ops, inputs)
+        if ops >= limit or clock() - start >= BUDGET then break end
+        ops = math.min(ops * 2, limit)
+    end
+
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local before = collectgarbage("count")
+    local start = clock()
+    loop(ops, inputs)
+    local elapsed = clock() - start
+    local allocated = (collectgarbage("count") - before) * 1024
+    local gc = math.max(0, collect_time() - BASELINE)
+    collectgarbage("restart")
+    return {
+        ops = ops,
+        ns = elapsed * 1e9 / ops,
+        gc_ns = gc * 1e9 / ops,
+        bytes = allocated / ops,
+    }
+end
+
+local function report(op, mode, size, result)
+    local rate = size > 0 and string.format("%10.2f", size * 1e3 / result.ns) or
+                     string.format("%10s", "-")
+    print(string.format("%-8s %-4s %8d %12.1f %s %10.1f %10.1f", op, mode,
+                        size, result.ns, rate, result.gc_ns, result.bytes))
+    io.stdout:flush()
+end
+
+-- the counter is repeated because Lua hashes long strings by sampling
+local function message(i, size)
+    return string.rep(string.format("%08x", i), size / 8)
+end
+
+print(string.format("-- %s, %.2f s per case, CPU time",
+                    has_jit and jit.version or _VERSION, BUDGET))
+print(string.format("%-8s %-4s %8s %12s %10s %10s %10s", "op", "mode",
+                    "bytes", "ns/op", "MB/s", "gc ns/op", "alloc B"))
+
+for _, name in ipairs(MODES) do
+    local mode = blowfish[name]
+    local iv = name ~= "ECB" and IV or nil
+
+    report("new", name, 0, measure(function(ops)
+        for _ = 1, ops do blowfish.new(mode, KEY, iv) end
+    end, 4096))
+
+    local keychain = blowfish.new(mode, KEY, iv)
+    report("reset", name, 0, measure(function(ops)
+        for _ = 1, ops do keychain:reset() end
+    end, 0))
+
+    for _, size in ipairs(SIZES) do
+        report("encrypt", name, size, measure(function(ops, inputs)
+            for i = 1, ops do keychain:encrypt(inputs[i]) end
+        end, size, function(i) return message(i, size) end))
+
+        -- the last blocks, and so the padding, do not depend on the
+        -- chaining state that earlier calls leave behind
+        local encoder = blowfish.new(mode, KEY, iv)
+        report("decrypt", name, size, measure(function(ops, inputs)
+            for i = 1, ops do keychain:decrypt(inputs[i]) end
+        end, size, function(i) return encoder:encrypt(message(i, size)) end))
+        assert(keychain:decrypt(encoder:encrypt(message(0, size))))
+    end
+end
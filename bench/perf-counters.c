@@ -0,0 +1,146 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "perf-counters.h"
+
+#ifdef __linux__
+#    include <linux/perf_event.h>
+#    include <sys/ioctl.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+
+static struct {
+    uint32_t type;
+    uint64_t config;
+} const EVENTS[PERF_NUM_EVENTS] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D
+                             | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                             | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int
+open_event(enum perf_event event, int group_fd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = EVENTS[event].type;
+    attr.config = EVENTS[event].config;
+    attr.disabled = group_fd == -1; /* members follow the leader */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                     | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+bool
+perf_counters_open(struct perf_counters *counters, char *error,
+                   size_t error_size)
+{
+    int first_errno = 0;
+
+    counters->leader = -1;
+    for (int event = 0; event < PERF_NUM_EVENTS; ++event) {
+        counters->fds[event] = open_event(event, counters->leader);
+        if (counters->fds[event] < 0) {
+            counters->fds[event] = -1;
+            first_errno = first_errno ? first_errno : errno;
+        } else if (counters->leader < 0) {
+            counters->leader = counters->fds[event];
+        }
+    }
+    if (counters->leader < 0) {
+        snprintf(error, error_size, "perf_event_open: %s",
+                 strerror(first_errno));
+        return false;
+    }
+    return true;
+}
+
+void
+perf_counters_close(struct perf_counters *counters)
+{
+    for (int event = 0; event < PERF_NUM_EVENTS; ++event) {
+        if (counters->fds[event] >= 0) {
+            close(counters->fds[event]);
+            counters->fds[event] = -1;
+        }
+    }
+    counters->leader = -1;
+}
+
+void
+perf_counters_start(struct perf_counters const *counters)
+{
+    ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void
+perf_counters_stop(struct perf_counters const *counters,
+                   struct perf_sample *sample)
+{
+    /* nr, time enabled, time running and a value per member */
+    uint64_t data[3 + PERF_NUM_EVENTS];
+    size_t next = 3;
+
+    ioctl(counters->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    memset(sample, 0, sizeof(*sample));
+    if (read(counters->leader, data, sizeof(data)) < (ssize_t)(3 * 8)
+        || data[2] == 0)
+    {
+        return; /* never scheduled */
+    }
+    for (int event = 0; event < PERF_NUM_EVENTS && next < 3 + data[0];
+         ++event)
+    {
+        if (counters->fds[event] >= 0) {
+            double scale = (double)data[1] / (double)data[2];
+            sample->valid[event] = true;
+            sample->value[event] = (uint64_t)((double)data[next++] * scale);
+        }
+    }
+}
+
+#else /* !__linux__ */
+
+bool
+perf_counters_open(struct perf_counters *counters, char *error,
+                   size_t error_size)
+{
+    for (int event = 0; event < PERF_NUM_EVENTS; ++event) {
+        counters->fds[event] = -1;
+    }
+    counters->leader = -1;
+    snprintf(error, error_size, "hardware counters need Linux");
+    return false;
+}
+
+void
+perf_counters_close(struct perf_counters *counters)
+{
+    (void)counters;
+}
+
+void
+perf_counters_start(struct perf_counters const *counters)
+{
+    (void)counters;
+}
+
+void
+perf_counters_stop(struct perf_counters const *counters,
+                   struct perf_sample *sample)
+{
+    (void)counters;
+    memset(sample, 0, sizeof(*sample));
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,40 @@
+#ifndef BLOWFISH_8BIT_PERF_COUNTERS_H
+#define BLOWFISH_8BIT_PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Hardware counters of the calling thread, read with perf_event_open on
+ * Linux.  Events the processor or the hypervisor does not offer are left
+ * out; the rest are scheduled together so their ratios are taken over
+ * the same instructions.  Only user space is counted, which works with
+ * the default perf_event_paranoid setting.
+ */
+enum perf_event {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NUM_EVENTS
+};
+
+struct perf_counters {
+    int fds[PERF_NUM_EVENTS]; /* -1 for events that are not counted */
+    int leader;
+};
+
+struct perf_sample {
+    bool valid[PERF_NUM_EVENTS];
+    uint64_t value[PERF_NUM_EVENTS]; /* scaled when multiplexed */
+};
+
+/* Fails, with `error` explaining why, when no event could be opened */
+extern bool perf_counters_open(struct perf_counters *counters, char *error,
+                               size_t error_size);
+extern void perf_counters_close(struct perf_counters *counters);
+extern void perf_counters_start(struct perf_counters const *counters);
+extern void perf_counters_stop(struct perf_counters const *counters,
+                               struct perf_sample *sample);
+
+#endif /* !BLOWFISH_8BIT_PERF_COUNTERS_H */
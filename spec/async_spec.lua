@@ -0,0 +1,42 @@
+local blowfish = require("blowfish")
+
+describe("#async", function()
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+    local PLAINTEXT = string.rep("sixteen  letters", 4096)
+
+    local function round_trip()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local expected = keychain:encrypt(PLAINTEXT)
+        keychain:reset()
+
+        local job = keychain:encrypt_async(PLAINTEXT)
+        assert.is_number(job:fd())
+        assert.equal(expected, job:result())
+        assert.is_true(job:ready())
+
+        job = keychain:decrypt_async(expected)
+        keychain = nil -- the job does not need the keychain
+        collectgarbage()
+        assert.equal(PLAINTEXT, job:result())
+    end
+
+    it("runs inline without worker threads", round_trip)
+
+    it("runs on worker threads", function()
+        assert.is_true(blowfish.threads(2))
+        round_trip()
+        assert.is_true(blowfish.threads(0))
+    end)
+
+    it("reports errors through the handle", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local result, err = keychain:decrypt_async("not a block"):result()
+        assert.is_nil(result)
+        assert.is_not_nil(err)
+    end)
+
+    it("rejects bad thread counts", function()
+        assert.has.errors(function() blowfish.threads(-1) end)
+    end)
+end)
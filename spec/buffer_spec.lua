@@ -0,0 +1,59 @@
+local blowfish = require("blowfish")
+
+describe("#buffer", function()
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+    local PLAINTEXT = "a message that is reused over and over"
+
+    local function keychain()
+        local k = blowfish.new(blowfish.CBC, KEY, IV)
+        k:enable_pkcs7_padding()
+        return k
+    end
+
+    it("holds a copy of a string", function()
+        local buffer = blowfish.buffer(64)
+        assert.equal(64, buffer:capacity())
+        buffer:set(PLAINTEXT)
+        assert.equal(#PLAINTEXT, buffer:len())
+        assert.equal(PLAINTEXT, buffer:tostring())
+        assert.equal(PLAINTEXT, tostring(buffer))
+        assert.equal("message", buffer:sub(3, 9))
+        assert.equal("over", buffer:sub(-4))
+        assert.equal("", buffer:sub(10, 9))
+        buffer:clear()
+        assert.equal("", buffer:tostring())
+        assert.has.errors(function() buffer:set(string.rep("x", 65)) end)
+    end)
+
+    it("receives results from a keychain", function()
+        local expected = keychain():encrypt(PLAINTEXT)
+        local k = keychain()
+        local cipher, plain = blowfish.buffer(64), blowfish.buffer(64)
+        assert.equal(#expected, k:encrypt_into(cipher, PLAINTEXT))
+        assert.equal(expected, cipher:tostring())
+        k:reset()
+        assert.equal(#PLAINTEXT, k:decrypt_into(plain, cipher))
+        assert.equal(PLAINTEXT, plain:tostring())
+    end)
+
+    it("encrypts its own contents in place", function()
+        local expected = keychain():encrypt(PLAINTEXT)
+        local k = keychain()
+        local buffer = blowfish.buffer(64)
+        buffer:set(PLAINTEXT)
+        k:encrypt_into(buffer)
+        assert.equal(expected, buffer:tostring())
+        k:reset()
+        k:decrypt_into(buffer)
+        assert.equal(PLAINTEXT, buffer:tostring())
+    end)
+
+    it("reports a result that does not fit", function()
+        local buffer = blowfish.buffer(8)
+        local result, err = keychain():encrypt_into(buffer, PLAINTEXT)
+        assert.is_nil(result)
+        assert.is_not_nil(err)
+        assert.equal(0, buffer:len())
+    end)
+end)
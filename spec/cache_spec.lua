@@ -0,0 +1,32 @@
+local blowfish = require("blowfish")
+
+describe("#shared cache", function()
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+
+    it("requires an absolute name", function()
+        local ok, err = blowfish.use_shared_cache("no-slash")
+        assert.is_nil(ok)
+        assert.is_not_nil(err)
+    end)
+
+    it("produces the same ciphertext as private keys", function()
+        local private = blowfish.new(blowfish.CBC, KEY, IV)
+        local expected = private:encrypt("sixteen  letters")
+        assert.is_true(blowfish.use_shared_cache("/blowfish-spec"))
+        local shared = blowfish.new(blowfish.CBC, KEY, IV)
+        assert.equal(expected, shared:encrypt("sixteen  letters"))
+        shared:reset()
+        assert.equal("sixteen  letters", shared:decrypt(expected))
+    end)
+
+    it("can be opened again with the same name", function()
+        assert.is_true(blowfish.use_shared_cache("/blowfish-spec"))
+    end)
+
+    it("refuses to switch caches", function()
+        local ok, err = blowfish.use_shared_cache("/blowfish-other")
+        assert.is_nil(ok)
+        assert.is_not_nil(err)
+    end)
+end)
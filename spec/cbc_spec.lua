@@ -16,6 +16,19 @@ describe("#CBC", function()
         assert.equal(plaintext, keychain:decrypt(ciphertext))
     end)
 
+    it("handles messages of any size", function()
+        local keychain = blowfish.new(MODE, KEY, IV)
+        keychain:enable_pkcs7_padding()
+        for _, size in ipairs({1, 8191, 8192, 8193, 100000}) do
+            local plaintext = string.rep("x", size)
+            local ciphertext = keychain:encrypt(plaintext)
+            assert.equal(size + 8 - size % 8, #ciphertext)
+            keychain:reset()
+            assert.equal(plaintext, keychain:decrypt(ciphertext))
+            keychain:reset()
+        end
+    end)
+
     describe("creation", function()
         it("succeeds when IV is 8-bytes in length", function()
             assert.has_no
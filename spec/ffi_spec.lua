@@ -0,0 +1,61 @@
+local has_ffi = pcall(require, "ffi")
+
+describe("#FFI", function()
+    if not has_ffi then return end
+
+    local ffi = require("ffi")
+    local blowfish = require("blowfish")
+    local bffi = require("blowfish.ffi")
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+    local PLAINTEXT = "a message that is not a multiple of eight bytes"
+
+    local function classic(mode, iv)
+        local keychain = blowfish.new(mode, KEY, iv)
+        keychain:enable_pkcs7_padding()
+        return keychain
+    end
+
+    it("matches the classic binding", function()
+        for _, mode in ipairs({bffi.CBC, bffi.CFB, bffi.ECB, bffi.OFB}) do
+            local iv = mode ~= bffi.ECB and IV or nil
+            local context = bffi.new(mode, KEY, iv)
+            local ciphertext = context:encrypt(PLAINTEXT)
+            assert.equal(classic(mode, iv):encrypt(PLAINTEXT), ciphertext)
+            context:reset()
+            assert.equal(PLAINTEXT, context:decrypt(ciphertext))
+        end
+    end)
+
+    it("writes into caller memory", function()
+        local context = bffi.new(bffi.CBC, KEY, IV)
+        local size = context:encrypted_size(#PLAINTEXT)
+        local out = ffi.new("uint8_t[?]", size)
+        assert.equal(size, context:encrypt_into(PLAINTEXT, #PLAINTEXT, out, size))
+        context:reset()
+        assert.equal(#PLAINTEXT, context:decrypt_into(out, size, out, size))
+        assert.equal(PLAINTEXT, ffi.string(out, #PLAINTEXT))
+
+        local n, err = context:encrypt_into(PLAINTEXT, #PLAINTEXT, out, 8)
+        assert.is_nil(n)
+        assert.is_string(err)
+    end)
+
+    it("appends to string buffers", function()
+        local ok, buffer = pcall(require, "string.buffer")
+        if not ok then return end
+        local context = bffi.new(bffi.CBC, KEY, IV)
+        local buf = buffer.new()
+        context:encrypt_to_buffer(buf, PLAINTEXT)
+        context:reset()
+        local out = buffer.new()
+        context:decrypt_to_buffer(out, buf:tostring())
+        assert.equal(PLAINTEXT, out:tostring())
+    end)
+
+    it("reports configuration errors", function()
+        assert.has.errors(function() bffi.new(bffi.CBC, "abc", IV) end)
+        local context = bffi.new(bffi.CBC, KEY, IV)
+        assert.has.errors(function() context:set_iv("short") end)
+    end)
+end)
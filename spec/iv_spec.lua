@@ -0,0 +1,44 @@
+local blowfish = require("blowfish")
+
+describe("#IV", function()
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+    local OTHER_IV = "otherivs"
+    local PLAINTEXT = "sixteen  letters"
+
+    local function expected(mode, iv)
+        return blowfish.new(mode, KEY, iv):encrypt(PLAINTEXT)
+    end
+
+    it("can be replaced without a new keychain", function()
+        for _, mode in ipairs({blowfish.CBC, blowfish.CFB, blowfish.OFB}) do
+            local keychain = blowfish.new(mode, KEY, IV)
+            keychain:encrypt(PLAINTEXT) -- leaves chaining state behind
+            keychain:set_iv(OTHER_IV)
+            assert.equal(expected(mode, OTHER_IV), keychain:encrypt(PLAINTEXT))
+            keychain:reset()
+            assert.equal(expected(mode, OTHER_IV), keychain:encrypt(PLAINTEXT))
+        end
+    end)
+
+    it("can be given with each call", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local ciphertext = keychain:encrypt(PLAINTEXT, OTHER_IV)
+        assert.equal(expected(blowfish.CBC, OTHER_IV), ciphertext)
+        assert.equal(PLAINTEXT, keychain:decrypt(ciphertext, OTHER_IV))
+        assert.equal(expected(blowfish.CBC, IV), keychain:encrypt(PLAINTEXT, IV))
+    end)
+
+    it("must be a whole block", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        assert.has.errors(function() keychain:set_iv("short") end)
+        local result, err = keychain:encrypt(PLAINTEXT, "short")
+        assert.is_nil(result)
+        assert.is_not_nil(err)
+    end)
+
+    it("is refused in ECB mode", function()
+        local keychain = blowfish.new(blowfish.ECB, KEY)
+        assert.has.errors(function() keychain:set_iv(IV) end)
+    end)
+end)
@@ -0,0 +1,62 @@
+local blowfish = require("blowfish")
+
+describe("#many", function()
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+    local OTHER_IV = "otherivs"
+
+    it("matches one call per element", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local plaintexts = {"sixteen  letters", "eight ch", "another sixteen!"}
+        local ciphertexts, errors = keychain:encrypt_many(plaintexts)
+        assert.same({}, errors)
+        for i, plaintext in ipairs(plaintexts) do
+            keychain:reset()
+            assert.equal(keychain:encrypt(plaintext), ciphertexts[i])
+        end
+
+        local decrypted = keychain:decrypt_many(ciphertexts)
+        assert.same(plaintexts, decrypted)
+    end)
+
+    it("installs per-element initialization vectors", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local ciphertexts = keychain:encrypt_many({"eight ch", "eight ch"},
+                                                  {IV, OTHER_IV})
+        assert.is_true(ciphertexts[1] ~= ciphertexts[2])
+
+        local other = blowfish.new(blowfish.CBC, KEY, OTHER_IV)
+        assert.equal(other:encrypt("eight ch"), ciphertexts[2])
+        assert.same({"eight ch", "eight ch"},
+                    keychain:decrypt_many(ciphertexts, {IV, OTHER_IV}))
+    end)
+
+    it("reports errors per element", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local results, errors = keychain:decrypt_many(
+                                    {"not a block", {}, "eight ch"},
+                                    {IV, IV, "short"})
+        assert.same({}, results)
+        assert.is_string(errors[1])
+        assert.is_string(errors[2])
+        assert.is_string(errors[3])
+    end)
+
+    it("rejects initialization vectors in ECB mode", function()
+        local keychain = blowfish.new(blowfish.ECB, KEY)
+        local results, errors = keychain:encrypt_many({"eight ch"}, {IV})
+        assert.same({}, results)
+        assert.is_string(errors[1])
+    end)
+
+    it("leaves the keychain's own vector in place", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local expected = keychain:encrypt("eight ch")
+        keychain:encrypt_many({"eight ch", "eight ch"}, {OTHER_IV})
+        keychain:reset()
+        assert.equal(expected, keychain:encrypt("eight ch"))
+        local ciphertexts = keychain:encrypt_many({"eight ch", "eight ch"},
+                                                  {OTHER_IV})
+        assert.equal(expected, ciphertexts[2])
+    end)
+end)
@@ -0,0 +1,46 @@
+local blowfish = require("blowfish")
+
+describe("#rekey", function()
+    local KEY = "any key that you want"
+    local OTHER_KEY = "some other key"
+    local IV = "somebits" -- exactly 8 bytes
+    local OTHER_IV = "otherivs"
+    local PLAINTEXT = "sixteen  letters"
+
+    it("switches keys in place", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        keychain:encrypt(PLAINTEXT)
+        keychain:rekey(OTHER_KEY)
+        local expected = blowfish.new(blowfish.CBC, OTHER_KEY, IV)
+        assert.equal(expected:encrypt(PLAINTEXT), keychain:encrypt(PLAINTEXT))
+    end)
+
+    it("can change the IV and mode", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        keychain:rekey(OTHER_KEY, OTHER_IV)
+        local expected = blowfish.new(blowfish.CBC, OTHER_KEY, OTHER_IV)
+        assert.equal(expected:encrypt(PLAINTEXT), keychain:encrypt(PLAINTEXT))
+
+        keychain:rekey(KEY, nil, blowfish.ECB)
+        expected = blowfish.new(blowfish.ECB, KEY)
+        assert.equal(expected:encrypt(PLAINTEXT), keychain:encrypt(PLAINTEXT))
+    end)
+
+    it("keeps the padding setting", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        keychain:enable_pkcs7_padding()
+        keychain:rekey(OTHER_KEY)
+        assert.equal(24, #keychain:encrypt(PLAINTEXT))
+    end)
+
+    it("leaves the keychain alone on bad input", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local expected = keychain:encrypt(PLAINTEXT)
+        assert.has.errors(function() keychain:rekey("abc") end)
+        assert.has.errors(function()
+            keychain:rekey(OTHER_KEY, nil, blowfish.ECB + 100)
+        end)
+        keychain:reset()
+        assert.equal(expected, keychain:encrypt(PLAINTEXT))
+    end)
+end)
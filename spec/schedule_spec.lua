@@ -0,0 +1,55 @@
+local blowfish = require("blowfish")
+
+describe("#schedule", function()
+    local KEY = "any key that you want"
+    local OTHER_KEY = "some other key"
+    local IV = "somebits" -- exactly 8 bytes
+    local PLAINTEXT = "sixteen  letters"
+
+    local function expected(key)
+        return blowfish.new(blowfish.CBC, key, IV):encrypt(PLAINTEXT)
+    end
+
+    it("is shared by name", function()
+        local schedule = assert(blowfish.schedule("spec-shared", KEY))
+        local found = assert(blowfish.schedule("spec-shared"))
+        assert.equal("spec-shared", found:name())
+        assert.equal("spec-shared", tostring(schedule))
+        assert.equal(expected(KEY),
+                     blowfish.new(blowfish.CBC, found, IV):encrypt(PLAINTEXT))
+    end)
+
+    it("refuses unknown names and conflicting keys", function()
+        local result, err = blowfish.schedule("spec-missing")
+        assert.is_nil(result)
+        assert.is_string(err)
+
+        local schedule = assert(blowfish.schedule("spec-conflict", KEY))
+        result, err = blowfish.schedule("spec-conflict", OTHER_KEY)
+        assert.is_nil(result)
+        assert.is_string(err)
+        assert.is_not_nil(schedule)
+    end)
+
+    it("stays alive while a keychain uses it", function()
+        local keychain = blowfish.new(blowfish.CBC,
+                                      blowfish.schedule("spec-alive", KEY), IV)
+        collectgarbage()
+        collectgarbage()
+        assert.equal(expected(KEY), keychain:encrypt(PLAINTEXT))
+        keychain = nil
+        collectgarbage()
+        collectgarbage()
+        assert.is_nil(blowfish.schedule("spec-alive"))
+    end)
+
+    it("can be installed with rekey", function()
+        local schedule = assert(blowfish.schedule("spec-rekey", OTHER_KEY))
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        keychain:rekey(schedule)
+        assert.equal(expected(OTHER_KEY), keychain:encrypt(PLAINTEXT))
+        keychain:reset()
+        keychain:rekey(KEY)
+        assert.equal(expected(KEY), keychain:encrypt(PLAINTEXT))
+    end)
+end)
@@ -0,0 +1,63 @@
+local blowfish = require("blowfish")
+
+describe("#slices", function()
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+    local PLAINTEXT = string.rep("processed a slice at a time. ", 100)
+
+    local function keychain(mode, segment_size)
+        local k = blowfish.new(mode, KEY, mode ~= blowfish.ECB and IV or nil,
+                               segment_size)
+        k:enable_pkcs7_padding()
+        return k
+    end
+
+    -- collects the pieces, yielding between them like a light thread would
+    local function collect(iterator)
+        local co = coroutine.wrap(function()
+            local out = {}
+            for piece in iterator do
+                out[#out + 1] = piece
+                coroutine.yield(#out)
+            end
+            return table.concat(out)
+        end)
+        local result = co()
+        while type(result) == "number" do result = co() end
+        return result
+    end
+
+    it("matches a single call in every mode", function()
+        for _, case in ipairs({{blowfish.CBC}, {blowfish.CFB, 24},
+                               {blowfish.ECB}, {blowfish.OFB}}) do
+            local ciphertext = keychain(case[1], case[2]):encrypt(PLAINTEXT)
+            local k = keychain(case[1], case[2])
+            assert.equal(ciphertext, collect(k:encrypt_slices(PLAINTEXT, 100)))
+            k:reset()
+            assert.equal(PLAINTEXT, collect(k:decrypt_slices(ciphertext, 100)))
+        end
+    end)
+
+    it("advances the keychain's chaining state", function()
+        local expected = keychain(blowfish.CBC)
+        expected:encrypt(PLAINTEXT)
+        local k = keychain(blowfish.CBC)
+        collect(k:encrypt_slices(PLAINTEXT, 64))
+        assert.equal(expected:encrypt(PLAINTEXT), k:encrypt(PLAINTEXT))
+    end)
+
+    it("produces one piece per slice", function()
+        local count = 0
+        for _ in keychain(blowfish.CBC):encrypt_slices(PLAINTEXT, 1000) do
+            count = count + 1
+        end
+        assert.equal(3, count)
+    end)
+
+    it("raises errors from the iterator", function()
+        local k = keychain(blowfish.CBC)
+        assert.has.errors(function()
+            for _ in k:decrypt_slices(string.rep("x", 100), 16) do end
+        end)
+    end)
+end)
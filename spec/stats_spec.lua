@@ -0,0 +1,62 @@
+local blowfish = require("blowfish")
+
+describe("#stats", function()
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+    local PLAINTEXT = "sixteen  letters"
+
+    it("counts operations by mode and direction", function()
+        local before = blowfish.stats()
+        local keychain = blowfish.new(blowfish.OFB, KEY, IV)
+        local ciphertext = keychain:encrypt(PLAINTEXT)
+        keychain:reset()
+        assert.equal(PLAINTEXT, keychain:decrypt(ciphertext))
+        local after = blowfish.stats()
+
+        assert.equal(1, after.operations.OFB.encrypt -
+                         before.operations.OFB.encrypt)
+        assert.equal(1, after.operations.OFB.decrypt -
+                         before.operations.OFB.decrypt)
+        assert.equal(#PLAINTEXT,
+                     after.bytes.OFB.encrypt - before.bytes.OFB.encrypt)
+        assert.is_nil(after.operations.CTR)
+    end)
+
+    it("counts padding failures", function()
+        local keychain = blowfish.new(blowfish.ECB, KEY)
+        keychain:disable_pkcs7_padding()
+        local garbled = keychain:encrypt(string.rep("x", 16))
+        keychain:enable_pkcs7_padding()
+        local before = blowfish.stats().padding_failures
+        assert.is_nil(keychain:decrypt(garbled))
+        assert.equal(1, blowfish.stats().padding_failures - before)
+    end)
+
+    it("records latency only while tracking", function()
+        local keychain = blowfish.new(blowfish.CBC, KEY, IV)
+        local before = blowfish.stats().latency.encrypt.count
+        keychain:encrypt(PLAINTEXT)
+        assert.equal(before, blowfish.stats().latency.encrypt.count)
+
+        blowfish.track_latency(true)
+        keychain:encrypt(PLAINTEXT)
+        blowfish.track_latency(false)
+        local latency = blowfish.stats().latency.encrypt
+        assert.equal(before + 1, latency.count)
+        local total = 0
+        for _, count in ipairs(latency.buckets) do total = total + count end
+        assert.equal(latency.count, total)
+    end)
+
+    it("renders the Prometheus text format", function()
+        local text = blowfish.stats("prometheus")
+        assert.is_string(text)
+        assert.is_not_nil(text:find(
+                              "# TYPE blowfish_operations_total counter", 1,
+                              true))
+        assert.is_not_nil(text:find(
+                              'blowfish_latency_seconds_bucket{op="encrypt",' ..
+                                  'le="+Inf"}', 1, true))
+        assert.has_error(function() blowfish.stats("xml") end)
+    end)
+end)
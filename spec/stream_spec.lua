@@ -0,0 +1,68 @@
+local blowfish = require("blowfish")
+
+describe("#stream", function()
+    local KEY = "any key that you want"
+    local IV = "somebits" -- exactly 8 bytes
+    local OTHER_IV = "otherivs"
+    local PLAINTEXT = string.rep("a body that arrives in chunks. ", 40)
+
+    local function keychain(mode)
+        local k = blowfish.new(mode, KEY, mode ~= blowfish.ECB and IV or nil)
+        k:enable_pkcs7_padding()
+        return k
+    end
+
+    -- feeds `input` in chunks of growing size and collects the output
+    local function run(stream, input)
+        local out, pos, size = {}, 1, 1
+        while pos <= #input do
+            out[#out + 1] = assert(stream:update(input:sub(pos, pos + size - 1)))
+            pos, size = pos + size, size + 3
+        end
+        out[#out + 1] = assert(stream:finish())
+        return table.concat(out)
+    end
+
+    it("matches whole-message calls in every mode", function()
+        for _, mode in ipairs({blowfish.CBC, blowfish.CFB, blowfish.ECB,
+                               blowfish.OFB}) do
+            local ciphertext = keychain(mode):encrypt(PLAINTEXT)
+            local k = keychain(mode)
+            assert.equal(ciphertext, run(k:stream("encrypt"), PLAINTEXT))
+            assert.equal(PLAINTEXT, run(k:stream("decrypt"), ciphertext))
+        end
+    end)
+
+    it("releases output before the last chunk", function()
+        local ciphertext = keychain(blowfish.CBC):encrypt(PLAINTEXT)
+        local stream = keychain(blowfish.CBC):stream("decrypt")
+        assert.equal(PLAINTEXT:sub(1, 16), stream:update(ciphertext:sub(1, 20)))
+        assert.equal("", stream:update(ciphertext:sub(21, 24)))
+    end)
+
+    it("starts over after finishing", function()
+        local ciphertext = keychain(blowfish.CBC):encrypt(PLAINTEXT)
+        local stream = keychain(blowfish.CBC):stream("decrypt")
+        assert.equal(PLAINTEXT, run(stream, ciphertext))
+        assert.equal(PLAINTEXT, run(stream, ciphertext))
+    end)
+
+    it("accepts its own initialization vector", function()
+        local k = keychain(blowfish.CBC)
+        local ciphertext = k:encrypt(PLAINTEXT, OTHER_IV)
+        assert.equal(PLAINTEXT, run(k:stream("decrypt", OTHER_IV), ciphertext))
+    end)
+
+    it("reports truncated input when finishing", function()
+        local ciphertext = keychain(blowfish.CBC):encrypt(PLAINTEXT)
+        local stream = keychain(blowfish.CBC):stream("decrypt")
+        assert.is_string(stream:update(ciphertext:sub(1, 20)))
+        local result, err = stream:finish()
+        assert.is_nil(result)
+        assert.is_not_nil(err)
+    end)
+
+    it("rejects unknown directions", function()
+        assert.has.errors(function() keychain(blowfish.CBC):stream("sideways") end)
+    end)
+end)
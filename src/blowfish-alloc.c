@@ -0,0 +1,224 @@
+/*
+ * Allocation hooks and the output buffer pool.
+ *
+ * Every block handed out by this module is preceded by a header that
+ * records the allocator that produced it so that it can be released
+ * without knowing which context it came from.  Output buffers that were
+ * obtained from the global allocator are recycled through a small pool
+ * of power-of-two size classes instead of going back to the allocator,
+ * and are wiped on the way in.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blowfish-internal.h"
+#include "blowfish.h"
+
+#define MIN_CLASS_SHIFT 6  /* 64 bytes */
+#define MAX_CLASS_SHIFT 16 /* 64 KiB */
+#define NUM_CLASSES (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+#define MAX_POOLED 8 /* buffers kept per size class */
+
+struct block_header {
+    blowfish_alloc_function alloc;
+    void *ud;
+    void *base;  /* what alloc returned */
+    size_t size; /* number of bytes requested from alloc */
+};
+
+struct pooled_block {
+    struct pooled_block *next;
+};
+
+static void *default_alloc(void *, void *, size_t, size_t);
+
+static blowfish_alloc_function global_alloc = &default_alloc;
+static void *global_ud = NULL;
+
+static struct {
+    pthread_mutex_t lock;
+    struct pooled_block *free_list[NUM_CLASSES];
+    unsigned int count[NUM_CLASSES];
+} pool = {PTHREAD_MUTEX_INITIALIZER, {NULL}, {0}};
+
+static void *
+default_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    (void)ud;
+    (void)osize;
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsize);
+}
+
+static inline struct block_header *
+header_of(void const *ptr)
+{
+    return ((struct block_header *)ptr) - 1;
+}
+
+static void
+release_block(struct block_header *header)
+{
+    header->alloc(header->ud, header->base, header->size, 0);
+}
+
+/* Returns the size class for a block of `size` bytes or -1 if too large */
+static int
+size_class(size_t size)
+{
+    int shift = MIN_CLASS_SHIFT;
+    while (((size_t)1 << shift) < size) {
+        if (++shift > MAX_CLASS_SHIFT) {
+            return -1;
+        }
+    }
+    return shift - MIN_CLASS_SHIFT;
+}
+
+static void
+drain_pool(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < NUM_CLASSES; ++i) {
+        while (pool.free_list[i] != NULL) {
+            struct pooled_block *block = pool.free_list[i];
+            pool.free_list[i] = block->next;
+            release_block(header_of(block));
+        }
+        pool.count[i] = 0;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void
+blowfish_set_allocator(blowfish_alloc_function alloc, void *ud)
+{
+    drain_pool();
+    if (alloc == NULL) {
+        alloc = &default_alloc;
+        ud = NULL;
+    }
+    global_alloc = alloc;
+    global_ud = ud;
+}
+
+void
+blowfish_set_context_allocator(blowfish_state *self,
+                               blowfish_alloc_function alloc, void *ud)
+{
+    if (alloc == NULL) {
+        alloc = global_alloc;
+        ud = global_ud;
+    }
+    self->alloc = alloc;
+    self->alloc_ud = ud;
+}
+
+void
+blowfish_release(uint8_t *buf)
+{
+    struct block_header *header;
+    int cls;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    header = header_of(buf);
+    cls = size_class(header->size);
+    if (cls >= 0 && header->size == ((size_t)1 << (cls + MIN_CLASS_SHIFT))
+        && header->alloc == global_alloc && header->ud == global_ud)
+    {
+        /* do not hand the last message to the next caller */
+        memset(buf, 0, header->size - sizeof(*header));
+        pthread_mutex_lock(&pool.lock);
+        if (pool.count[cls] < MAX_POOLED) {
+            struct pooled_block *block = (struct pooled_block *)buf;
+            block->next = pool.free_list[cls];
+            pool.free_list[cls] = block;
+            ++pool.count[cls];
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pool.lock);
+        if (buf == NULL) {
+            return;
+        }
+    }
+    release_block(header);
+}
+
+uint8_t *
+bf_buffer_alloc(blowfish_state const *self, size_t size)
+{
+    struct block_header *header;
+    size_t total = sizeof(*header) + size;
+    int cls = -1;
+
+    if (self->alloc == global_alloc && self->alloc_ud == global_ud) {
+        cls = size_class(total);
+    }
+    if (cls >= 0) {
+        struct pooled_block *block = NULL;
+
+        pthread_mutex_lock(&pool.lock);
+        if (pool.free_list[cls] != NULL) {
+            block = pool.free_list[cls];
+            pool.free_list[cls] = block->next;
+            --pool.count[cls];
+        }
+        pthread_mutex_unlock(&pool.lock);
+        if (block != NULL) {
+            return (uint8_t *)block;
+        }
+        total = (size_t)1 << (cls + MIN_CLASS_SHIFT);
+    }
+
+    header = (struct block_header *)self->alloc(self->alloc_ud, NULL, 0, total);
+    if (header == NULL) {
+        return NULL;
+    }
+    bf_stats_allocation();
+    header->alloc = self->alloc;
+    header->ud = self->alloc_ud;
+    header->base = header;
+    header->size = total;
+    return (uint8_t *)(header + 1);
+}
+
+blowfish_state *
+bf_state_alloc(void)
+{
+    struct block_header *header;
+    size_t total = sizeof(blowfish_state) + sizeof(*header)
+                 + BLOWFISH_ALIGNMENT - 1;
+    uint8_t *base = (uint8_t *)global_alloc(global_ud, NULL, 0, total);
+    uintptr_t addr;
+
+    if (base == NULL) {
+        return NULL;
+    }
+    bf_stats_allocation();
+    addr = (uintptr_t)(base + sizeof(*header));
+    addr = (addr + BLOWFISH_ALIGNMENT - 1)
+         & ~(uintptr_t)(BLOWFISH_ALIGNMENT - 1);
+    header = header_of((void *)addr);
+    header->alloc = global_alloc;
+    header->ud = global_ud;
+    header->base = base;
+    header->size = total;
+
+    blowfish_state *self = (blowfish_state *)addr;
+    self->alloc = global_alloc;
+    self->alloc_ud = global_ud;
+    return self;
+}
+
+void
+bf_state_release(blowfish_state *self)
+{
+    release_block(header_of(self));
+}
@@ -0,0 +1,197 @@
+/*
+ * Arena allocator that packs blowfish contexts into 2MB regions.
+ *
+ * Each region is backed by a huge page when the kernel has them reserved
+ * (MAP_HUGETLB) and is otherwise aligned to 2MB and offered to transparent
+ * huge pages.  Contexts are carved from the regions in BLOWFISH_ALIGNMENT
+ * multiples and released slots are kept on an intrusive free list.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#    include <malloc.h>
+#else
+#    include <sys/mman.h>
+#endif
+
+#include "blowfish-internal.h"
+#include "blowfish.h"
+
+#define REGION_SIZE ((size_t)2 * 1024 * 1024)
+#define SLOTS_PER_REGION (REGION_SIZE / sizeof(blowfish_state))
+
+struct free_slot {
+    struct free_slot *next;
+};
+
+struct region {
+    struct region *next;
+    uint8_t *base;
+    size_t used; /* number of slots carved from this region */
+};
+
+struct blowfish_arena {
+    struct region *regions;
+    struct free_slot *free_list;
+    size_t capacity;
+    size_t allocated;
+};
+
+static uint8_t *
+map_region(void)
+{
+#ifdef _WIN32
+    return (uint8_t *)_aligned_malloc(REGION_SIZE, REGION_SIZE);
+#else
+    void *mem;
+
+#    ifdef MAP_HUGETLB
+    mem = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+        return (uint8_t *)mem;
+    }
+#    endif
+
+    /* over-allocate so that the region can be trimmed to a 2MB boundary */
+    mem = mmap(NULL, REGION_SIZE * 2, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    uintptr_t start = (uintptr_t)mem;
+    uintptr_t aligned = (start + REGION_SIZE - 1) & ~(REGION_SIZE - 1);
+    if (aligned > start) {
+        munmap(mem, aligned - start);
+    }
+    munmap((void *)(aligned + REGION_SIZE), start + REGION_SIZE - aligned);
+
+#    ifdef MADV_HUGEPAGE
+    madvise((void *)aligned, REGION_SIZE, MADV_HUGEPAGE);
+#    endif
+    return (uint8_t *)aligned;
+#endif
+}
+
+static void
+unmap_region(struct region *region)
+{
+#ifdef _WIN32
+    _aligned_free(region->base);
+#else
+    munmap(region->base, REGION_SIZE);
+#endif
+}
+
+blowfish_arena *
+blowfish_arena_new(size_t capacity, error_function on_error,
+                   void *error_context)
+{
+    blowfish_arena *arena;
+
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    arena = (blowfish_arena *)calloc(1, sizeof(*arena));
+    if (arena == NULL) {
+        on_error(error_context, "failed to allocate arena");
+        return NULL;
+    }
+    arena->capacity = capacity;
+    return arena;
+}
+
+void
+blowfish_arena_free(blowfish_arena *arena)
+{
+    if (arena != NULL) {
+        struct region *region = arena->regions;
+        while (region != NULL) {
+            struct region *next = region->next;
+            unmap_region(region);
+            free(region);
+            region = next;
+        }
+        free(arena);
+    }
+}
+
+static blowfish_state *
+arena_alloc(blowfish_arena *arena, error_function on_error,
+            void *error_context)
+{
+    struct region *region;
+
+    if (arena->capacity && arena->allocated >= arena->capacity) {
+        on_error(error_context, "arena capacity of %zu contexts exhausted",
+                 arena->capacity);
+        return NULL;
+    }
+
+    if (arena->free_list != NULL) {
+        struct free_slot *slot = arena->free_list;
+        arena->free_list = slot->next;
+        ++arena->allocated;
+        return (blowfish_state *)slot;
+    }
+
+    region = arena->regions;
+    if (region == NULL || region->used == SLOTS_PER_REGION) {
+        region = (struct region *)calloc(1, sizeof(*region));
+        if (region == NULL) {
+            on_error(error_context, "failed to allocate arena region");
+            return NULL;
+        }
+        region->base = map_region();
+        if (region->base == NULL) {
+            free(region);
+            on_error(error_context, "failed to map %zu byte arena region",
+                     REGION_SIZE);
+            return NULL;
+        }
+        region->next = arena->regions;
+        arena->regions = region;
+    }
+
+    ++arena->allocated;
+    return (blowfish_state *)(region->base
+                              + (region->used++ * sizeof(blowfish_state)));
+}
+
+blowfish_state *
+blowfish_arena_new_state(blowfish_arena *arena, uint8_t const *key,
+                         size_t key_len, uint8_t const *iv, size_t iv_len,
+                         blowfish_mode mode, int segment_size,
+                         error_function on_error, void *error_context)
+{
+    blowfish_state *self;
+
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    self = arena_alloc(arena, on_error, error_context);
+    if (self != NULL) {
+        if (!blowfish_init(self, key, key_len, iv, iv_len, mode, segment_size,
+                           on_error, error_context))
+        {
+            blowfish_arena_release(arena, self);
+            self = NULL;
+        }
+    }
+
+    return self;
+}
+
+void
+blowfish_arena_release(blowfish_arena *arena, blowfish_state *self)
+{
+    if (self != NULL) {
+        struct free_slot *slot = (struct free_slot *)self;
+        memset(self, 0, sizeof(*self)); /* do not leave key material around */
+        slot->next = arena->free_list;
+        arena->free_list = slot;
+        --arena->allocated;
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * Batches of small independent messages.
+ *
+ * The job array is cut into one contiguous range per participating
+ * thread.  A thread works through its own range from the front and, once
+ * that is empty, steals single jobs from the other ranges.  Every range
+ * hands out jobs through its own atomic cursor on its own cache line so
+ * threads only contend once they start stealing.  Each thread processes
+ * its jobs in a scratch context so the shared contexts stay read-only.
+ */
+#include <stdatomic.h>
+#include <string.h>
+
+#include "blowfish-internal.h"
+#include "blowfish.h"
+
+struct job_range {
+    _Alignas(BLOWFISH_ALIGNMENT) _Atomic size_t next;
+    size_t end;
+};
+
+struct batch {
+    blowfish_job *jobs;
+    bool encrypt;
+    size_t num_ranges;
+    _Atomic size_t failures;
+    struct job_range ranges[BLOWFISH_MAX_THREADS];
+};
+
+static void
+run_job(struct batch *batch, blowfish_state *scratch, blowfish_job *job)
+{
+    blowfish_state const *context = job->context;
+
+    job->ok = false;
+    job->output_len = 0;
+    job->error[0] = '\0';
+    if (context == NULL) {
+        blowfish_error_to_buffer(job->error, "job has no context");
+    } else {
+        /* the shared part of the state is all that a call touches */
+        memcpy(scratch, context, BLOWFISH_SHARED_STATE_SIZE);
+        blowfish_reset(scratch);
+        memset(scratch->old_cipher, 0, sizeof(scratch->old_cipher));
+        if (job->iv != NULL) {
+            memcpy(scratch->iv, job->iv, sizeof(scratch->iv));
+        }
+        if (batch->encrypt) {
+            job->ok = blowfish_encrypt_into(scratch, job->input,
+                                            job->input_len, job->output,
+                                            job->output_size, &job->output_len,
+                                            blowfish_error_to_buffer,
+                                            job->error);
+        } else {
+            job->ok = blowfish_decrypt_into(scratch, job->input,
+                                            job->input_len, job->output,
+                                            job->output_size, &job->output_len,
+                                            blowfish_error_to_buffer,
+                                            job->error);
+        }
+    }
+    if (!job->ok) {
+        atomic_fetch_add_explicit(&batch->failures, 1, memory_order_relaxed);
+    }
+}
+
+static void
+run_ranges(void *arg, size_t index)
+{
+    struct batch *batch = (struct batch *)arg;
+    blowfish_state scratch;
+
+    /* own range first, then steal from the others in turn */
+    for (size_t i = 0; i < batch->num_ranges; ++i) {
+        struct job_range *range =
+            &batch->ranges[(index + i) % batch->num_ranges];
+        size_t job;
+
+        while ((job = atomic_fetch_add_explicit(&range->next, 1,
+                                                memory_order_relaxed))
+               < range->end)
+        {
+            run_job(batch, &scratch, &batch->jobs[job]);
+        }
+    }
+}
+
+static size_t
+run_batch(blowfish_job *jobs, size_t num_jobs, bool encrypt)
+{
+    struct batch batch;
+    size_t per_range;
+
+    if (num_jobs == 0) {
+        return 0;
+    }
+    batch.jobs = jobs;
+    batch.encrypt = encrypt;
+    batch.num_ranges = bf_parallel_width();
+    if (batch.num_ranges > num_jobs) {
+        batch.num_ranges = num_jobs;
+    }
+    atomic_init(&batch.failures, 0);
+
+    per_range = (num_jobs + batch.num_ranges - 1) / batch.num_ranges;
+    for (size_t i = 0; i < batch.num_ranges; ++i) {
+        size_t begin = i * per_range;
+        size_t end = begin + per_range;
+        atomic_init(&batch.ranges[i].next, begin < num_jobs ? begin : num_jobs);
+        batch.ranges[i].end = end < num_jobs ? end : num_jobs;
+    }
+
+    if (batch.num_ranges == 1) {
+        run_ranges(&batch, 0);
+    } else {
+        bf_parallel_for(&run_ranges, &batch, batch.num_ranges);
+    }
+    return atomic_load(&batch.failures);
+}
+
+size_t
+blowfish_encrypt_batch(blowfish_job *jobs, size_t num_jobs)
+{
+    return run_batch(jobs, num_jobs, true);
+}
+
+size_t
+blowfish_decrypt_batch(blowfish_job *jobs, size_t num_jobs)
+{
+    return run_batch(jobs, num_jobs, false);
+}
@@ -0,0 +1,388 @@
+/*
+ * Cross-process key schedule cache.
+ *
+ * The cache is a POSIX shared memory object holding a header followed by
+ * an open-addressed table of slots.  A slot moves from EMPTY to WRITING
+ * when a process claims it with a compare-and-swap, and from WRITING to
+ * READY once the key and its expanded schedule have been stored.  Only
+ * the process that won the claim writes to a slot so readers never need
+ * a lock -- an acquire load of the slot state is enough to see the
+ * finished schedule.  Slots are never evicted.
+ *
+ * The claim also records the writer's pid.  A process that finds a slot
+ * in WRITING whose writer no longer exists takes the slot over with
+ * another compare-and-swap, so a worker killed mid-write does not leave
+ * the slot blocked.  Waiting on a live writer is bounded by time, after
+ * which the key is expanded privately.  Processes sharing a cache are
+ * expected to share a pid namespace, as prefork workers do.
+ *
+ * The raw key is kept next to the schedule so that hash collisions are
+ * detected.  The object is created with mode 0600.
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#    include <fcntl.h>
+#    include <sched.h>
+#    include <signal.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <time.h>
+#    include <unistd.h>
+#endif
+
+#include "blowfish-internal.h"
+#include "blowfish.h"
+
+#define CACHE_MAGIC 0x62666b73U /* "bfks" */
+#define CACHE_VERSION 2
+#define DEFAULT_SLOTS 1024
+#define MAX_PROBES 16
+#define MAX_KEY_LEN 56
+#define WRITER_WAIT_NS 2000000 /* 2 ms, far longer than an expansion */
+#define OPEN_RETRIES 1000   /* milliseconds to wait for the creator */
+
+enum slot_state {
+    SLOT_EMPTY = 0,
+    SLOT_WRITING,
+    SLOT_READY,
+};
+
+struct cache_slot {
+    blowfish_schedule schedule;
+    _Atomic uint64_t state; /* slot_state, the writer's pid above bit 31 */
+    uint32_t key_len;
+    uint64_t hash;
+    uint8_t key[MAX_KEY_LEN];
+};
+
+struct cache_header {
+    _Alignas(BLOWFISH_ALIGNMENT) _Atomic uint32_t magic;
+    uint32_t version;
+    uint64_t num_slots;
+    uint64_t slot_size;
+};
+
+struct blowfish_cache {
+    struct cache_header *header;
+    struct cache_slot *slots;
+    size_t num_slots;
+    size_t map_size;
+};
+
+static uint64_t
+hash_key(uint8_t const *key, size_t key_len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+    while (key_len--) {
+        hash ^= *key++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#ifndef _WIN32
+static void
+sleep_briefly(void)
+{
+    struct timespec delay = {0, 1000000};
+    nanosleep(&delay, NULL);
+}
+
+static bool
+map_cache(blowfish_cache *cache, int fd, size_t map_size,
+          error_function on_error, void *error_context)
+{
+    void *mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        on_error(error_context, "failed to map shared key cache: %s",
+                 strerror(errno));
+        return false;
+    }
+    cache->header = (struct cache_header *)mem;
+    cache->slots = (struct cache_slot *)(cache->header + 1);
+    cache->map_size = map_size;
+    return true;
+}
+
+static bool
+create_cache(blowfish_cache *cache, int fd, size_t slots,
+             error_function on_error, void *error_context)
+{
+    size_t map_size = sizeof(struct cache_header)
+                    + slots * sizeof(struct cache_slot);
+
+    if (ftruncate(fd, (off_t)map_size) != 0) {
+        on_error(error_context, "failed to size shared key cache: %s",
+                 strerror(errno));
+        return false;
+    }
+    if (!map_cache(cache, fd, map_size, on_error, error_context)) {
+        return false;
+    }
+    cache->header->version = CACHE_VERSION;
+    cache->header->num_slots = slots;
+    cache->header->slot_size = sizeof(struct cache_slot);
+    cache->num_slots = slots;
+    atomic_store_explicit(&cache->header->magic, CACHE_MAGIC,
+                          memory_order_release);
+    return true;
+}
+
+static bool
+attach_cache(blowfish_cache *cache, int fd, error_function on_error,
+             void *error_context)
+{
+    struct stat info;
+    int retries;
+
+    /* the creator may not have sized the object yet */
+    for (retries = 0; retries < OPEN_RETRIES; ++retries) {
+        if (fstat(fd, &info) != 0) {
+            on_error(error_context, "failed to stat shared key cache: %s",
+                     strerror(errno));
+            return false;
+        }
+        if ((size_t)info.st_size >= sizeof(struct cache_header)) {
+            break;
+        }
+        sleep_briefly();
+    }
+    if (retries == OPEN_RETRIES) {
+        on_error(error_context, "shared key cache was never initialized");
+        return false;
+    }
+    if (!map_cache(cache, fd, (size_t)info.st_size, on_error, error_context)) {
+        return false;
+    }
+
+    for (retries = 0; retries < OPEN_RETRIES; ++retries) {
+        if (atomic_load_explicit(&cache->header->magic, memory_order_acquire)
+            == CACHE_MAGIC)
+        {
+            break;
+        }
+        sleep_briefly();
+    }
+    if (retries == OPEN_RETRIES || cache->header->version != CACHE_VERSION
+        || cache->header->slot_size != sizeof(struct cache_slot)
+        || cache->map_size != sizeof(struct cache_header)
+                                  + (cache->header->num_slots
+                                     * sizeof(struct cache_slot)))
+    {
+        on_error(error_context, "shared key cache has an incompatible layout");
+        munmap(cache->header, cache->map_size);
+        return false;
+    }
+    cache->num_slots = cache->header->num_slots;
+    return true;
+}
+#endif /* !_WIN32 */
+
+blowfish_cache *
+blowfish_cache_open(char const *name, size_t slots, error_function on_error,
+                    void *error_context)
+{
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+#ifdef _WIN32
+    (void)name;
+    (void)slots;
+    on_error(error_context, "shared key cache is not supported");
+    return NULL;
+#else
+    blowfish_cache *cache;
+    bool ok;
+    int fd;
+
+    if (name == NULL || *name != '/') {
+        on_error(error_context, "shared key cache name must start with '/'");
+        return NULL;
+    }
+    if (slots == 0) {
+        slots = DEFAULT_SLOTS;
+    }
+    cache = (blowfish_cache *)calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        on_error(error_context, "failed to allocate shared key cache");
+        return NULL;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        ok = create_cache(cache, fd, slots, on_error, error_context);
+        if (!ok) {
+            shm_unlink(name); /* do not leave a half-made cache behind */
+        }
+    } else if (errno == EEXIST && (fd = shm_open(name, O_RDWR, 0600)) >= 0) {
+        ok = attach_cache(cache, fd, on_error, error_context);
+    } else {
+        on_error(error_context, "failed to open shared key cache %s: %s",
+                 name, strerror(errno));
+        ok = false;
+    }
+    if (fd >= 0) {
+        close(fd); /* the mapping keeps the object alive */
+    }
+    if (!ok) {
+        free(cache);
+        cache = NULL;
+    }
+    return cache;
+#endif
+}
+
+void
+blowfish_cache_close(blowfish_cache *cache)
+{
+    if (cache != NULL) {
+#ifndef _WIN32
+        munmap(cache->header, cache->map_size);
+#endif
+        free(cache);
+    }
+}
+
+bool
+blowfish_cache_unlink(char const *name)
+{
+#ifdef _WIN32
+    (void)name;
+    return false;
+#else
+    return shm_unlink(name) == 0;
+#endif
+}
+
+static bool
+slot_matches(struct cache_slot const *slot, uint64_t hash, uint8_t const *key,
+             size_t key_len)
+{
+    return slot->hash == hash && slot->key_len == key_len
+        && memcmp(slot->key, key, key_len) == 0;
+}
+
+#ifndef _WIN32
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* True when the process that claimed the slot has exited */
+static bool
+writer_gone(uint64_t state)
+{
+    pid_t writer = (pid_t)(state >> 32);
+    return writer > 0 && kill(writer, 0) != 0 && errno == ESRCH;
+}
+
+/* Claims a slot still in `expected` and stores the key in it */
+static bool
+claim_slot(struct cache_slot *slot, uint64_t expected, uint64_t hash,
+           uint8_t const *key, size_t key_len)
+{
+    uint64_t writing = ((uint64_t)(uint32_t)getpid() << 32) | SLOT_WRITING;
+
+    if (!atomic_compare_exchange_strong_explicit(&slot->state, &expected,
+                                                 writing, memory_order_acq_rel,
+                                                 memory_order_acquire))
+    {
+        return false;
+    }
+    slot->hash = hash;
+    slot->key_len = (uint32_t)key_len;
+    memcpy(slot->key, key, key_len);
+    bf_expand_key(&slot->schedule, key, key_len);
+    atomic_store_explicit(&slot->state, SLOT_READY, memory_order_release);
+    return true;
+}
+#endif /* !_WIN32 */
+
+blowfish_schedule const *
+blowfish_cache_acquire(blowfish_cache *cache, uint8_t const *key,
+                       size_t key_len, error_function on_error,
+                       void *error_context)
+{
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    if (!bf_verify_key(key, key_len, on_error, error_context)) {
+        return NULL;
+    }
+#ifdef _WIN32
+    (void)cache; /* a cache cannot be opened */
+    return NULL;
+#else
+    uint64_t hash = hash_key(key, key_len);
+
+    for (size_t probe = 0; probe < MAX_PROBES && probe < cache->num_slots;
+         ++probe)
+    {
+        struct cache_slot *slot =
+            &cache->slots[(hash + probe) % cache->num_slots];
+        uint64_t state =
+            atomic_load_explicit(&slot->state, memory_order_acquire);
+        uint64_t deadline = 0;
+
+        if (state == SLOT_EMPTY
+            && claim_slot(slot, state, hash, key, key_len))
+        {
+            return &slot->schedule;
+        }
+        /* another process is expanding a key here, it may well be ours */
+        state = atomic_load_explicit(&slot->state, memory_order_acquire);
+        while ((uint32_t)state == SLOT_WRITING) {
+            if (writer_gone(state)) {
+                if (claim_slot(slot, state, hash, key, key_len)) {
+                    return &slot->schedule;
+                }
+            } else if (deadline == 0) {
+                deadline = now_ns() + WRITER_WAIT_NS;
+            } else if (now_ns() >= deadline) {
+                break;
+            } else {
+                sched_yield();
+            }
+            state = atomic_load_explicit(&slot->state, memory_order_acquire);
+        }
+        if (state == SLOT_READY && slot_matches(slot, hash, key, key_len)) {
+            return &slot->schedule;
+        }
+    }
+
+    return NULL; /* the neighbourhood is full, caller expands privately */
+#endif
+}
+
+bool
+blowfish_init_cached(blowfish_state *self, blowfish_cache *cache,
+                     uint8_t const *key, size_t key_len, uint8_t const *iv,
+                     size_t iv_len, blowfish_mode mode, int segment_size,
+                     error_function on_error, void *error_context)
+{
+    blowfish_schedule const *schedule = NULL;
+
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    if (!bf_verify_key(key, key_len, on_error, error_context)) {
+        return false;
+    }
+    if (cache != NULL) {
+        schedule = blowfish_cache_acquire(cache, key, key_len, on_error,
+                                          error_context);
+    }
+    if (schedule == NULL) {
+        return blowfish_init(self, key, key_len, iv, iv_len, mode,
+                             segment_size, on_error, error_context);
+    }
+    return blowfish_init_with_schedule(self, schedule, iv, iv_len, mode,
+                                       segment_size, on_error, error_context);
+}
@@ -0,0 +1,68 @@
+#ifndef BLOWFISH_8BIT_BLOWFISH_INTERNAL_H
+#define BLOWFISH_8BIT_BLOWFISH_INTERNAL_H
+
+/*
+ * Helpers shared between the library translation units.  Nothing in
+ * here is part of the public API.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blowfish.h"
+
+/* the error_function used when a caller passes NULL, it reports nothing */
+extern void bf_default_error(void *context, char const *fmt, ...);
+
+extern bool bf_verify_key(uint8_t const *key, size_t key_len,
+                          error_function err, void *err_context);
+extern void bf_expand_key(blowfish_schedule *ks, uint8_t const *key,
+                          size_t key_len);
+
+/* state allocation through the global allocator, aligned for the S-boxes */
+extern blowfish_state *bf_state_alloc(void);
+extern void bf_state_release(blowfish_state *self);
+
+/* output buffers through the context allocator and the buffer pool */
+extern uint8_t *bf_buffer_alloc(blowfish_state const *self, size_t size);
+
+/*
+ * Runs fn(arg, 0) .. fn(arg, count - 1) on the thread pool and the
+ * calling thread, returning once every index has completed.
+ */
+typedef void (*bf_task_function)(void *arg, size_t index);
+extern void bf_parallel_for(bf_task_function fn, void *arg, size_t count);
+
+/*
+ * Fire-and-forget work for the thread pool.  The task is linked into the
+ * queue so it must stay valid until fn(arg, 0) has been called.  Returns
+ * false, without running the task, when the pool is not running.  Tasks
+ * still queued when the pool is stopped run on the stopping thread.
+ */
+struct bf_task {
+    struct bf_task *next;
+    bf_task_function fn;
+    void *arg;
+};
+extern bool bf_submit(struct bf_task *task);
+
+/* number of threads that may work on one call, including the caller */
+extern size_t bf_parallel_width(void);
+
+/* number of chunks to split `len` bytes of `granule` sized units into */
+extern size_t bf_parallel_chunks(size_t len, size_t granule);
+
+/*
+ * Statistics of the calling thread.  bf_stats_clock returns zero when
+ * latencies are not tracked, and a `start` of zero records no latency.
+ */
+extern uint64_t bf_stats_clock(void);
+extern void bf_stats_crypt(blowfish_mode mode, bool encrypt, size_t bytes,
+                           uint64_t start);
+/* bytes of a stream update, the operation is counted when it finishes */
+extern void bf_stats_stream_bytes(blowfish_mode mode, bool encrypt,
+                                  size_t bytes);
+extern void bf_stats_key_expansion(uint64_t start);
+extern void bf_stats_padding_failure(void);
+extern void bf_stats_allocation(void);
+
+#endif /* !BLOWFISH_8BIT_BLOWFISH_INTERNAL_H */
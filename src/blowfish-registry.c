@@ -0,0 +1,152 @@
+/*
+ * Process-wide registry of named key schedules.
+ *
+ * Every thread and every Lua state in the process sees the same list, so
+ * a key is expanded once no matter how many interpreters use it.  Entries
+ * are reference counted under a single mutex; lookups happen when a
+ * context is created, never while encrypting, so the lock is not on a
+ * hot path.  The schedule is the first member of an entry so that a
+ * schedule pointer leads back to its entry on release.
+ *
+ * The raw key is kept next to the schedule so that a second acquire of a
+ * name with a different key is refused rather than silently ignored.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blowfish-internal.h"
+#include "blowfish.h"
+
+#define MAX_KEY_LEN 56
+
+struct registry_entry {
+    blowfish_schedule schedule;
+    struct registry_entry *next;
+    size_t refs;
+    size_t key_len;
+    uint8_t key[MAX_KEY_LEN];
+    char name[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct registry_entry *head;
+} registry = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+static struct registry_entry *
+find_entry(char const *name)
+{
+    for (struct registry_entry *entry = registry.head; entry != NULL;
+         entry = entry->next)
+    {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct registry_entry *
+new_entry(char const *name, uint8_t const *key, size_t key_len)
+{
+    size_t name_len = strlen(name);
+    size_t size = sizeof(struct registry_entry) + name_len + 1;
+    struct registry_entry *entry;
+
+    /* aligned_alloc wants a multiple of the alignment */
+    size = (size + BLOWFISH_ALIGNMENT - 1) & ~(size_t)(BLOWFISH_ALIGNMENT - 1);
+    entry = (struct registry_entry *)aligned_alloc(BLOWFISH_ALIGNMENT, size);
+    if (entry != NULL) {
+        bf_expand_key(&entry->schedule, key, key_len);
+        entry->refs = 1;
+        entry->key_len = key_len;
+        memcpy(entry->key, key, key_len);
+        memcpy(entry->name, name, name_len + 1);
+        entry->next = registry.head;
+        registry.head = entry;
+    }
+    return entry;
+}
+
+blowfish_schedule const *
+blowfish_schedule_acquire(char const *name, uint8_t const *key,
+                          size_t key_len, error_function on_error,
+                          void *error_context)
+{
+    struct registry_entry *entry;
+
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    if (!bf_verify_key(key, key_len, on_error, error_context)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    entry = find_entry(name);
+    if (entry == NULL) {
+        entry = new_entry(name, key, key_len);
+        pthread_mutex_unlock(&registry.lock);
+        if (entry == NULL) {
+            on_error(error_context, "failed to allocate schedule %s", name);
+            return NULL;
+        }
+        return &entry->schedule;
+    }
+    if (entry->key_len != key_len || memcmp(entry->key, key, key_len) != 0) {
+        pthread_mutex_unlock(&registry.lock);
+        on_error(error_context, "schedule %s holds a different key", name);
+        return NULL;
+    }
+    entry->refs++;
+    pthread_mutex_unlock(&registry.lock);
+    return &entry->schedule;
+}
+
+blowfish_schedule const *
+blowfish_schedule_find(char const *name, error_function on_error,
+                       void *error_context)
+{
+    struct registry_entry *entry;
+
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    entry = find_entry(name);
+    if (entry != NULL) {
+        entry->refs++;
+    }
+    pthread_mutex_unlock(&registry.lock);
+    if (entry == NULL) {
+        on_error(error_context, "no schedule named %s", name);
+        return NULL;
+    }
+    return &entry->schedule;
+}
+
+void
+blowfish_schedule_release(blowfish_schedule const *schedule)
+{
+    struct registry_entry *entry = (struct registry_entry *)schedule;
+    struct registry_entry **link;
+
+    if (schedule == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    if (--entry->refs > 0) {
+        pthread_mutex_unlock(&registry.lock);
+        return;
+    }
+    for (link = &registry.head; *link != entry; link = &(*link)->next) {
+    }
+    *link = entry->next;
+    pthread_mutex_unlock(&registry.lock);
+
+    memset(entry, 0, sizeof(*entry)); /* key material */
+    free(entry);
+}
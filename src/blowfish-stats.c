@@ -0,0 +1,372 @@
+/*
+ * Runtime statistics.
+ *
+ * Each thread gets a block of counters laid out like blowfish_stats, as
+ * an array of words, the first time it counts something.  Only the
+ * owning thread writes to its block, so an update is a relaxed load and
+ * store rather than a locked add, and a snapshot reads every block with
+ * relaxed loads under the registry lock.  When a thread exits its counts
+ * are folded into `retired` and its block is freed.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blowfish-internal.h"
+#include "blowfish.h"
+
+#define NUM_WORDS (sizeof(blowfish_stats) / sizeof(uint64_t))
+#define WORD(field) (offsetof(blowfish_stats, field) / sizeof(uint64_t))
+#define HISTOGRAM_WORD(field)                                                  \
+    (offsetof(blowfish_histogram, field) / sizeof(uint64_t))
+#define HISTOGRAM_WORDS (sizeof(blowfish_histogram) / sizeof(uint64_t))
+
+_Static_assert(sizeof(blowfish_stats) % sizeof(uint64_t) == 0,
+               "blowfish_stats must consist of uint64_t words");
+
+struct thread_stats {
+    _Alignas(BLOWFISH_ALIGNMENT) _Atomic uint64_t words[NUM_WORDS];
+    struct thread_stats *next;
+    struct thread_stats **prev;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    bool has_key;
+    struct thread_stats *threads;
+    uint64_t retired[NUM_WORDS];
+} registry = {.lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT};
+
+static atomic_bool track_latency;
+static _Thread_local struct thread_stats *local;
+
+static void
+detach_thread(void *arg)
+{
+    struct thread_stats *stats = arg;
+
+    pthread_mutex_lock(&registry.lock);
+    for (size_t i = 0; i < NUM_WORDS; ++i) {
+        registry.retired[i] += atomic_load_explicit(&stats->words[i],
+                                                    memory_order_relaxed);
+    }
+    *stats->prev = stats->next;
+    if (stats->next != NULL) {
+        stats->next->prev = stats->prev;
+    }
+    pthread_mutex_unlock(&registry.lock);
+    local = NULL;
+    free(stats);
+}
+
+static void
+create_key(void)
+{
+    registry.has_key = pthread_key_create(&registry.key, &detach_thread) == 0;
+}
+
+/*
+ * The library may be a Lua module that lua_close unloads.  Threads that
+ * exit after that must not call detach_thread, so the key goes with the
+ * library.  Their blocks are leaked rather than folded into `retired`.
+ */
+__attribute__((destructor)) static void
+delete_key(void)
+{
+    pthread_mutex_lock(&registry.lock);
+    if (registry.has_key) {
+        registry.has_key = false;
+        pthread_key_delete(registry.key);
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+/* Returns the block of the calling thread, NULL when it cannot count */
+static struct thread_stats *
+attach_thread(void)
+{
+    struct thread_stats *stats;
+
+    pthread_once(&registry.once, &create_key);
+    if (!registry.has_key) {
+        return NULL;
+    }
+    stats = aligned_alloc(BLOWFISH_ALIGNMENT, sizeof(*stats));
+    if (stats == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < NUM_WORDS; ++i) {
+        atomic_init(&stats->words[i], 0);
+    }
+    if (pthread_setspecific(registry.key, stats) != 0) {
+        free(stats);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    stats->next = registry.threads;
+    stats->prev = &registry.threads;
+    if (stats->next != NULL) {
+        stats->next->prev = &stats->next;
+    }
+    registry.threads = stats;
+    pthread_mutex_unlock(&registry.lock);
+    return local = stats;
+}
+
+static inline void
+add(struct thread_stats *stats, size_t word, uint64_t amount)
+{
+    uint64_t value = atomic_load_explicit(&stats->words[word],
+                                          memory_order_relaxed);
+    atomic_store_explicit(&stats->words[word], value + amount,
+                          memory_order_relaxed);
+}
+
+static inline struct thread_stats *
+thread_stats(void)
+{
+    return local != NULL ? local : attach_thread();
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+record_latency(struct thread_stats *stats, blowfish_latency_kind kind,
+               uint64_t start)
+{
+    size_t base = WORD(latency) + kind * HISTOGRAM_WORDS;
+    uint64_t elapsed = now_ns() - start;
+    size_t bucket = 0;
+
+    while (bucket < BLOWFISH_STATS_BUCKETS - 1 && (elapsed >> bucket) != 0) {
+        ++bucket;
+    }
+    add(stats, base + HISTOGRAM_WORD(count), 1);
+    add(stats, base + HISTOGRAM_WORD(sum_ns), elapsed);
+    add(stats, base + HISTOGRAM_WORD(buckets) + bucket, 1);
+}
+
+uint64_t
+bf_stats_clock(void)
+{
+    uint64_t now;
+
+    if (!atomic_load_explicit(&track_latency, memory_order_relaxed)) {
+        return 0;
+    }
+    now = now_ns();
+    return now != 0 ? now : 1;
+}
+
+static void
+count_crypt(blowfish_mode mode, bool encrypt, uint64_t operations,
+            size_t bytes, uint64_t start)
+{
+    struct thread_stats *stats = thread_stats();
+    size_t slot = (size_t)mode * 2 + encrypt;
+
+    if (stats == NULL || (size_t)mode >= BLOWFISH_STATS_MODES) {
+        return;
+    }
+    add(stats, WORD(operations) + slot, operations);
+    add(stats, WORD(bytes) + slot, bytes);
+    if (start != 0) {
+        record_latency(stats,
+                       encrypt ? BLOWFISH_LATENCY_ENCRYPT
+                               : BLOWFISH_LATENCY_DECRYPT,
+                       start);
+    }
+}
+
+void
+bf_stats_crypt(blowfish_mode mode, bool encrypt, size_t bytes,
+               uint64_t start)
+{
+    count_crypt(mode, encrypt, 1, bytes, start);
+}
+
+void
+bf_stats_stream_bytes(blowfish_mode mode, bool encrypt, size_t bytes)
+{
+    count_crypt(mode, encrypt, 0, bytes, 0);
+}
+
+void
+bf_stats_key_expansion(uint64_t start)
+{
+    struct thread_stats *stats = thread_stats();
+
+    if (stats != NULL) {
+        add(stats, WORD(key_expansions), 1);
+        if (start != 0) {
+            record_latency(stats, BLOWFISH_LATENCY_KEY_SETUP, start);
+        }
+    }
+}
+
+void
+bf_stats_padding_failure(void)
+{
+    struct thread_stats *stats = thread_stats();
+
+    if (stats != NULL) {
+        add(stats, WORD(padding_failures), 1);
+    }
+}
+
+void
+bf_stats_allocation(void)
+{
+    struct thread_stats *stats = thread_stats();
+
+    if (stats != NULL) {
+        add(stats, WORD(allocations), 1);
+    }
+}
+
+void
+blowfish_stats_track_latency(bool enabled)
+{
+    atomic_store_explicit(&track_latency, enabled, memory_order_relaxed);
+}
+
+void
+blowfish_stats_snapshot(blowfish_stats *stats)
+{
+    uint64_t *words = (uint64_t *)stats;
+
+    pthread_mutex_lock(&registry.lock);
+    memcpy(words, registry.retired, sizeof(registry.retired));
+    for (struct thread_stats *thread = registry.threads; thread != NULL;
+         thread = thread->next)
+    {
+        for (size_t i = 0; i < NUM_WORDS; ++i) {
+            words[i] += atomic_load_explicit(&thread->words[i],
+                                             memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+struct text {
+    char *buf;
+    size_t size;
+    size_t len; /* of the complete text, which may exceed `size` */
+};
+
+static void
+append(struct text *text, char const *fmt, ...)
+{
+    size_t room = text->len < text->size ? text->size - text->len : 0;
+    va_list ap;
+    int written;
+
+    va_start(ap, fmt);
+    written = vsnprintf(room ? text->buf + text->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if (written > 0) {
+        text->len += (size_t)written;
+    }
+}
+
+static void
+append_header(struct text *text, char const *name, char const *type,
+              char const *help)
+{
+    append(text, "# HELP blowfish_%s %s\n# TYPE blowfish_%s %s\n", name, help,
+           name, type);
+}
+
+static void
+append_by_mode(struct text *text, char const *name, char const *help,
+               uint64_t const values[][2])
+{
+    static struct {
+        blowfish_mode mode;
+        char const *name;
+    } const modes[] = {
+        {MODE_CBC, "CBC"}, {MODE_CFB, "CFB"}, {MODE_ECB, "ECB"},
+        {MODE_OFB, "OFB"},
+    };
+
+    append_header(text, name, "counter", help);
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        for (int encrypt = 1; encrypt >= 0; --encrypt) {
+            append(text,
+                   "blowfish_%s{mode=\"%s\",direction=\"%s\"} %llu\n", name,
+                   modes[i].name, encrypt ? "encrypt" : "decrypt",
+                   (unsigned long long)values[modes[i].mode][encrypt]);
+        }
+    }
+}
+
+static void
+append_counter(struct text *text, char const *name, char const *help,
+               uint64_t value)
+{
+    append_header(text, name, "counter", help);
+    append(text, "blowfish_%s %llu\n", name, (unsigned long long)value);
+}
+
+size_t
+blowfish_stats_prometheus(blowfish_stats const *stats, char *buf, size_t size)
+{
+    static char const *const kinds[BLOWFISH_LATENCY_KINDS] = {
+        [BLOWFISH_LATENCY_ENCRYPT] = "encrypt",
+        [BLOWFISH_LATENCY_DECRYPT] = "decrypt",
+        [BLOWFISH_LATENCY_KEY_SETUP] = "key_setup",
+    };
+    struct text text = {buf, size, 0};
+
+    if (size > 0) {
+        buf[0] = '\0';
+    }
+    append_by_mode(&text, "operations_total",
+                   "Calls that encrypted or decrypted.", stats->operations);
+    append_by_mode(&text, "bytes_total", "Bytes passed to those calls.",
+                   stats->bytes);
+    append_counter(&text, "key_expansions_total", "Key schedules computed.",
+                   stats->key_expansions);
+    append_counter(&text, "padding_failures_total",
+                   "Decryptions rejected for invalid PKCS#7 padding.",
+                   stats->padding_failures);
+    append_counter(&text, "allocations_total",
+                   "Blocks requested from an allocator.", stats->allocations);
+
+    append_header(&text, "latency_seconds", "histogram",
+                  "Call latency, while tracking is enabled.");
+    for (int kind = 0; kind < BLOWFISH_LATENCY_KINDS; ++kind) {
+        blowfish_histogram const *histogram = &stats->latency[kind];
+        uint64_t cumulative = 0;
+
+        for (int i = 0; i < BLOWFISH_STATS_BUCKETS - 1; ++i) {
+            cumulative += histogram->buckets[i];
+            append(&text,
+                   "blowfish_latency_seconds_bucket{op=\"%s\",le=\"%.9g\"} "
+                   "%llu\n",
+                   kinds[kind], (double)((uint64_t)1 << i) * 1e-9,
+                   (unsigned long long)cumulative);
+        }
+        append(&text,
+               "blowfish_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n"
+               "blowfish_latency_seconds_sum{op=\"%s\"} %.9f\n"
+               "blowfish_latency_seconds_count{op=\"%s\"} %llu\n",
+               kinds[kind], (unsigned long long)histogram->count, kinds[kind],
+               (double)histogram->sum_ns * 1e-9, kinds[kind],
+               (unsigned long long)histogram->count);
+    }
+    return text.len;
+}
@@ -0,0 +1,296 @@
+/*
+ * Worker threads for splitting large messages across cores.
+ *
+ * A call to bf_parallel_for publishes a job on the pool queue and then
+ * claims indices from it like any worker does.  Indices are handed out
+ * with an atomic counter so each one runs exactly once.  Once the caller
+ * runs out of indices it takes the job off the queue and waits for the
+ * workers that joined in to finish their last index.
+ *
+ * Submitted tasks are run by the workers alone and only when no
+ * parallel job is waiting on them.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "blowfish-internal.h"
+#include "blowfish.h"
+
+#define DEFAULT_THRESHOLD ((size_t)256 * 1024)
+
+struct parallel_job {
+    struct parallel_job *next;
+    bf_task_function fn;
+    void *arg;
+    size_t count;
+    _Atomic size_t next_index;
+    unsigned active; /* workers inside the job, guarded by pool.lock */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* a job was queued or the pool is stopping */
+    pthread_cond_t idle; /* a worker left a job */
+    pthread_t threads[BLOWFISH_MAX_THREADS];
+    unsigned started;
+    bool stopping;
+    struct parallel_job *queue;
+    struct bf_task *tasks_head;
+    struct bf_task *tasks_tail;
+    _Atomic unsigned num_threads;
+    _Atomic unsigned max_parallelism;
+    _Atomic size_t threshold;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    {0},
+    0,
+    false,
+    NULL,
+    NULL,
+    NULL,
+    0,
+    0,
+    DEFAULT_THRESHOLD,
+};
+
+static void
+run_indices(struct parallel_job *job)
+{
+    size_t index;
+    while ((index = atomic_fetch_add_explicit(&job->next_index, 1,
+                                              memory_order_relaxed))
+           < job->count)
+    {
+        job->fn(job->arg, index);
+    }
+}
+
+/* Removes `job` from the queue if it is still there, pool.lock held */
+static void
+dequeue(struct parallel_job *job)
+{
+    for (struct parallel_job **link = &pool.queue; *link != NULL;
+         link = &(*link)->next)
+    {
+        if (*link == job) {
+            *link = job->next;
+            break;
+        }
+    }
+}
+
+/* Takes the oldest submitted task off the queue, pool.lock held */
+static struct bf_task *
+next_task(void)
+{
+    struct bf_task *task = pool.tasks_head;
+    if (task != NULL) {
+        pool.tasks_head = task->next;
+        if (pool.tasks_head == NULL) {
+            pool.tasks_tail = NULL;
+        }
+    }
+    return task;
+}
+
+static void *
+worker_main(void *unused)
+{
+    (void)unused;
+
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.stopping) {
+        struct parallel_job *job = pool.queue;
+        if (job == NULL) {
+            struct bf_task *task = next_task();
+            if (task == NULL) {
+                pthread_cond_wait(&pool.work, &pool.lock);
+            } else {
+                pthread_mutex_unlock(&pool.lock);
+                task->fn(task->arg, 0);
+                pthread_mutex_lock(&pool.lock);
+            }
+            continue;
+        }
+        ++job->active;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_indices(job);
+
+        pthread_mutex_lock(&pool.lock);
+        dequeue(job); /* exhausted, nobody else should pick it up */
+        if (--job->active == 0) {
+            pthread_cond_broadcast(&pool.idle);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+bool
+blowfish_threads_start(unsigned num_threads, error_function on_error,
+                       void *error_context)
+{
+    bool ok = true;
+
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    if (num_threads == 0 || num_threads > BLOWFISH_MAX_THREADS) {
+        on_error(error_context, "thread count must be between 1 and %d",
+                 BLOWFISH_MAX_THREADS);
+        return false;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.started) {
+        pthread_mutex_unlock(&pool.lock);
+        on_error(error_context, "thread pool is already running");
+        return false;
+    }
+    while (pool.started < num_threads) {
+        int rc = pthread_create(&pool.threads[pool.started], NULL,
+                                &worker_main, NULL);
+        if (rc != 0) {
+            on_error(error_context, "failed to start worker thread: %s",
+                     strerror(rc));
+            ok = false;
+            break;
+        }
+        ++pool.started;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (ok) {
+        atomic_store(&pool.num_threads, num_threads);
+    } else {
+        blowfish_threads_stop(); /* do not keep a partial pool around */
+    }
+    return ok;
+}
+
+void
+blowfish_threads_stop(void)
+{
+    struct bf_task *task;
+    unsigned started;
+
+    atomic_store(&pool.num_threads, 0);
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    started = pool.started;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    /* nobody is left to run what is still queued */
+    pthread_mutex_lock(&pool.lock);
+    while ((task = next_task()) != NULL) {
+        pthread_mutex_unlock(&pool.lock);
+        task->fn(task->arg, 0);
+        pthread_mutex_lock(&pool.lock);
+    }
+    pool.started = 0;
+    pool.stopping = false;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void
+blowfish_set_parallel_threshold(size_t min_bytes)
+{
+    atomic_store(&pool.threshold, min_bytes);
+}
+
+void
+blowfish_set_max_parallelism(unsigned max_threads)
+{
+    atomic_store(&pool.max_parallelism, max_threads);
+}
+
+bool
+bf_submit(struct bf_task *task)
+{
+    bool queued = false;
+
+    task->next = NULL;
+    pthread_mutex_lock(&pool.lock);
+    if (pool.started && !pool.stopping) {
+        if (pool.tasks_tail != NULL) {
+            pool.tasks_tail->next = task;
+        } else {
+            pool.tasks_head = task;
+        }
+        pool.tasks_tail = task;
+        pthread_cond_signal(&pool.work);
+        queued = true;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return queued;
+}
+
+size_t
+bf_parallel_width(void)
+{
+    size_t width = atomic_load_explicit(&pool.num_threads,
+                                        memory_order_relaxed);
+    size_t limit = atomic_load_explicit(&pool.max_parallelism,
+                                        memory_order_relaxed);
+
+    ++width; /* the calling thread does its share */
+    if (limit && width > limit) {
+        width = limit;
+    }
+    return width < BLOWFISH_MAX_THREADS ? width : BLOWFISH_MAX_THREADS;
+}
+
+size_t
+bf_parallel_chunks(size_t len, size_t granule)
+{
+    size_t chunks;
+
+    if (len < atomic_load_explicit(&pool.threshold, memory_order_relaxed)) {
+        return 1;
+    }
+    chunks = bf_parallel_width();
+    if (chunks > len / granule) {
+        chunks = len / granule;
+    }
+    return chunks ? chunks : 1;
+}
+
+void
+bf_parallel_for(bf_task_function fn, void *arg, size_t count)
+{
+    struct parallel_job job;
+
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.active = 0;
+    atomic_init(&job.next_index, 0);
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.started && !pool.stopping) {
+        job.next = pool.queue;
+        pool.queue = &job;
+        pthread_cond_broadcast(&pool.work);
+    } else {
+        job.next = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    run_indices(&job);
+
+    pthread_mutex_lock(&pool.lock);
+    dequeue(&job);
+    while (job.active) {
+        pthread_cond_wait(&pool.idle, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -29,10 +29,13 @@
  * http://www.schneier.com/paper-blowfish-fse.html
  */
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "blowfish-internal.h"
 #include "blowfish-tables.h"
 #include "blowfish.h"
 
@@ -49,13 +52,23 @@ char const *MODE_STRING[] = {
     "CBC", "CFB", "CTR", "ECB", "OFB",
 };
 
-static void
-default_error_func(void *context, char const *fmt, ...)
+void
+bf_default_error(void *context, char const *fmt, ...)
 {
     (void)context;
     (void)fmt;
 }
 
+void
+blowfish_error_to_buffer(void *buffer, char const *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf((char *)buffer, BLOWFISH_ERROR_SIZE, fmt, ap);
+    va_end(ap);
+}
+
 static inline uint32_t
 bytes_to_word(uint8_t const *in)
 {
@@ -72,118 +85,388 @@ word_to_bytes(uint32_t word, uint8_t *out)
 }
 
 static inline void
-inline_encrypt(blowfish_state *self, uint32_t *pxL, uint32_t *pxR)
+inline_encrypt(blowfish_schedule const *ks, uint32_t *pxL, uint32_t *pxR)
 {
     uint32_t xL = *pxL;
     uint32_t xR = *pxR;
 
     for (int i = 0; i < 16; ++i) {
-        xL ^= self->P[i];
-        xR ^= F(self->S1[(xL >> 24) & 0xFF], self->S2[(xL >> 16) & 0xFF],
-                self->S3[(xL >> 8) & 0xFF], self->S4[xL & 0xFF]);
+        xL ^= ks->P[i];
+        xR ^= F(ks->S1[(xL >> 24) & 0xFF], ks->S2[(xL >> 16) & 0xFF],
+                ks->S3[(xL >> 8) & 0xFF], ks->S4[xL & 0xFF]);
         SWAP(xL, xR);
     }
     SWAP(xL, xR);
-    xR ^= self->P[16];
-    xL ^= self->P[17];
+    xR ^= ks->P[16];
+    xL ^= ks->P[17];
     *pxL = xL;
     *pxR = xR;
 }
 
 static inline void
-inline_decrypt(blowfish_state *self, uint32_t *pxL, uint32_t *pxR)
+inline_decrypt(blowfish_schedule const *ks, uint32_t *pxL, uint32_t *pxR)
 {
     uint32_t xL = *pxL;
     uint32_t xR = *pxR;
 
-    xL ^= self->P[17];
-    xR ^= self->P[16];
+    xL ^= ks->P[17];
+    xR ^= ks->P[16];
     SWAP(xL, xR);
 
     for (int i = 15; i >= 0; --i) {
         SWAP(xL, xR);
-        xR ^= F(self->S1[(xL >> 24) & 0xFF], self->S2[(xL >> 16) & 0xFF],
-                self->S3[(xL >> 8) & 0xFF], self->S4[xL & 0xFF]);
-        xL ^= self->P[i];
+        xR ^= F(ks->S1[(xL >> 24) & 0xFF], ks->S2[(xL >> 16) & 0xFF],
+                ks->S3[(xL >> 8) & 0xFF], ks->S4[xL & 0xFF]);
+        xL ^= ks->P[i];
     }
     *pxL = xL;
     *pxR = xR;
 }
 
 /* Encrypts 8 bytes from `in` to `out` */
-static void
-block_encrypt(blowfish_state *self, uint8_t const *in, uint8_t *out)
+static inline void
+block_encrypt(blowfish_schedule const *ks, uint8_t const *in, uint8_t *out)
 {
     uint32_t xL = bytes_to_word(in);
     uint32_t xR = bytes_to_word(in + 4);
-    inline_encrypt(self, &xL, &xR);
+    inline_encrypt(ks, &xL, &xR);
     word_to_bytes(xL, out);
     word_to_bytes(xR, out + 4);
 }
 
-static void
-block_decrypt(blowfish_state *self, uint8_t const *in, uint8_t *out)
+static inline void
+block_decrypt(blowfish_schedule const *ks, uint8_t const *in, uint8_t *out)
 {
     uint32_t xL = bytes_to_word(in);
     uint32_t xR = bytes_to_word(in + 4);
-    inline_decrypt(self, &xL, &xR);
+    inline_decrypt(ks, &xL, &xR);
     word_to_bytes(xL, out);
     word_to_bytes(xR, out + 4);
 }
 
 /*
- * Verify and remove PKCS#7 padding from a plaintext blob.
+ * Mode kernels.  Each one processes `len` bytes that are a multiple of
+ * the mode's unit, updates the chaining value in `iv`, and is safe to
+ * call with `in == out`.
+ */
+static void
+ecb_encrypt(blowfish_schedule const *ks, uint8_t const *in, uint8_t *out,
+            size_t len)
+{
+    for (size_t i = 0; i < len; i += BLOWFISH_BLOCK_SIZE) {
+        block_encrypt(ks, in + i, out + i);
+    }
+}
+
+static void
+ecb_decrypt(blowfish_schedule const *ks, uint8_t const *in, uint8_t *out,
+            size_t len)
+{
+    for (size_t i = 0; i < len; i += BLOWFISH_BLOCK_SIZE) {
+        block_decrypt(ks, in + i, out + i);
+    }
+}
+
+static void
+cbc_encrypt(blowfish_schedule const *ks, uint8_t *iv, uint8_t const *in,
+            uint8_t *out, size_t len)
+{
+    uint8_t temp[BLOWFISH_BLOCK_SIZE];
+
+    for (size_t i = 0; i < len; i += BLOWFISH_BLOCK_SIZE) {
+        for (size_t j = 0; j < BLOWFISH_BLOCK_SIZE; ++j) {
+            temp[j] = in[i + j] ^ iv[j];
+        }
+        block_encrypt(ks, temp, iv);
+        memcpy(out + i, iv, BLOWFISH_BLOCK_SIZE);
+    }
+}
+
+static void
+cbc_decrypt(blowfish_schedule const *ks, uint8_t *iv, uint8_t const *in,
+            uint8_t *out, size_t len)
+{
+    uint8_t temp[BLOWFISH_BLOCK_SIZE];
+    uint8_t cipher[BLOWFISH_BLOCK_SIZE];
+
+    for (size_t i = 0; i < len; i += BLOWFISH_BLOCK_SIZE) {
+        memcpy(cipher, in + i, BLOWFISH_BLOCK_SIZE);
+        block_decrypt(ks, cipher, temp);
+        for (size_t j = 0; j < BLOWFISH_BLOCK_SIZE; ++j) {
+            out[i + j] = temp[j] ^ iv[j];
+        }
+        memcpy(iv, cipher, BLOWFISH_BLOCK_SIZE);
+    }
+}
+
+/* shifts `segment` bytes of ciphertext into the CFB feedback register */
+static inline void
+cfb_shift(uint8_t *iv, uint8_t const *cipher, size_t segment)
+{
+    if (segment == BLOWFISH_BLOCK_SIZE) {
+        memcpy(iv, cipher, BLOWFISH_BLOCK_SIZE);
+    } else {
+        memmove(iv, iv + segment, BLOWFISH_BLOCK_SIZE - segment);
+        memcpy(iv + BLOWFISH_BLOCK_SIZE - segment, cipher, segment);
+    }
+}
+
+static void
+cfb_encrypt(blowfish_schedule const *ks, uint8_t *iv, size_t segment,
+            uint8_t const *in, uint8_t *out, size_t len)
+{
+    uint8_t temp[BLOWFISH_BLOCK_SIZE];
+
+    for (size_t i = 0; i < len; i += segment) {
+        block_encrypt(ks, iv, temp);
+        for (size_t j = 0; j < segment; ++j) {
+            out[i + j] = in[i + j] ^ temp[j];
+        }
+        cfb_shift(iv, out + i, segment);
+    }
+}
+
+static void
+cfb_decrypt(blowfish_schedule const *ks, uint8_t *iv, size_t segment,
+            uint8_t const *in, uint8_t *out, size_t len)
+{
+    uint8_t temp[BLOWFISH_BLOCK_SIZE];
+    uint8_t cipher[BLOWFISH_BLOCK_SIZE];
+
+    for (size_t i = 0; i < len; i += segment) {
+        block_encrypt(ks, iv, temp);
+        memcpy(cipher, in + i, segment);
+        for (size_t j = 0; j < segment; ++j) {
+            out[i + j] = cipher[j] ^ temp[j];
+        }
+        cfb_shift(iv, cipher, segment);
+    }
+}
+
+/* OFB is symmetric and keeps a partially used keystream block in `iv` */
+static void
+ofb_crypt(blowfish_state *self, uint8_t const *in, uint8_t *out, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        if (self->count == BLOWFISH_BLOCK_SIZE) {
+            block_encrypt(self->ks, self->iv, self->iv);
+            self->count = 0;
+        }
+        out[i] = in[i] ^ self->iv[self->count++];
+    }
+}
+
+/*
+ * Splits a long message into chunks for the thread pool.  Chunk
+ * boundaries fall on whole blocks (and whole CFB segments) so every chunk
+ * can start from the ciphertext that precedes it.  Chaining values are
+ * captured before any chunk runs since `in` and `out` may overlap.
+ */
+struct chunk_job {
+    blowfish_state const *self;
+    bool encrypt;
+    uint8_t const *in;
+    uint8_t *out;
+    size_t len;
+    size_t chunk_size;
+    uint8_t chain[BLOWFISH_MAX_THREADS][BLOWFISH_BLOCK_SIZE];
+};
+
+static void
+run_chunk(void *arg, size_t index)
+{
+    struct chunk_job *job = (struct chunk_job *)arg;
+    blowfish_schedule const *ks = job->self->ks;
+    size_t offset = index * job->chunk_size;
+    size_t len = job->len - offset;
+    uint8_t *iv = job->chain[index];
+
+    if (len > job->chunk_size) {
+        len = job->chunk_size;
+    }
+    switch (job->self->mode) {
+    case MODE_CBC:
+        cbc_decrypt(ks, iv, job->in + offset, job->out + offset, len);
+        break;
+    case MODE_CFB:
+        cfb_decrypt(ks, iv, job->self->segment_size / 8, job->in + offset,
+                    job->out + offset, len);
+        break;
+    case MODE_ECB:
+        if (job->encrypt) {
+            ecb_encrypt(ks, job->in + offset, job->out + offset, len);
+        } else {
+            ecb_decrypt(ks, job->in + offset, job->out + offset, len);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static bool
+process_parallel(blowfish_state *self, bool encrypt, uint8_t const *in,
+                 uint8_t *out, size_t len)
+{
+    size_t granule = BLOWFISH_BLOCK_SIZE;
+    size_t chunks;
+    struct chunk_job job;
+
+    if (self->mode == MODE_CFB) {
+        granule *= self->segment_size / 8;
+    }
+    chunks = bf_parallel_chunks(len, granule);
+    if (chunks < 2) {
+        return false;
+    }
+
+    job.self = self;
+    job.encrypt = encrypt;
+    job.in = in;
+    job.out = out;
+    job.len = len;
+    job.chunk_size = ((len / granule + chunks - 1) / chunks) * granule;
+    chunks = (len + job.chunk_size - 1) / job.chunk_size;
+
+    if (self->mode != MODE_ECB) {
+        memcpy(job.chain[0], self->iv, BLOWFISH_BLOCK_SIZE);
+        for (size_t i = 1; i < chunks; ++i) {
+            memcpy(job.chain[i],
+                   in + (i * job.chunk_size) - BLOWFISH_BLOCK_SIZE,
+                   BLOWFISH_BLOCK_SIZE);
+        }
+        if (self->mode == MODE_CBC) {
+            memcpy(self->old_cipher, in + len - 2 * BLOWFISH_BLOCK_SIZE,
+                   BLOWFISH_BLOCK_SIZE);
+        }
+        /* the feedback register ends up holding the last ciphertext block */
+        memcpy(self->iv, in + len - BLOWFISH_BLOCK_SIZE, BLOWFISH_BLOCK_SIZE);
+    }
+
+    bf_parallel_for(&run_chunk, &job, chunks);
+    return true;
+}
+
+/* Encrypts whole units of the context's mode from `in` into `out` */
+static void
+encrypt_units(blowfish_state *self, uint8_t const *in, uint8_t *out,
+              size_t len)
+{
+    switch (self->mode) {
+    case MODE_CBC:
+        cbc_encrypt(self->ks, self->iv, in, out, len);
+        break;
+    case MODE_CFB:
+        cfb_encrypt(self->ks, self->iv, self->segment_size / 8, in, out, len);
+        break;
+    case MODE_ECB:
+        if (!process_parallel(self, true, in, out, len)) {
+            ecb_encrypt(self->ks, in, out, len);
+        }
+        break;
+    case MODE_OFB:
+        ofb_crypt(self, in, out, len);
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+decrypt_units(blowfish_state *self, uint8_t const *in, uint8_t *out,
+              size_t len)
+{
+    if (self->mode == MODE_OFB) {
+        ofb_crypt(self, in, out, len);
+        return;
+    }
+    if (process_parallel(self, false, in, out, len)) {
+        return;
+    }
+    switch (self->mode) {
+    case MODE_CBC:
+        if (len > BLOWFISH_BLOCK_SIZE) {
+            memcpy(self->old_cipher, in + len - 2 * BLOWFISH_BLOCK_SIZE,
+                   BLOWFISH_BLOCK_SIZE);
+        } else {
+            memcpy(self->old_cipher, self->iv, BLOWFISH_BLOCK_SIZE);
+        }
+        cbc_decrypt(self->ks, self->iv, in, out, len);
+        break;
+    case MODE_CFB:
+        cfb_decrypt(self->ks, self->iv, self->segment_size / 8, in, out, len);
+        break;
+    case MODE_ECB:
+        ecb_decrypt(self->ks, in, out, len);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Returns the number of bytes the mode processes at a time */
+static size_t
+unit_size(blowfish_state const *self)
+{
+    switch (self->mode) {
+    case MODE_CBC:
+    case MODE_ECB:
+        return BLOWFISH_BLOCK_SIZE;
+    case MODE_CFB:
+        return self->segment_size / 8;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Verify PKCS#7 padding on a plaintext blob.
  *
  * @param self - blowfish decryption state
- * @param plaintext - pointer to the decrypted plaintext buffer, unchanged
- *                    if padding is correct; DEALLOCATED and set to NULL
- *                    when padding is not correct
+ * @param plaintext - pointer to the decrypted plaintext buffer
  * @param plaintext_len - the length of the padded buffer on input,
  *                        the unpadded length upon return
  * @param on_error - function to call to report an error
  * @param error_context - error context to pass along
+ * @return false if the padding is not correct
  */
-static void
-unpad(blowfish_state const *self, uint8_t **plaintext, size_t *plaintext_len,
-      error_function on_error, void *error_context)
+static bool
+unpad(blowfish_state const *self, uint8_t const *plaintext,
+      size_t *plaintext_len, error_function on_error, void *error_context)
 {
     if (self->pkcs7padding) {
-        uint8_t *cipher = *plaintext;
         size_t cipher_len = *plaintext_len;
-        uint8_t padding_length = cipher[cipher_len - 1];
-        if (padding_length >= cipher_len) {
-            free(cipher);
-            *plaintext = NULL;
-            *plaintext_len = 0;
+        uint8_t padding_length = plaintext[cipher_len - 1];
+        if (padding_length == 0 || padding_length > unit_size(self)
+            || padding_length > cipher_len)
+        {
             on_error(error_context, "Invalid PKCS padding value %02x",
                      padding_length);
-        } else {
-            *plaintext_len -= padding_length;
-            for (uint8_t *byte_ptr = &cipher[cipher_len - padding_length],
-                         *end_ptr = &cipher[cipher_len - 1];
-                 byte_ptr != end_ptr; ++byte_ptr)
-            {
-                if (*byte_ptr != padding_length) {
-                    uint8_t wrong_byte = *byte_ptr;
-                    size_t offset = byte_ptr - cipher;
-                    free(cipher);
-                    *plaintext = NULL;
-                    *plaintext_len = 0;
-                    on_error(error_context,
-                             "Invalid PKCS padding value at offset %u, "
-                             "expected %02x, found %02x",
-                             offset, padding_length, wrong_byte);
-                    break;
-                }
+            bf_stats_padding_failure();
+            return false;
+        }
+        for (uint8_t const *byte_ptr = &plaintext[cipher_len - padding_length],
+                           *end_ptr = &plaintext[cipher_len - 1];
+             byte_ptr != end_ptr; ++byte_ptr)
+        {
+            if (*byte_ptr != padding_length) {
+                on_error(error_context,
+                         "Invalid PKCS padding value at offset %d, "
+                         "expected %02x, found %02x",
+                         (int)(byte_ptr - plaintext), padding_length,
+                         *byte_ptr);
+                bf_stats_padding_failure();
+                return false;
             }
         }
+        *plaintext_len -= padding_length;
     }
+    return true;
 }
 
-static bool
-verify_params(uint8_t const *key, size_t key_len, uint8_t const *iv,
-              size_t iv_len, blowfish_mode mode, int *segment_size,
-              error_function err, void *err_context)
+bool
+bf_verify_key(uint8_t const *key, size_t key_len, error_function err,
+              void *err_context)
 {
     if (!key_len || !key) {
         err(err_context, "key must be specified");
@@ -193,7 +476,13 @@ verify_params(uint8_t const *key, size_t key_len, uint8_t const *iv,
         err(err_context, "key length must be between 4 and 56 bytes");
         return false;
     }
+    return true;
+}
 
+static bool
+verify_mode(uint8_t const *iv, size_t iv_len, blowfish_mode mode,
+            int *segment_size, error_function err, void *err_context)
+{
     switch (mode) {
     case MODE_CBC:
         if (iv == NULL || iv_len != BLOWFISH_BLOCK_SIZE) {
@@ -262,14 +551,14 @@ blowfish_new(uint8_t const *key, size_t key_len, uint8_t const *iv,
     blowfish_state *self;
 
     if (on_error == NULL) {
-        on_error = &default_error_func;
+        on_error = &bf_default_error;
     }
-    self = (blowfish_state *)malloc(sizeof(*self));
+    self = bf_state_alloc();
     if (self != NULL) {
         if (!blowfish_init(self, key, key_len, iv, iv_len, mode, segment_size,
                            on_error, error_context))
         {
-            free(self);
+            bf_state_release(self);
             self = NULL;
         }
     }
@@ -281,23 +570,17 @@ void
 blowfish_free(blowfish_state *self)
 {
     if (self != NULL) {
-        free(self);
+        bf_state_release(self);
     }
 }
 
-bool
-blowfish_init(blowfish_state *self, uint8_t const *key, size_t key_len,
-              uint8_t const *iv, size_t iv_len, blowfish_mode mode,
-              int segment_size, error_function on_error, void *error_context)
+static bool
+init_mode(blowfish_state *self, uint8_t const *iv, size_t iv_len,
+          blowfish_mode mode, int segment_size, error_function on_error,
+          void *error_context)
 {
-    uint32_t word = 0;
-    uint32_t xL, xR;
-
-    if (on_error == NULL) {
-        on_error = &default_error_func;
-    }
-    if (!verify_params(key, key_len, iv, iv_len, mode, &segment_size, on_error,
-                       error_context))
+    if (!verify_mode(iv, iv_len, mode, &segment_size, on_error,
+                     error_context))
     {
         return false;
     }
@@ -306,41 +589,90 @@ blowfish_init(blowfish_state *self, uint8_t const *key, size_t key_len,
     self->pkcs7padding = true;
     self->segment_size = segment_size;
     self->count = BLOWFISH_BLOCK_SIZE;
+    blowfish_set_context_allocator(self, NULL, NULL);
     if (iv) {
         memcpy(&self->iv[0], iv, sizeof(self->iv));
         memcpy(&self->initial_iv[0], iv, sizeof(self->initial_iv));
     }
     memset(&self->old_cipher, 0, BLOWFISH_BLOCK_SIZE);
+    return true;
+}
+
+void
+bf_expand_key(blowfish_schedule *ks, uint8_t const *key, size_t key_len)
+{
+    uint64_t start = bf_stats_clock();
+    uint32_t word = 0;
+    uint32_t xL, xR;
 
     for (int i = 0; i < (18 * 4); ++i) {
         word = (word << 8) | key[i % key_len];
         if ((i & 3) == 3) {
-            self->P[i >> 2] = initial_P[i >> 2] ^ word;
+            ks->P[i >> 2] = initial_P[i >> 2] ^ word;
             word = 0;
         }
     }
 
-    memcpy(&self->S1[0], initial_S1, 256 * sizeof(uint32_t));
-    memcpy(&self->S2[0], initial_S2, 256 * sizeof(uint32_t));
-    memcpy(&self->S3[0], initial_S3, 256 * sizeof(uint32_t));
-    memcpy(&self->S4[0], initial_S4, 256 * sizeof(uint32_t));
+    memcpy(&ks->S1[0], initial_S1, 256 * sizeof(uint32_t));
+    memcpy(&ks->S2[0], initial_S2, 256 * sizeof(uint32_t));
+    memcpy(&ks->S3[0], initial_S3, 256 * sizeof(uint32_t));
+    memcpy(&ks->S4[0], initial_S4, 256 * sizeof(uint32_t));
 
     xL = xR = 0;
 #define initialize(ary)                                                        \
     do {                                                                       \
         for (size_t i = 0; i < NUM_ELEMENTS(ary); i += 2) {                    \
-            inline_encrypt(self, &xL, &xR);                                    \
+            inline_encrypt(ks, &xL, &xR);                                      \
             ary[i] = xL;                                                       \
             ary[i + 1] = xR;                                                   \
         }                                                                      \
     } while (0)
 
-    initialize(self->P);
-    initialize(self->S1);
-    initialize(self->S2);
-    initialize(self->S3);
-    initialize(self->S4);
+    initialize(ks->P);
+    initialize(ks->S1);
+    initialize(ks->S2);
+    initialize(ks->S3);
+    initialize(ks->S4);
+    bf_stats_key_expansion(start);
+}
 
+bool
+blowfish_init(blowfish_state *self, uint8_t const *key, size_t key_len,
+              uint8_t const *iv, size_t iv_len, blowfish_mode mode,
+              int segment_size, error_function on_error, void *error_context)
+{
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    if (!bf_verify_key(key, key_len, on_error, error_context)
+        || !init_mode(self, iv, iv_len, mode, segment_size, on_error,
+                      error_context))
+    {
+        return false;
+    }
+
+    bf_expand_key(&self->schedule, key, key_len);
+    self->ks = &self->schedule;
+    return true;
+}
+
+bool
+blowfish_init_with_schedule(blowfish_state *self,
+                            blowfish_schedule const *schedule,
+                            uint8_t const *iv, size_t iv_len,
+                            blowfish_mode mode, int segment_size,
+                            error_function on_error, void *error_context)
+{
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    if (!init_mode(self, iv, iv_len, mode, segment_size, on_error,
+                   error_context))
+    {
+        return false;
+    }
+
+    self->ks = schedule;
     return true;
 }
 
@@ -351,240 +683,393 @@ blowfish_reset(blowfish_state *self)
     self->count = BLOWFISH_BLOCK_SIZE;
 }
 
-uint8_t *
-blowfish_encrypt(blowfish_state *self, uint8_t const *msg, size_t msg_len,
-                 size_t *out_len, error_function on_error, void *error_context)
+bool
+blowfish_set_iv(blowfish_state *self, uint8_t const *iv, size_t iv_len,
+                error_function on_error, void *error_context)
 {
-#define advance(ptr, offset)                                                   \
-    do {                                                                       \
-        ptr = ((offset + 1) == msg_len) ? &padding[0] : ptr + 1;               \
-    } while (0)
-
-    uint8_t padding[BLOWFISH_BLOCK_SIZE];
-    size_t pad_len = 0;
-    uint8_t temp[BLOWFISH_BLOCK_SIZE];
-    size_t i, j;
-    uint8_t const *in_ptr;
-    uint8_t *out_buf;
+    int segment_size = (int)self->segment_size;
 
     if (on_error == NULL) {
-        on_error = &default_error_func;
+        on_error = &bf_default_error;
     }
-
-    *out_len = 0;
-    if (msg_len == 0) {
-        return NULL;
+    if (!verify_mode(iv, iv_len, self->mode, &segment_size, on_error,
+                     error_context))
+    {
+        return false;
+    }
+    if (iv) {
+        memcpy(&self->initial_iv[0], iv, sizeof(self->initial_iv));
     }
+    memset(&self->old_cipher, 0, BLOWFISH_BLOCK_SIZE);
+    blowfish_reset(self);
+    return true;
+}
 
+/* Checks that the context can encrypt `msg_len` bytes and sizes the pad */
+static bool
+plan_encrypt(blowfish_state const *self, size_t msg_len, size_t *pad_len,
+             error_function on_error, void *error_context)
+{
+    size_t unit = unit_size(self);
+
+    *pad_len = 0;
+    if (self->mode == MODE_CTR
+        || (size_t)self->mode >= NUM_ELEMENTS(MODE_STRING))
+    {
+        on_error(error_context, "mode %d is not implemented", self->mode);
+        return false;
+    }
     if (self->pkcs7padding) {
-        if (self->mode == MODE_CBC || self->mode == MODE_ECB) {
-            pad_len = BLOWFISH_BLOCK_SIZE - (msg_len % BLOWFISH_BLOCK_SIZE);
-            memset(&padding[0], pad_len, sizeof(padding));
-        } else if (self->mode == MODE_CFB) {
-            uint8_t segment_byte_size = (self->segment_size / 8);
-            pad_len = (segment_byte_size - (msg_len % segment_byte_size));
+        if (self->mode != MODE_OFB) { /* stream mode, nothing to pad */
+            *pad_len = unit - (msg_len % unit);
         }
-    } else {
-        if ((self->mode == MODE_CBC || self->mode == MODE_ECB)
-            && (msg_len % BLOWFISH_BLOCK_SIZE))
-        {
+    } else if (msg_len % unit) {
+        if (self->mode == MODE_CFB) {
+            on_error(error_context,
+                     "CFB mode requires input strings multiple of %d bytes",
+                     (int)unit);
+        } else {
             on_error(error_context,
                      "%s mode requires input multiple of %d bytes",
                      MODE_STRING[self->mode], BLOWFISH_BLOCK_SIZE);
-            return NULL;
-        }
-        if (self->mode == MODE_CFB && (msg_len % (self->segment_size / 8))) {
-            on_error(error_context,
-                     "CFB mode requires input strings multiple of %d bytes",
-                     self->segment_size / 8);
-            return NULL;
         }
+        return false;
     }
-    memset(&padding[0], pad_len, sizeof(padding));
+    return true;
+}
 
-    out_buf = (uint8_t *)malloc(msg_len + pad_len);
-    if (out_buf == NULL) {
-        on_error(error_context, "failed to allocate buffer of %d bytes",
-                 msg_len + pad_len);
-        return NULL;
+size_t
+blowfish_encrypted_size(blowfish_state const *self, size_t msg_len)
+{
+    size_t pad_len;
+    if (!plan_encrypt(self, msg_len, &pad_len, &bf_default_error, NULL)) {
+        return 0;
     }
-    *out_len = msg_len + pad_len;
+    return msg_len + pad_len;
+}
 
-    switch (self->mode) {
-    case MODE_CBC:
-        in_ptr = msg;
-        for (i = 0; i < *out_len; i += BLOWFISH_BLOCK_SIZE) {
-            for (j = 0; j < BLOWFISH_BLOCK_SIZE; ++j) {
-                temp[j] = *in_ptr ^ self->iv[j];
-                advance(in_ptr, i + j);
-            }
-            block_encrypt(self, temp, out_buf + i);
-            memcpy(self->iv, out_buf + i, BLOWFISH_BLOCK_SIZE);
-        }
-        break;
-    case MODE_CFB:
-        in_ptr = msg;
-        for (i = 0; i < *out_len; i += self->segment_size / 8) {
-            block_encrypt(self, self->iv, temp);
-            for (j = 0; j < self->segment_size / 8; j++) {
-                out_buf[i + j] = *in_ptr ^ temp[j];
-                advance(in_ptr, i + j);
-            }
+bool
+blowfish_encrypt_into(blowfish_state *self, uint8_t const *msg,
+                      size_t msg_len, uint8_t *out, size_t out_size,
+                      size_t *out_len, error_function on_error,
+                      void *error_context)
+{
+    uint64_t start = bf_stats_clock();
+    uint8_t tail[BLOWFISH_BLOCK_SIZE];
+    size_t unit = unit_size(self);
+    size_t body_len, pad_len;
 
-            if (self->segment_size == (BLOWFISH_BLOCK_SIZE * 8)) {
-                memcpy(self->iv, out_buf + i, BLOWFISH_BLOCK_SIZE);
-            } else if ((self->segment_size % 8) == 0) {
-                size_t sz = self->segment_size / 8;
-                memmove(self->iv, self->iv + sz, BLOWFISH_BLOCK_SIZE - sz);
-                memcpy(self->iv + BLOWFISH_BLOCK_SIZE - sz, out_buf + i, sz);
-            } else {
-                /* should not happen! */
-            }
-        }
-        break;
-    case MODE_ECB:
-        for (i = 0; i < (msg_len / BLOWFISH_BLOCK_SIZE) * BLOWFISH_BLOCK_SIZE;
-             i += BLOWFISH_BLOCK_SIZE)
-        {
-            block_encrypt(self, msg + i, out_buf + i);
-        }
-        if (self->pkcs7padding) {
-            size_t remaining = msg_len % BLOWFISH_BLOCK_SIZE;
-            memcpy(&temp[0], msg + i, remaining);
-            memset(&temp[remaining], sizeof(temp) - remaining, pad_len);
-            block_encrypt(self, &temp[0], out_buf + i);
-        }
-        break;
-    case MODE_OFB:
-        i = 0;
-        while (i < msg_len) {
-            if ((msg_len - i) <= (BLOWFISH_BLOCK_SIZE - self->count)) {
-                for (j = 0; j < (msg_len - i); ++j) {
-                    out_buf[i + j] = self->iv[self->count + j] ^ msg[i + j];
-                }
-                self->count += msg_len - i;
-                i = msg_len;
-                continue;
-            }
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
 
-            for (j = 0; j < BLOWFISH_BLOCK_SIZE - self->count; ++j) {
-                out_buf[i + j] = self->iv[self->count + j] ^ msg[i + j];
-            }
-            i += BLOWFISH_BLOCK_SIZE - self->count;
-            self->count = BLOWFISH_BLOCK_SIZE;
+    *out_len = 0;
+    if (!plan_encrypt(self, msg_len, &pad_len, on_error, error_context)) {
+        return false;
+    }
+    if (out_size < msg_len + pad_len) {
+        on_error(error_context,
+                 "output buffer of %d bytes is too small, %d required",
+                 (int)out_size, (int)(msg_len + pad_len));
+        return false;
+    }
+    *out_len = msg_len + pad_len;
 
-            block_encrypt(self, self->iv, temp);
-            memcpy(self->iv, temp, BLOWFISH_BLOCK_SIZE);
-            self->count = 0;
-        }
-        break;
-    case MODE_CTR:
-    default:
-        on_error(error_context, "mode %d is not implemented", self->mode);
-        free(out_buf);
-        *out_len = 0;
-        return NULL;
+    /* the final unit holds whatever is left of the message plus padding */
+    body_len = msg_len;
+    if (pad_len) {
+        size_t remaining = msg_len % unit;
+        body_len -= remaining;
+        memcpy(tail, msg + body_len, remaining);
+        memset(tail + remaining, (int)pad_len, pad_len);
     }
-    return out_buf;
+    encrypt_units(self, msg, out, body_len);
+    if (pad_len) {
+        encrypt_units(self, tail, out + body_len, unit);
+    }
+    bf_stats_crypt(self->mode, true, msg_len, start);
+    return true;
 }
 
 uint8_t *
-blowfish_decrypt(blowfish_state *self, uint8_t const *msg, size_t msg_len,
+blowfish_encrypt(blowfish_state *self, uint8_t const *msg, size_t msg_len,
                  size_t *out_len, error_function on_error, void *error_context)
 {
-    uint8_t *out_buf = NULL;
-    size_t i, j;
-    uint8_t temp[BLOWFISH_BLOCK_SIZE];
+    size_t pad_len;
+    uint8_t *out_buf;
 
     if (on_error == NULL) {
-        on_error = &default_error_func;
+        on_error = &bf_default_error;
     }
 
     *out_len = 0;
-    if (msg_len == 0) {
+    if (msg_len == 0
+        || !plan_encrypt(self, msg_len, &pad_len, on_error, error_context))
+    {
         return NULL;
     }
 
-    if (self->mode == MODE_CTR || self->mode == MODE_OFB) {
-        /* these are symmetric so reuse the encryption bits */
-        return blowfish_encrypt(self, msg, msg_len, out_len, on_error,
-                                error_context);
+    out_buf = bf_buffer_alloc(self, msg_len + pad_len);
+    if (out_buf == NULL) {
+        on_error(error_context, "failed to allocate buffer of %d bytes",
+                 msg_len + pad_len);
+        return NULL;
     }
+    blowfish_encrypt_into(self, msg, msg_len, out_buf, msg_len + pad_len,
+                          out_len, on_error, error_context);
+    return out_buf;
+}
 
-    if (!self->pkcs7padding) {
-        if ((self->mode == MODE_CBC || self->mode == MODE_ECB)
-            && (msg_len % BLOWFISH_BLOCK_SIZE))
-        {
-            on_error(error_context,
-                     "Ciphertext must be a multiple of block size");
-            return NULL;
-        }
+bool
+blowfish_decrypt_into(blowfish_state *self, uint8_t const *msg,
+                      size_t msg_len, uint8_t *out, size_t out_size,
+                      size_t *out_len, error_function on_error,
+                      void *error_context)
+{
+    uint64_t start = bf_stats_clock();
+    size_t unit;
+
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
 
-        if (self->mode == MODE_CFB && (msg_len % (self->segment_size / 8))) {
+    *out_len = 0;
+    if (self->mode == MODE_CTR
+        || (size_t)self->mode >= NUM_ELEMENTS(MODE_STRING))
+    {
+        on_error(error_context, "Unimplemented mode");
+        return false;
+    }
+
+    /* padded or not, block modes cannot decrypt a partial unit */
+    unit = unit_size(self);
+    if (msg_len % unit) {
+        if (self->mode == MODE_CFB) {
             on_error(error_context,
                      "Ciphertext must be a multiple of segment "
                      "size %d in length",
-                     (self->segment_size / 8));
-            return NULL;
+                     (int)unit);
+        } else {
+            on_error(error_context,
+                     "Ciphertext must be a multiple of block size");
         }
+        return false;
     }
+    if (out_size < msg_len) {
+        on_error(error_context,
+                 "output buffer of %d bytes is too small, %d required",
+                 (int)out_size, (int)msg_len);
+        return false;
+    }
+    if (msg_len > 0) {
+        decrypt_units(self, msg, out, msg_len);
+        *out_len = msg_len;
+        if (self->mode != MODE_OFB
+            && !unpad(self, out, out_len, on_error, error_context))
+        {
+            *out_len = 0;
+            return false;
+        }
+    }
+    bf_stats_crypt(self->mode, false, msg_len, start);
+    return true;
+}
 
-    if (!(out_buf = (uint8_t *)malloc(msg_len))) {
+uint8_t *
+blowfish_decrypt(blowfish_state *self, uint8_t const *msg, size_t msg_len,
+                 size_t *out_len, error_function on_error, void *error_context)
+{
+    uint8_t *out_buf;
+
+    *out_len = 0;
+    if (msg_len == 0) {
+        return NULL;
+    }
+    if (!(out_buf = bf_buffer_alloc(self, msg_len))) {
         return NULL;
     }
-    *out_len = msg_len;
+    if (!blowfish_decrypt_into(self, msg, msg_len, out_buf, msg_len, out_len,
+                               on_error, error_context))
+    {
+        blowfish_release(out_buf);
+        out_buf = NULL;
+    }
+    return out_buf;
+}
 
-    switch (self->mode) {
-    case MODE_CBC:
-        for (i = 0; i < msg_len; i += BLOWFISH_BLOCK_SIZE) {
-            memcpy(self->old_cipher, self->iv, BLOWFISH_BLOCK_SIZE);
-            block_decrypt(self, msg + i, &temp[0]);
-            for (j = 0; j < BLOWFISH_BLOCK_SIZE; ++j) {
-                out_buf[i + j] = temp[j] ^ self->iv[j];
-                self->iv[j] = msg[i + j];
-            }
-        }
-        unpad(self, &out_buf, out_len, on_error, error_context);
-        break;
+/* Decryption with padding keeps the final unit until the stream finishes */
+static bool
+holds_back(blowfish_stream const *stream)
+{
+    return !stream->encrypt && stream->context->pkcs7padding
+        && stream->context->mode != MODE_OFB;
+}
 
-    case MODE_CFB:
-        for (i = 0; i < msg_len; i += (self->segment_size / 8)) {
-            block_encrypt(self, &self->iv[0], &temp[0]);
-            for (j = 0; j < self->segment_size / 8; ++j) {
-                out_buf[i + j] = msg[i + j] ^ temp[j];
-            }
-            if (self->segment_size == (BLOWFISH_BLOCK_SIZE * 8)) {
-                memcpy(&self->iv[0], &msg[i], BLOWFISH_BLOCK_SIZE);
-            } else if ((self->segment_size % 8) == 0) {
-                size_t sz = self->segment_size / 8;
-                memmove(self->iv, &self->iv[sz], BLOWFISH_BLOCK_SIZE - sz);
-                memcpy(&self->iv[BLOWFISH_BLOCK_SIZE - sz], &msg[i], sz);
-            } else {
-                /* cannot happen?! */
-            }
+bool
+blowfish_stream_init(blowfish_stream *stream, blowfish_state *context,
+                     bool encrypt, error_function on_error,
+                     void *error_context)
+{
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    if (context->mode == MODE_CTR
+        || (size_t)context->mode >= NUM_ELEMENTS(MODE_STRING))
+    {
+        on_error(error_context, "mode %d is not implemented", context->mode);
+        return false;
+    }
+
+    stream->context = context;
+    stream->encrypt = encrypt;
+    stream->buffered = 0;
+    return true;
+}
+
+bool
+blowfish_stream_update(blowfish_stream *stream, uint8_t const *in,
+                       size_t len, uint8_t *out, size_t out_size,
+                       size_t *out_len, error_function on_error,
+                       void *error_context)
+{
+    blowfish_state *self = stream->context;
+    size_t unit = unit_size(self);
+    size_t in_len = len; /* len is consumed below */
+    size_t available = stream->buffered + len;
+    size_t keep = available % unit;
+    size_t produce;
+
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+
+    *out_len = 0;
+    if (keep == 0 && available > 0 && holds_back(stream)) {
+        keep = unit;
+    }
+    produce = available - keep;
+    if (out_size < produce) {
+        on_error(error_context,
+                 "output buffer of %d bytes is too small, %d required",
+                 (int)out_size, (int)produce);
+        return false;
+    }
+    *out_len = produce;
+
+    /* complete the buffered unit first, the rest is taken in place */
+    if (produce > 0 && stream->buffered > 0) {
+        size_t fill = unit - stream->buffered;
+        memcpy(stream->buffer + stream->buffered, in, fill);
+        if (stream->encrypt) {
+            encrypt_units(self, stream->buffer, out, unit);
+        } else {
+            decrypt_units(self, stream->buffer, out, unit);
         }
-        unpad(self, &out_buf, out_len, on_error, error_context);
-        break;
+        in += fill;
+        len -= fill;
+        out += unit;
+        produce -= unit;
+        stream->buffered = 0;
+    }
+    if (produce > 0) {
+        if (stream->encrypt) {
+            encrypt_units(self, in, out, produce);
+        } else {
+            decrypt_units(self, in, out, produce);
+        }
+    }
+    memcpy(stream->buffer + stream->buffered, in + produce, len - produce);
+    stream->buffered += len - produce;
+    bf_stats_stream_bytes(self->mode, stream->encrypt, in_len);
+    return true;
+}
 
-    case MODE_ECB:
-        for (i = 0; i < msg_len; i += BLOWFISH_BLOCK_SIZE) {
-            block_decrypt(self, &msg[i], &out_buf[i]);
+static bool
+finish_stream(blowfish_stream *stream, uint8_t *out, size_t out_size,
+              size_t *out_len, error_function on_error, void *error_context)
+{
+    blowfish_state *self = stream->context;
+    size_t unit = unit_size(self);
+    uint8_t last[BLOWFISH_BLOCK_SIZE];
+    size_t buffered = stream->buffered;
+    size_t pad_len;
+
+    *out_len = 0;
+    stream->buffered = 0;
+    if (stream->encrypt && self->pkcs7padding && self->mode != MODE_OFB) {
+        pad_len = unit - buffered;
+        if (out_size < unit) {
+            on_error(error_context,
+                     "output buffer of %d bytes is too small, %d required",
+                     (int)out_size, (int)unit);
+            return false;
         }
-        unpad(self, &out_buf, out_len, on_error, error_context);
-        break;
+        memset(stream->buffer + buffered, (int)pad_len, pad_len);
+        encrypt_units(self, stream->buffer, out, unit);
+        *out_len = unit;
+        return true;
+    }
 
-    case MODE_CTR:
-    case MODE_OFB:
-        /* handled above */
-        break;
+    if (buffered != (holds_back(stream) ? unit : 0)) {
+        if (stream->encrypt) {
+            on_error(error_context,
+                     "%s mode requires input multiple of %d bytes",
+                     MODE_STRING[self->mode], (int)unit);
+        } else {
+            on_error(error_context,
+                     "Ciphertext must be a multiple of %d bytes in length",
+                     (int)unit);
+        }
+        return false;
+    }
+    if (buffered == 0) {
+        return true;
+    }
 
-    default:
-        free(out_buf);
-        out_buf = NULL;
-        *out_len = 0;
-        on_error(error_context, "Unimplemented mode");
-        break;
+    /* the held back unit carries the padding */
+    decrypt_units(self, stream->buffer, last, unit);
+    pad_len = last[unit - 1];
+    if (pad_len == 0 || pad_len > unit) {
+        on_error(error_context, "Invalid PKCS padding value %d",
+                 (int)pad_len);
+        bf_stats_padding_failure();
+        return false;
+    }
+    for (size_t i = unit - pad_len; i < unit - 1; ++i) {
+        if (last[i] != pad_len) {
+            on_error(error_context,
+                     "Invalid PKCS padding value at offset %d, "
+                     "expected %d, found %d",
+                     (int)i, (int)pad_len, (int)last[i]);
+            bf_stats_padding_failure();
+            return false;
+        }
+    }
+    if (out_size < unit - pad_len) {
+        on_error(error_context,
+                 "output buffer of %d bytes is too small, %d required",
+                 (int)out_size, (int)(unit - pad_len));
+        return false;
     }
+    memcpy(out, last, unit - pad_len);
+    *out_len = unit - pad_len;
+    return true;
+}
 
-    return out_buf;
+bool
+blowfish_stream_finish(blowfish_stream *stream, uint8_t *out,
+                       size_t out_size, size_t *out_len,
+                       error_function on_error, void *error_context)
+{
+    if (on_error == NULL) {
+        on_error = &bf_default_error;
+    }
+    if (!finish_stream(stream, out, out_size, out_len, on_error,
+                       error_context))
+    {
+        return false;
+    }
+    /* the message counts once, its bytes were counted by the updates */
+    bf_stats_crypt(stream->context->mode, stream->encrypt, 0, 0);
+    return true;
 }
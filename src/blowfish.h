@@ -2,9 +2,19 @@
 #define BLOWFISH_8BIT_BLOWFISH_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define BLOWFISH_BLOCK_SIZE 8
+#define BLOWFISH_ALIGNMENT 64 /* cache line size */
+#define BLOWFISH_MAX_THREADS 64
+
+/*
+ * Raised when the C API changes incompatibly.  Version 2: buffers from
+ * blowfish_encrypt and blowfish_decrypt are released with
+ * blowfish_release, free() no longer works on them.
+ */
+#define BLOWFISH_API_VERSION 2
 
 typedef enum {
     MODE_CBC, /* implemented */
@@ -14,7 +24,33 @@ typedef enum {
     MODE_OFB, /* implemented */
 } blowfish_mode;
 
+/*
+ * Allocation hook with the same contract as lua_Alloc: a zero `nsize`
+ * releases `ptr`, otherwise a block of `nsize` bytes is returned.
+ */
+typedef void *(*blowfish_alloc_function)(void *ud, void *ptr, size_t osize,
+                                         size_t nsize);
+
+/*
+ * Expanded key.  The S-boxes are the hot path of every round so they
+ * start on a cache line boundary.
+ */
 typedef struct {
+    _Alignas(BLOWFISH_ALIGNMENT) uint32_t S1[256];
+    uint32_t S2[256];
+    uint32_t S3[256];
+    uint32_t S4[256];
+    uint32_t P[18];
+} blowfish_schedule;
+
+/*
+ * The mode fields fill the first cache line and `ks` points at the
+ * schedule in use.  That is the embedded `schedule` unless the context
+ * was bound to a shared schedule, in which case the embedded storage is
+ * never touched and only BLOWFISH_SHARED_STATE_SIZE bytes are required.
+ */
+typedef struct {
+    blowfish_schedule const *ks;
     blowfish_mode mode;
     bool pkcs7padding;
     unsigned int segment_size;
@@ -22,15 +58,23 @@ typedef struct {
     uint8_t iv[BLOWFISH_BLOCK_SIZE];
     uint8_t old_cipher[BLOWFISH_BLOCK_SIZE];
     uint8_t initial_iv[BLOWFISH_BLOCK_SIZE];
-    uint32_t P[18];
-    uint32_t S1[256];
-    uint32_t S2[256];
-    uint32_t S3[256];
-    uint32_t S4[256];
+    blowfish_alloc_function alloc; /* used for output buffers */
+    void *alloc_ud;
+    blowfish_schedule schedule;
 } blowfish_state;
 
+#define BLOWFISH_SHARED_STATE_SIZE offsetof(blowfish_state, schedule)
+
 typedef void (*error_function)(void *, char const *, ...);
 
+/*
+ * error_function that formats the message into the buffer passed as its
+ * context, which must hold BLOWFISH_ERROR_SIZE bytes.  Useful where a
+ * callback cannot be written, such as from the LuaJIT FFI.
+ */
+#define BLOWFISH_ERROR_SIZE 128
+extern void blowfish_error_to_buffer(void *buffer, char const *fmt, ...);
+
 extern blowfish_state *blowfish_new(uint8_t const *key, size_t key_len,
                                     uint8_t const *iv, size_t iv_len,
                                     blowfish_mode mode, int segment_size,
@@ -43,6 +87,114 @@ extern bool blowfish_init(blowfish_state *self, uint8_t const *key,
                           error_function on_error, void *err_context);
 extern void blowfish_reset(blowfish_state *self);
 
+/*
+ * Replaces the initialization vector without expanding the key again.
+ * Chaining starts over from `iv` and blowfish_reset returns to it.
+ */
+extern bool blowfish_set_iv(blowfish_state *self, uint8_t const *iv,
+                            size_t iv_len, error_function on_error,
+                            void *err_context);
+
+/*
+ * Binds a context to an already expanded schedule without copying it.
+ * The schedule must outlive the context.
+ */
+extern bool blowfish_init_with_schedule(blowfish_state *self,
+                                        blowfish_schedule const *schedule,
+                                        uint8_t const *iv, size_t iv_len,
+                                        blowfish_mode mode, int segment_size,
+                                        error_function on_error,
+                                        void *err_context);
+
+/*
+ * Cross-process key schedule cache in POSIX shared memory.  Schedules are
+ * expanded once by whichever process needs them first and every other
+ * process that maps the same `name` binds to them in place.  Lookups are
+ * lock-free and each slot is claimed by exactly one writer.  Schedules
+ * handed out by a cache are valid until it is closed.
+ */
+typedef struct blowfish_cache blowfish_cache;
+
+extern blowfish_cache *blowfish_cache_open(char const *name, size_t slots,
+                                           error_function on_error,
+                                           void *err_context);
+extern void blowfish_cache_close(blowfish_cache *cache);
+extern bool blowfish_cache_unlink(char const *name);
+extern blowfish_schedule const *
+blowfish_cache_acquire(blowfish_cache *cache, uint8_t const *key,
+                       size_t key_len, error_function on_error,
+                       void *err_context);
+extern bool blowfish_init_cached(blowfish_state *self, blowfish_cache *cache,
+                                 uint8_t const *key, size_t key_len,
+                                 uint8_t const *iv, size_t iv_len,
+                                 blowfish_mode mode, int segment_size,
+                                 error_function on_error, void *err_context);
+
+/*
+ * Process-wide named schedules shared by every thread and Lua state.
+ * blowfish_schedule_acquire expands `key` under `name` the first time and
+ * hands the same schedule to later callers with the same key, while
+ * blowfish_schedule_find looks an existing name up without the key.  Each
+ * successful call takes a reference that blowfish_schedule_release drops.
+ * The schedule is wiped and freed with its last reference, so it must
+ * outlive every context bound to it.
+ */
+extern blowfish_schedule const *
+blowfish_schedule_acquire(char const *name, uint8_t const *key,
+                          size_t key_len, error_function on_error,
+                          void *err_context);
+extern blowfish_schedule const *blowfish_schedule_find(char const *name,
+                                                       error_function on_error,
+                                                       void *err_context);
+extern void blowfish_schedule_release(blowfish_schedule const *schedule);
+
+/*
+ * Contexts and output buffers are allocated through the global allocator
+ * unless a context is given its own.  Passing NULL restores the default.
+ * Buffers returned from blowfish_encrypt and blowfish_decrypt start
+ * after a hidden header and MUST be released with blowfish_release, never
+ * with free().  Buffers from the global allocator are wiped and recycled
+ * through a size-classed pool.  A context's allocator is called from
+ * whichever thread uses the context, including the library's workers.
+ */
+extern void blowfish_set_allocator(blowfish_alloc_function alloc, void *ud);
+extern void blowfish_set_context_allocator(blowfish_state *self,
+                                           blowfish_alloc_function alloc,
+                                           void *ud);
+extern void blowfish_release(uint8_t *buf);
+
+/*
+ * Contexts allocated from an arena are packed into 2MB (huge page when
+ * available) regions so that many active keys share few TLB entries.
+ * An arena is not thread-safe.  Pass zero as capacity for no limit.
+ */
+typedef struct blowfish_arena blowfish_arena;
+
+extern blowfish_arena *blowfish_arena_new(size_t capacity,
+                                          error_function on_error,
+                                          void *err_context);
+extern void blowfish_arena_free(blowfish_arena *arena);
+extern blowfish_state *
+blowfish_arena_new_state(blowfish_arena *arena, uint8_t const *key,
+                         size_t key_len, uint8_t const *iv, size_t iv_len,
+                         blowfish_mode mode, int segment_size,
+                         error_function on_error, void *err_context);
+extern void blowfish_arena_release(blowfish_arena *arena,
+                                   blowfish_state *self);
+
+/*
+ * Opt-in worker threads for large messages.  Once started, ECB and the
+ * CBC and CFB decryption of messages of at least the parallel threshold
+ * are split into block-aligned chunks that are processed by the workers
+ * and the calling thread together.  At most `max_parallelism` threads
+ * (zero for no limit) work on a single call.
+ */
+extern bool blowfish_threads_start(unsigned num_threads,
+                                   error_function on_error, void *err_context);
+extern void blowfish_threads_stop(void);
+extern void blowfish_set_parallel_threshold(size_t min_bytes);
+extern void blowfish_set_max_parallelism(unsigned max_threads);
+
 extern uint8_t *blowfish_encrypt(blowfish_state *self, uint8_t const *msg,
                                  size_t msg_len, size_t *out_len,
                                  error_function on_error, void *err_context);
@@ -50,4 +202,119 @@ extern uint8_t *blowfish_decrypt(blowfish_state *self, uint8_t const *msg,
                                  size_t msg_len, size_t *out_len,
                                  error_function on_error, void *err_context);
 
+/*
+ * Variants that write into a caller-provided buffer of `out_size` bytes.
+ * Encryption needs blowfish_encrypted_size() bytes, decryption at most
+ * `msg_len` bytes.  Both may be called with `out == msg`.
+ */
+extern size_t blowfish_encrypted_size(blowfish_state const *self,
+                                      size_t msg_len);
+extern bool blowfish_encrypt_into(blowfish_state *self, uint8_t const *msg,
+                                  size_t msg_len, uint8_t *out,
+                                  size_t out_size, size_t *out_len,
+                                  error_function on_error, void *err_context);
+extern bool blowfish_decrypt_into(blowfish_state *self, uint8_t const *msg,
+                                  size_t msg_len, uint8_t *out,
+                                  size_t out_size, size_t *out_len,
+                                  error_function on_error, void *err_context);
+
+/*
+ * Incremental encryption or decryption of a message that arrives in
+ * pieces.  The stream advances the chaining state of `context` and
+ * buffers partial units between calls.  When decrypting with PKCS#7
+ * padding the final unit is held back until blowfish_stream_finish,
+ * which then strips the padding.  An update writes at most `buffered`
+ * plus `len` bytes, the finish at most BLOWFISH_BLOCK_SIZE.  The stream
+ * is empty again after blowfish_stream_finish.  `out` must not overlap
+ * the input.
+ */
+typedef struct {
+    blowfish_state *context;
+    bool encrypt;
+    size_t buffered;
+    uint8_t buffer[BLOWFISH_BLOCK_SIZE];
+} blowfish_stream;
+
+extern bool blowfish_stream_init(blowfish_stream *stream,
+                                 blowfish_state *context, bool encrypt,
+                                 error_function on_error, void *err_context);
+extern bool blowfish_stream_update(blowfish_stream *stream, uint8_t const *in,
+                                   size_t len, uint8_t *out, size_t out_size,
+                                   size_t *out_len, error_function on_error,
+                                   void *err_context);
+extern bool blowfish_stream_finish(blowfish_stream *stream, uint8_t *out,
+                                   size_t out_size, size_t *out_len,
+                                   error_function on_error, void *err_context);
+
+/*
+ * Batches of independent messages.  Every job is processed with a copy
+ * of `context` whose IV is replaced by `iv` (the context's initial IV when
+ * NULL), so one context may be shared by any number of jobs and is never
+ * modified.  The jobs are spread over the thread pool when it is running
+ * and each job reports its own failure.  Returns the number of failures.
+ */
+typedef struct {
+    blowfish_state const *context;
+    uint8_t const *iv;
+    uint8_t const *input;
+    size_t input_len;
+    uint8_t *output;
+    size_t output_size;
+    size_t output_len;               /* set by the batch */
+    bool ok;                         /* set by the batch */
+    char error[BLOWFISH_ERROR_SIZE]; /* set when `ok` is false */
+} blowfish_job;
+
+extern size_t blowfish_encrypt_batch(blowfish_job *jobs, size_t num_jobs);
+extern size_t blowfish_decrypt_batch(blowfish_job *jobs, size_t num_jobs);
+
+/*
+ * Runtime statistics.  Every thread counts into a block of its own
+ * without locking and a snapshot adds them all up, threads that have
+ * exited included.  Operations are messages encrypted or decrypted, and
+ * bytes are their input.  A stream is one operation, counted when it
+ * finishes, and its latency is not recorded.  Allocations count the
+ * contexts and output buffers that did not come from the buffer pool.
+ *
+ * Reading the clock costs more than counting, so latencies are measured
+ * only after blowfish_stats_track_latency(true).  Bucket `i` counts the
+ * calls that took less than 2^i nanoseconds but not less than 2^(i-1),
+ * and the last bucket everything slower as well.
+ */
+#define BLOWFISH_STATS_MODES (MODE_OFB + 1)
+#define BLOWFISH_STATS_BUCKETS 32
+
+typedef enum {
+    BLOWFISH_LATENCY_ENCRYPT,
+    BLOWFISH_LATENCY_DECRYPT,
+    BLOWFISH_LATENCY_KEY_SETUP,
+    BLOWFISH_LATENCY_KINDS
+} blowfish_latency_kind;
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[BLOWFISH_STATS_BUCKETS];
+} blowfish_histogram;
+
+typedef struct {
+    uint64_t operations[BLOWFISH_STATS_MODES][2]; /* [mode][encrypt] */
+    uint64_t bytes[BLOWFISH_STATS_MODES][2];
+    uint64_t key_expansions;
+    uint64_t padding_failures;
+    uint64_t allocations;
+    blowfish_histogram latency[BLOWFISH_LATENCY_KINDS];
+} blowfish_stats;
+
+extern void blowfish_stats_snapshot(blowfish_stats *stats);
+extern void blowfish_stats_track_latency(bool enabled);
+
+/*
+ * Writes `stats` in the Prometheus text exposition format.  Like
+ * snprintf, returns the length of the complete text and never writes
+ * more than `size` bytes, the terminating zero included.
+ */
+extern size_t blowfish_stats_prometheus(blowfish_stats const *stats,
+                                        char *buf, size_t size);
+
 #endif /* !BLOWFISH_8BIT_BLOWFISH_H */
@@ -0,0 +1,477 @@
+/*
+ * Batch mode for the command line tools.
+ *
+ * The file list is collected up front, directories included, and then
+ * claimed one file at a time by the worker threads through an atomic
+ * cursor.  Every worker owns its stream buffers and a copy of the mode
+ * fields of the context, bound to the caller's schedule, so nothing is
+ * allocated or shared per file.
+ *
+ * Outputs are created with O_EXCL unless forced.  Before any worker
+ * starts, inputs that are the output of another input are dropped from
+ * the list so that no file is written while a worker reads it.
+ */
+#define _GNU_SOURCE 1 /* nftw */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blowfish.h"
+#include "cli-lib.h"
+
+#define MAX_OPEN_DIRS 32
+
+struct file_list {
+    char **paths;
+    size_t count;
+    size_t capacity;
+};
+
+struct batch {
+    blowfish_state const *state;
+    struct batch_options const *options;
+    struct file_list files; /* skipped entries are NULL */
+    size_t skipped;
+    _Atomic size_t next_file;
+    _Atomic size_t failures;
+    _Atomic uint64_t bytes;
+    pthread_mutex_t print_lock;
+};
+
+/* nftw has no context argument */
+static struct file_list *collecting;
+
+static bool
+add_file(struct file_list *files, char const *path)
+{
+    if (files->count == files->capacity) {
+        size_t capacity = files->capacity ? files->capacity * 2 : 64;
+        char **paths = realloc(files->paths, capacity * sizeof(*paths));
+        if (paths == NULL) {
+            return false;
+        }
+        files->paths = paths;
+        files->capacity = capacity;
+    }
+    files->paths[files->count] = strdup(path);
+    return files->paths[files->count++] != NULL;
+}
+
+static int
+collect_file(char const *path, struct stat const *info, int type,
+             struct FTW *ftw)
+{
+    (void)info;
+    (void)ftw;
+    if (type == FTW_F && !add_file(collecting, path)) {
+        return -1;
+    }
+    return 0;
+}
+
+static bool
+collect_path(struct file_list *files, char const *path)
+{
+    struct stat info;
+
+    if (stat(path, &info) != 0) {
+        fprintf(stderr, "ERROR: cannot read %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (S_ISDIR(info.st_mode)) {
+        collecting = files;
+        if (nftw(path, collect_file, MAX_OPEN_DIRS, FTW_PHYS) != 0) {
+            fprintf(stderr, "ERROR: failed to walk %s\n", path);
+            return false;
+        }
+    } else if (!add_file(files, path)) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return false;
+    }
+    return true;
+}
+
+/* Collects the paths listed one per line in `list_path` */
+static bool
+collect_list(struct file_list *files, char const *list_path)
+{
+    FILE *list = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    bool ok = true;
+
+    if (list == NULL) {
+        fprintf(stderr, "ERROR: cannot read %s: %s\n", list_path,
+                strerror(errno));
+        return false;
+    }
+    while (ok && (line_len = getline(&line, &line_size, list)) > 0) {
+        if (line[line_len - 1] == '\n') {
+            line[--line_len] = '\0';
+        }
+        if (line_len > 0) {
+            ok = collect_path(files, line);
+        }
+    }
+    free(line);
+    if (list != stdin) {
+        fclose(list);
+    }
+    return ok;
+}
+
+static bool
+collect_files(struct file_list *files, char *const *paths, size_t num_paths)
+{
+    for (size_t i = 0; i < num_paths; ++i) {
+        if (!(paths[i][0] == '@' ? collect_list(files, paths[i] + 1)
+                                 : collect_path(files, paths[i])))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+free_files(struct file_list *files)
+{
+    for (size_t i = 0; i < files->count; ++i) {
+        free(files->paths[i]);
+    }
+    free(files->paths);
+}
+
+static char *
+output_path(char const *path, struct batch_options const *options)
+{
+    size_t len = strlen(path), suffix_len = strlen(options->suffix);
+    char *out = malloc(len + suffix_len + sizeof(".out"));
+
+    if (out == NULL) {
+        return NULL;
+    }
+    memcpy(out, path, len + 1);
+    if (options->encrypt) {
+        strcat(out, options->suffix);
+    } else if (len > suffix_len
+               && strcmp(path + len - suffix_len, options->suffix) == 0)
+    {
+        out[len - suffix_len] = '\0';
+    } else {
+        strcat(out, ".out");
+    }
+    return out;
+}
+
+struct file_id {
+    dev_t dev;
+    ino_t ino;
+    size_t index;
+};
+
+static int
+compare_ids(void const *a, void const *b)
+{
+    struct file_id const *x = a, *y = b;
+
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/*
+ * Drops every input that the output of another input names, whatever
+ * path either was found under, and every repeat of an input.
+ */
+static bool
+skip_outputs(struct batch *batch)
+{
+    struct file_list *files = &batch->files;
+    struct file_id *ids = calloc(files->count + 1, sizeof(*ids));
+    size_t num_ids = 0, kept = 0;
+    struct stat info;
+
+    if (ids == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return false;
+    }
+    for (size_t i = 0; i < files->count; ++i) {
+        if (stat(files->paths[i], &info) == 0) {
+            ids[num_ids++] = (struct file_id){info.st_dev, info.st_ino, i};
+        }
+    }
+    qsort(ids, num_ids, sizeof(*ids), compare_ids);
+    for (size_t i = 0; i < num_ids; ++i) {
+        if (kept > 0 && compare_ids(&ids[kept - 1], &ids[i]) == 0) {
+            printf("skip   %s: listed more than once\n",
+                   files->paths[ids[i].index]);
+            free(files->paths[ids[i].index]);
+            files->paths[ids[i].index] = NULL;
+            ++batch->skipped;
+        } else {
+            ids[kept++] = ids[i];
+        }
+    }
+    num_ids = kept;
+
+    for (size_t i = 0; i < files->count; ++i) {
+        char *out_path;
+        struct file_id *found;
+
+        if (files->paths[i] == NULL) {
+            continue;
+        }
+        out_path = output_path(files->paths[i], batch->options);
+        if (out_path == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            free(ids);
+            return false;
+        }
+        if (stat(out_path, &info) == 0) {
+            struct file_id key = {info.st_dev, info.st_ino, 0};
+            found = bsearch(&key, ids, num_ids, sizeof(*ids), compare_ids);
+            if (found != NULL && files->paths[found->index] != NULL) {
+                printf("skip   %s: output of %s\n",
+                       files->paths[found->index], files->paths[i]);
+                free(files->paths[found->index]);
+                files->paths[found->index] = NULL;
+                ++batch->skipped;
+            }
+        }
+        free(out_path);
+    }
+    free(ids);
+    return true;
+}
+
+static bool
+read_fully(int fd, uint8_t *buf, size_t len, error_function on_error,
+           void *err_context)
+{
+    while (len > 0) {
+        ssize_t nread = read(fd, buf, len);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            on_error(err_context, "file is too short for its IV");
+            return false;
+        }
+        buf += nread;
+        len -= (size_t)nread;
+    }
+    return true;
+}
+
+/* Reads or writes the IV at the start of a file and installs it */
+static bool
+exchange_iv(blowfish_state *state, bool encrypt, int in_fd, int out_fd,
+            char *error)
+{
+    uint8_t iv[BLOWFISH_BLOCK_SIZE];
+
+    if (encrypt) {
+        if (getentropy(iv, sizeof(iv)) != 0) {
+            blowfish_error_to_buffer(error, "failed to generate an IV: %s",
+                                     strerror(errno));
+            return false;
+        }
+        if (!write_fully(out_fd, iv, sizeof(iv), blowfish_error_to_buffer,
+                         error))
+        {
+            return false;
+        }
+    } else if (!read_fully(in_fd, iv, sizeof(iv), blowfish_error_to_buffer,
+                           error))
+    {
+        return false;
+    }
+    return blowfish_set_iv(state, iv, sizeof(iv), blowfish_error_to_buffer,
+                           error);
+}
+
+static bool
+process_file(struct batch *batch, blowfish_state *state, char const *path,
+             uint8_t *in_buf, uint8_t *out_buf, char *error)
+{
+    struct batch_options const *options = batch->options;
+    blowfish_stream stream;
+    struct stat info;
+    char *out_path = output_path(path, options);
+    int in_fd, out_fd = -1;
+    bool ok = false;
+
+    in_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (out_path == NULL) {
+        blowfish_error_to_buffer(error, "out of memory");
+    } else if (in_fd < 0 || fstat(in_fd, &info) != 0) {
+        blowfish_error_to_buffer(error, "%s", strerror(errno));
+    } else if ((out_fd = open(out_path,
+                              O_WRONLY | O_CREAT | O_CLOEXEC
+                                  | (options->force ? O_TRUNC : O_EXCL),
+                              0644))
+               < 0)
+    {
+        blowfish_error_to_buffer(error, "cannot create %s: %s", out_path,
+                                 strerror(errno));
+    } else {
+        blowfish_reset(state);
+        ok = (!options->iv_prefix
+              || exchange_iv(state, options->encrypt, in_fd, out_fd, error))
+          && blowfish_stream_init(&stream, state, options->encrypt,
+                                  blowfish_error_to_buffer, error)
+          && pump_stream(&stream, in_fd, out_fd, in_buf, out_buf,
+                         blowfish_error_to_buffer, error);
+        if (ok) {
+            atomic_fetch_add(&batch->bytes, (uint64_t)info.st_size);
+        }
+    }
+
+    if (out_fd >= 0 && close(out_fd) != 0 && ok) {
+        blowfish_error_to_buffer(error, "failed to close %s: %s", out_path,
+                                 strerror(errno));
+        ok = false;
+    }
+    if (out_fd >= 0 && !ok) {
+        unlink(out_path); /* do not leave partial output behind */
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    free(out_path);
+    return ok;
+}
+
+static void *
+batch_worker(void *arg)
+{
+    struct batch *batch = (struct batch *)arg;
+    blowfish_state *state = aligned_alloc(BLOWFISH_ALIGNMENT,
+                                          sizeof(blowfish_state));
+    uint8_t *in_buf = aligned_alloc(PAGE_ALIGNMENT, STREAM_BUFFER_SIZE);
+    uint8_t *out_buf = aligned_alloc(PAGE_ALIGNMENT,
+                                     STREAM_BUFFER_SIZE + PAGE_ALIGNMENT);
+    char error[BLOWFISH_ERROR_SIZE];
+    size_t index;
+
+    while ((index = atomic_fetch_add(&batch->next_file, 1))
+           < batch->files.count)
+    {
+        char const *path = batch->files.paths[index];
+        bool ok;
+
+        if (path == NULL) {
+            continue;
+        }
+        error[0] = '\0';
+        if (state == NULL || in_buf == NULL || out_buf == NULL) {
+            blowfish_error_to_buffer(error, "out of memory");
+            ok = false;
+        } else {
+            /* the mode fields only, the schedule stays with the caller */
+            memcpy(state, batch->state, BLOWFISH_SHARED_STATE_SIZE);
+            ok = process_file(batch, state, path, in_buf, out_buf, error);
+        }
+
+        pthread_mutex_lock(&batch->print_lock);
+        if (ok) {
+            printf("ok     %s\n", path);
+        } else {
+            atomic_fetch_add(&batch->failures, 1);
+            printf("FAILED %s: %s\n", path, error);
+        }
+        pthread_mutex_unlock(&batch->print_lock);
+    }
+
+    free(state);
+    free(in_buf);
+    free(out_buf);
+    return NULL;
+}
+
+static double
+seconds_since(struct timespec const *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec)
+         + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+bool
+run_batch(blowfish_state const *state, struct batch_options const *options,
+          char *const *paths, size_t num_paths)
+{
+    struct batch batch;
+    pthread_t threads[BLOWFISH_MAX_THREADS];
+    unsigned num_threads = options->num_threads;
+    unsigned started = 0;
+    struct timespec start;
+    double elapsed;
+    uint64_t bytes;
+    bool ok;
+
+    if (options->iv_prefix && state->mode == MODE_ECB) {
+        fprintf(stderr, "ERROR: ECB does not use an initialization vector\n");
+        return false;
+    }
+    memset(&batch, 0, sizeof(batch));
+    batch.state = state;
+    batch.options = options;
+    if (!collect_files(&batch.files, paths, num_paths)) {
+        free_files(&batch.files);
+        return false;
+    }
+    if (!skip_outputs(&batch)) {
+        free_files(&batch.files);
+        return false;
+    }
+    atomic_init(&batch.next_file, 0);
+    atomic_init(&batch.failures, 0);
+    atomic_init(&batch.bytes, 0);
+    pthread_mutex_init(&batch.print_lock, NULL);
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > BLOWFISH_MAX_THREADS) {
+        num_threads = BLOWFISH_MAX_THREADS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (started < num_threads
+           && pthread_create(&threads[started], NULL, batch_worker, &batch)
+                  == 0)
+    {
+        ++started;
+    }
+    if (started == 0) {
+        batch_worker(&batch); /* no threads, do the work here */
+    }
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = seconds_since(&start);
+
+    bytes = atomic_load(&batch.bytes);
+    ok = atomic_load(&batch.failures) == 0;
+    printf("%zu files, %zu failed, %zu skipped, %llu bytes in %.3f s, "
+           "%.1f MB/s\n",
+           batch.files.count, atomic_load(&batch.failures), batch.skipped,
+           (unsigned long long)bytes, elapsed,
+           elapsed > 0 ? (double)bytes / 1e6 / elapsed : 0.0);
+
+    pthread_mutex_destroy(&batch.print_lock);
+    free_files(&batch.files);
+    return ok;
+}
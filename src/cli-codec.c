@@ -0,0 +1,153 @@
+/*
+ * Text encodings for record mode and the interactive prompts.  Decoders
+ * reject anything that is not part of the encoding, including whitespace,
+ * so a corrupt record fails instead of turning into a shorter message.
+ *
+ * Hex goes through lookup tables a byte pair at a time and validity is
+ * only checked once per buffer, which keeps the loops free of branches.
+ */
+#include <string.h>
+
+#include "blowfish.h"
+#include "cli-lib.h"
+
+#define HEX_ROW(high)                                                         \
+    {high, '0'}, {high, '1'}, {high, '2'}, {high, '3'}, {high, '4'},          \
+        {high, '5'}, {high, '6'}, {high, '7'}, {high, '8'}, {high, '9'},      \
+        {high, 'a'}, {high, 'b'}, {high, 'c'}, {high, 'd'}, {high, 'e'},      \
+        {high, 'f'}
+
+/* both digits of every byte value */
+static char const HEX_PAIRS[256][2] = {
+    HEX_ROW('0'), HEX_ROW('1'), HEX_ROW('2'), HEX_ROW('3'),
+    HEX_ROW('4'), HEX_ROW('5'), HEX_ROW('6'), HEX_ROW('7'),
+    HEX_ROW('8'), HEX_ROW('9'), HEX_ROW('a'), HEX_ROW('b'),
+    HEX_ROW('c'), HEX_ROW('d'), HEX_ROW('e'), HEX_ROW('f'),
+};
+
+/* digit values with HEX_VALID set, zero for everything else */
+#define HEX_VALID 0x10
+static uint8_t const HEX_VALUES[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e,
+    ['F'] = 0x1f, ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d,
+    ['e'] = 0x1e, ['f'] = 0x1f,
+};
+
+static char const BASE64_DIGITS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int
+base64_value(char c)
+{
+    char const *digit = c != '\0' ? strchr(BASE64_DIGITS, c) : NULL;
+    return digit != NULL ? (int)(digit - BASE64_DIGITS) : -1;
+}
+
+bool
+hex_decode(char const *text, size_t len, uint8_t *out, size_t *out_len)
+{
+    unsigned char const *digits = (unsigned char const *)text;
+    uint8_t valid = HEX_VALID;
+
+    if (len & 1) {
+        return false;
+    }
+    for (size_t i = 0; i < len / 2; ++i) {
+        uint8_t high = HEX_VALUES[digits[2 * i]];
+        uint8_t low = HEX_VALUES[digits[2 * i + 1]];
+        valid &= high & low;
+        out[i] = (uint8_t)(high << 4 | (low & 0x0f));
+    }
+    *out_len = len / 2;
+    return valid != 0;
+}
+
+size_t
+hex_span(char const *text)
+{
+    unsigned char const *digit = (unsigned char const *)text;
+    while (HEX_VALUES[*digit] != 0) {
+        ++digit;
+    }
+    return (size_t)(digit - (unsigned char const *)text);
+}
+
+size_t
+hex_encode(uint8_t const *in, size_t len, char *out)
+{
+    for (size_t i = 0; i < len; ++i) {
+        memcpy(&out[2 * i], HEX_PAIRS[in[i]], 2);
+    }
+    return 2 * len;
+}
+
+static bool
+base64_decode(char const *text, size_t len, uint8_t *out, size_t *out_len)
+{
+    size_t padding = 0;
+    uint8_t *start = out;
+
+    if (len & 3) {
+        return false;
+    }
+    while (padding < 2 && padding < len && text[len - 1 - padding] == '=') {
+        ++padding;
+    }
+    for (size_t i = 0; i < len; i += 4) {
+        uint32_t group = 0;
+        for (size_t j = 0; j < 4; ++j) {
+            int value = i + j >= len - padding ? 0 : base64_value(text[i + j]);
+            if (value < 0) {
+                return false;
+            }
+            group = group << 6 | (uint32_t)value;
+        }
+        *out++ = (uint8_t)(group >> 16);
+        *out++ = (uint8_t)(group >> 8);
+        *out++ = (uint8_t)group;
+    }
+    *out_len = (size_t)(out - start) - padding;
+    return true;
+}
+
+bool
+decode_text(enum text_encoding encoding, char const *text, size_t len,
+            uint8_t *out, size_t *out_len)
+{
+    return encoding == ENCODING_HEX ? hex_decode(text, len, out, out_len)
+                                    : base64_decode(text, len, out, out_len);
+}
+
+size_t
+encoded_size(enum text_encoding encoding, size_t len)
+{
+    return encoding == ENCODING_HEX ? len * 2 : (len + 2) / 3 * 4;
+}
+
+size_t
+encode_text(enum text_encoding encoding, uint8_t const *in, size_t len,
+            char *out)
+{
+    char *start = out;
+
+    if (encoding == ENCODING_HEX) {
+        return hex_encode(in, len, out);
+    }
+
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t group = (uint32_t)in[i] << 16;
+        if (i + 1 < len) {
+            group |= (uint32_t)in[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            group |= in[i + 2];
+        }
+        *out++ = BASE64_DIGITS[group >> 18];
+        *out++ = BASE64_DIGITS[(group >> 12) & 63];
+        *out++ = i + 1 < len ? BASE64_DIGITS[(group >> 6) & 63] : '=';
+        *out++ = i + 2 < len ? BASE64_DIGITS[group & 63] : '=';
+    }
+    return (size_t)(out - start);
+}
@@ -1,8 +1,12 @@
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "blowfish.h"
 #include "cli-lib.h"
@@ -10,20 +14,19 @@
 static char const *MODES[] = {"CBC", "CFB", "CTR", "ECB", "OFB"};
 static size_t NUM_MODES = sizeof(MODES) / sizeof(MODES[0]);
 
-static bool translate_hex(char const *hex_str, uint8_t *out, size_t out_len,
-                          char const **end_ptr);
+#define DEFAULT_SUFFIX ".bf"
 
 blowfish_mode
 get_mode_or_fail(char const *mode_string)
 {
-    for (int i = 0; i < NUM_MODES; ++i) {
+    for (size_t i = 0; i < NUM_MODES; ++i) {
         if (strcmp(mode_string, MODES[i]) == 0) {
-            return i;
+            return (blowfish_mode)i;
         }
     }
     fprintf(stderr, "Invalid mode '%s'\n", mode_string);
     fprintf(stderr, "Valid modes are: ");
-    for (int i = 0; i < NUM_MODES; ++i) {
+    for (size_t i = 0; i < NUM_MODES; ++i) {
         fprintf(stderr, "%s%s", MODES[i], (i + 1 == NUM_MODES ? "\n" : ", "));
     }
     exit(EXIT_FAILURE);
@@ -42,43 +45,89 @@ report_error(void *destination, char const *fmt, ...)
     fprintf(fp, "\n");
 }
 
+/* hexdump lines are 83 characters, 91 past 4 GiB, see format_dump_line */
+#define DUMP_LINE_SIZE 96
+#define DUMP_CHUNK_LINES 64
+#define HEX_CHUNK_SIZE 4096
+
+/*
+ * Formats one line of up to 16 bytes into `line` without going through
+ * stdio, returning its length.
+ */
+static size_t
+format_dump_line(char *line, uint8_t const *buf, size_t offset, size_t count)
+{
+    uint8_t offset_bytes[sizeof(uint64_t)];
+    char offset_digits[2 * sizeof(uint64_t)];
+    char *out = line;
+    size_t first = 0;
+
+    for (size_t i = 0; i < sizeof(offset_bytes); ++i) {
+        offset_bytes[i] = (uint8_t)((uint64_t)offset >> (56 - 8 * i));
+    }
+    hex_encode(offset_bytes, sizeof(offset_bytes), offset_digits);
+    while (first < 8 && offset_digits[first] == '0') {
+        ++first; /* at least eight digits, as %08zx */
+    }
+
+    memcpy(out, "| ", 2);
+    out += 2;
+    memcpy(out, &offset_digits[first], sizeof(offset_digits) - first);
+    out += sizeof(offset_digits) - first;
+    memcpy(out, " |", 2);
+    out += 2;
+    for (size_t i = 0; i < 16; ++i) {
+        *out++ = ' ';
+        if (i < count) {
+            out += hex_encode(&buf[i], 1, out);
+        } else {
+            *out++ = ' ';
+            *out++ = ' ';
+        }
+        if (i % 8 == 7) {
+            *out++ = ' ';
+        }
+    }
+    memcpy(out, "| ", 2);
+    out += 2;
+    for (size_t i = 0; i < 16; ++i) {
+        *out++ = i >= count ? ' ' : isgraph(buf[i]) ? (char)buf[i] : '.';
+    }
+    memcpy(out, " |\n", 3);
+    return (size_t)(out + 3 - line);
+}
+
 void
 hexdump(FILE *fp, uint8_t const *buf, size_t buf_len)
 {
+    char chunk[DUMP_CHUNK_LINES * DUMP_LINE_SIZE];
+    size_t chunk_len = 0;
+
     fprintf(fp, "\n");
     print_hex(fp, buf, buf_len);
     for (size_t offset = 0; offset < buf_len; offset += 16) {
-        fprintf(fp, "| %08zx |", offset);
-        for (size_t i = offset; i < offset + 16; ++i) {
-            if (i < buf_len) {
-                fprintf(fp, " %02x", buf[i]);
-            } else {
-                fprintf(fp, "   ");
-            }
-            if ((i + 1) % 8 == 0) {
-                fprintf(fp, " ");
-            }
-        }
-        fprintf(fp, "| ");
-        for (size_t i = offset; i < offset + 16; ++i) {
-            if (i >= buf_len) {
-                fprintf(fp, " ");
-            } else if (isalnum(buf[i]) || ispunct(buf[i])) {
-                fprintf(fp, "%c", buf[i]);
-            } else {
-                fprintf(fp, ".");
-            }
+        size_t count = buf_len - offset < 16 ? buf_len - offset : 16;
+        if (chunk_len + DUMP_LINE_SIZE > sizeof(chunk)) {
+            fwrite(chunk, 1, chunk_len, fp);
+            chunk_len = 0;
         }
-        fprintf(fp, " |\n");
+        chunk_len += format_dump_line(&chunk[chunk_len], &buf[offset], offset,
+                                      count);
     }
+    fwrite(chunk, 1, chunk_len, fp);
     fprintf(fp, "\n");
 }
 
 void
 print_hex(FILE *fp, uint8_t const *buf, size_t buf_len)
 {
-    while (buf_len--) {
-        fprintf(fp, "%02x", *buf++);
+    char chunk[HEX_CHUNK_SIZE];
+
+    while (buf_len > 0) {
+        size_t len = buf_len < sizeof(chunk) / 2 ? buf_len : sizeof(chunk) / 2;
+        fwrite(chunk, 1, hex_encode(buf, len, chunk), fp);
+        buf += len;
+        buf_len -= len;
     }
     fprintf(fp, "\n");
 }
@@ -86,46 +135,30 @@ print_hex(FILE *fp, uint8_t const *buf, size_t buf_len)
 uint8_t *
 read_hex_string(size_t *buf_len)
 {
-    bool done = false;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len = getline(&line, &line_size, stdin);
     uint8_t *out_buf = NULL;
-    size_t out_buf_sz = 0;
-    char hex_buf[256];
-    uint8_t tmp_buf[128];
 
     *buf_len = 0;
-    while (!done && fgets(&hex_buf[0], sizeof(hex_buf), stdin)) {
-        if (hex_buf[0] == '\n') {
-            break;
-        }
-
-        size_t l = strlen(hex_buf) - 1;
-        if (hex_buf[l] == '\n') {
-            hex_buf[l] = '\0';
-            done = true;
-        }
-
-        if (translate_hex(&hex_buf[0], &tmp_buf[0], sizeof(tmp_buf), NULL)) {
-            size_t new_len = out_buf_sz + (l / 2);
-            uint8_t *new_buf = (uint8_t *)realloc(out_buf, new_len);
-            if (new_buf) {
-                memcpy(&new_buf[out_buf_sz], &tmp_buf[0], l);
-                out_buf = new_buf;
-                out_buf_sz = new_len;
-                continue;
-            }
-        } else {
-            fprintf(stderr, "ERROR: failed to parse hex string '%s'\n",
-                    hex_buf);
-        }
-        /* failed! */
-        if (out_buf) {
+    while (line_len > 0
+           && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+    {
+        line[--line_len] = '\0';
+    }
+    if (line_len > 0) {
+        out_buf = malloc((size_t)line_len / 2 + 1);
+        if (out_buf == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate %zu bytes.\n",
+                    (size_t)line_len / 2 + 1);
+        } else if (!hex_decode(line, (size_t)line_len, out_buf, buf_len)) {
+            fprintf(stderr, "ERROR: failed to parse hex string '%s'\n", line);
             free(out_buf);
+            out_buf = NULL;
+            *buf_len = 0;
         }
-        return NULL;
     }
-
-    *buf_len = out_buf_sz;
-
+    free(line);
     return out_buf;
 }
 
@@ -152,12 +185,12 @@ from_hex_or_fail(char const *hexed, size_t *num_bytes)
         exit(EXIT_FAILURE);
     }
 
-    char const *end_ptr;
-    if (!translate_hex(hexed, out_buf, *num_bytes, &end_ptr)) {
+    size_t decoded_len;
+    if (!hex_decode(hexed, input_len, out_buf, &decoded_len)) {
         fprintf(
             stderr,
             "ERROR: failed to parse '%s' as a hex string starting with '%c'\n",
-            hexed, *end_ptr);
+            hexed, hexed[hex_span(hexed)]);
         free(out_buf);
         exit(EXIT_FAILURE);
     }
@@ -165,32 +198,221 @@ from_hex_or_fail(char const *hexed, size_t *num_bytes)
     return out_buf;
 }
 
-static bool
-translate_hex(char const *hex_str, uint8_t *out, size_t out_len,
-              char const **end_ptr)
+int
+open_or_default(char const *path, int flags, int default_fd)
 {
-    if (end_ptr) {
-        *end_ptr = NULL;
-    }
-
-    while (*hex_str && out_len--) {
-        *out = 0;
-        for (int i = 0; i < 2; ++i) {
-            uint8_t nybble;
-            if (isdigit(*hex_str)) {
-                nybble = *hex_str - '0';
-            } else if (isxdigit(*hex_str)) {
-                nybble = (tolower(*hex_str) - 'a') + 10;
-            } else {
-                if (end_ptr) {
-                    *end_ptr = hex_str;
-                }
-                return false;
+    int fd;
+
+    if (path == NULL || strcmp(path, "-") == 0) {
+        return default_fd;
+    }
+    fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: failed to open %s: %s\n", path,
+                strerror(errno));
+    }
+    return fd;
+}
+
+bool
+write_fully(int fd, uint8_t const *buf, size_t len, error_function on_error,
+            void *err_context)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            *out = (*out << 4) | nybble;
-            hex_str++;
+            on_error(err_context, "write failed: %s", strerror(errno));
+            return false;
         }
-        ++out;
+        buf += written;
+        len -= (size_t)written;
     }
     return true;
 }
+
+bool
+pump_stream(blowfish_stream *stream, int in_fd, int out_fd, uint8_t *in_buf,
+            uint8_t *out_buf, error_function on_error, void *err_context)
+{
+    size_t out_len;
+    ssize_t nread;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    while ((nread = read(in_fd, in_buf, STREAM_BUFFER_SIZE)) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            on_error(err_context, "read failed: %s", strerror(errno));
+            return false;
+        }
+        if (!blowfish_stream_update(stream, in_buf, (size_t)nread, out_buf,
+                                    STREAM_BUFFER_SIZE + PAGE_ALIGNMENT,
+                                    &out_len, on_error, err_context)
+            || !write_fully(out_fd, out_buf, out_len, on_error, err_context))
+        {
+            return false;
+        }
+    }
+    return blowfish_stream_finish(stream, out_buf, PAGE_ALIGNMENT, &out_len,
+                                  on_error, err_context)
+        && write_fully(out_fd, out_buf, out_len, on_error, err_context);
+}
+
+bool
+same_file(int a, int b)
+{
+    struct stat a_info, b_info;
+
+    return fstat(a, &a_info) == 0 && fstat(b, &b_info) == 0
+        && S_ISREG(a_info.st_mode) && a_info.st_dev == b_info.st_dev
+        && a_info.st_ino == b_info.st_ino;
+}
+
+bool
+stream_file(blowfish_state *state, bool encrypt, char const *in_path,
+            char const *out_path)
+{
+    blowfish_stream stream;
+    bool ok = false, owned = false;
+    int in_fd, out_fd = -1;
+
+    in_fd = open_or_default(in_path, O_RDONLY, STDIN_FILENO);
+    if (in_fd >= 0) {
+        /* not truncated until it is known not to be the input */
+        out_fd = open_or_default(out_path, O_WRONLY | O_CREAT, STDOUT_FILENO);
+    }
+    if (in_fd >= 0 && out_fd >= 0) {
+        if (same_file(in_fd, out_fd)) {
+            fprintf(stderr, "ERROR: input and output are the same file\n");
+        } else if (out_fd != STDOUT_FILENO && ftruncate(out_fd, 0) != 0) {
+            fprintf(stderr, "ERROR: failed to truncate %s: %s\n", out_path,
+                    strerror(errno));
+        } else {
+            owned = out_fd != STDOUT_FILENO;
+            ok = blowfish_stream_init(&stream, state, encrypt, &report_error,
+                                      stderr)
+              && pipeline_stream(&stream, in_fd, out_fd, &report_error,
+                                 stderr);
+        }
+    }
+
+    if (in_fd > STDERR_FILENO) {
+        close(in_fd);
+    }
+    if (out_fd > STDERR_FILENO && close(out_fd) != 0) {
+        fprintf(stderr, "ERROR: failed to close %s: %s\n", out_path,
+                strerror(errno));
+        ok = false;
+    }
+    if (!ok && owned) {
+        unlink(out_path); /* do not leave partial output behind */
+    }
+    return ok;
+}
+
+static void
+usage_and_exit(char const *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-i INPUT] [-o OUTPUT] MODE KEY [IV]\n"
+            "       %s -r hex|base64 [-i INPUT] [-o OUTPUT] MODE KEY [IV]\n"
+            "       %s -b PATH [-b PATH]... [-j THREADS] [-s SUFFIX] [-p] [-f] "
+            "MODE KEY [IV]\n",
+            program, program, program);
+    exit(EXIT_FAILURE);
+}
+
+void
+parse_options_or_fail(int argc, char *argv[], bool encrypt,
+                      struct cli_options *options)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    memset(options, 0, sizeof(*options));
+    options->batch.encrypt = encrypt;
+    options->batch.num_threads = online > 0 ? (unsigned)online : 1;
+    options->batch.suffix = DEFAULT_SUFFIX;
+    options->batch_paths = calloc((size_t)argc, sizeof(char *));
+    if (options->batch_paths == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((opt = getopt(argc, argv, "b:fi:j:o:pr:s:")) != -1) {
+        switch (opt) {
+        case 'b':
+            options->batch_paths[options->num_batch_paths++] = optarg;
+            break;
+        case 'f':
+            options->batch.force = true;
+            break;
+        case 'i':
+            options->in_path = optarg;
+            break;
+        case 'j':
+            options->batch.num_threads = (unsigned)atoi(optarg);
+            if (options->batch.num_threads < 1
+                || options->batch.num_threads > BLOWFISH_MAX_THREADS)
+            {
+                fprintf(stderr, "ERROR: threads must be between 1 and %d\n",
+                        BLOWFISH_MAX_THREADS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            options->out_path = optarg;
+            break;
+        case 'p':
+            options->batch.iv_prefix = true;
+            break;
+        case 'r':
+            options->records = true;
+            if (strcmp(optarg, "hex") == 0) {
+                options->encoding = ENCODING_HEX;
+            } else if (strcmp(optarg, "base64") == 0) {
+                options->encoding = ENCODING_BASE64;
+            } else {
+                usage_and_exit(argv[0]);
+            }
+            break;
+        case 's':
+            options->batch.suffix = optarg;
+            break;
+        default:
+            usage_and_exit(argv[0]);
+        }
+    }
+    if ((argc - optind != 2 && argc - optind != 3)
+        || (options->num_batch_paths > 0
+            && (options->in_path || options->out_path || options->records)))
+    {
+        usage_and_exit(argv[0]);
+    }
+
+    options->mode = get_mode_or_fail(argv[optind]);
+    options->key = from_hex_or_fail(argv[optind + 1], &options->key_len);
+    options->iv = from_hex_or_fail(argv[optind + 2], &options->iv_len);
+
+    /* files carry their own IV, the context only needs a placeholder */
+    if (options->batch.iv_prefix && options->iv == NULL
+        && options->mode != MODE_ECB)
+    {
+        options->iv = calloc(1, BLOWFISH_BLOCK_SIZE);
+        options->iv_len = BLOWFISH_BLOCK_SIZE;
+    }
+}
+
+void
+free_options(struct cli_options *options)
+{
+    free(options->key);
+    free(options->iv);
+    free(options->batch_paths);
+}
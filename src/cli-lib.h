@@ -13,4 +13,121 @@ extern void hexdump(FILE *fp, uint8_t const *buf, size_t buf_len);
 extern void print_hex(FILE *fp, uint8_t const *buf, size_t buf_len);
 extern uint8_t *read_hex_string(size_t *buf_len);
 
+/*
+ * Encrypts or decrypts `in_path` into `out_path` ("-" or NULL for the
+ * standard streams) as raw bytes, in constant memory, with the chaining
+ * state carried across the whole file.  The output file is removed when
+ * the call fails, and input and output must not be the same file.
+ */
+extern bool stream_file(blowfish_state *state, bool encrypt,
+                        char const *in_path, char const *out_path);
+extern int open_or_default(char const *path, int flags, int default_fd);
+/* True when both descriptors refer to the same regular file */
+extern bool same_file(int a, int b);
+
+/*
+ * Runs everything readable from `in_fd` through `stream` into `out_fd`.
+ * `in_buf` holds STREAM_BUFFER_SIZE bytes and `out_buf` PAGE_ALIGNMENT
+ * more, both page aligned.
+ */
+#define STREAM_BUFFER_SIZE ((size_t)1024 * 1024)
+#define PAGE_ALIGNMENT 4096
+extern bool pump_stream(blowfish_stream *stream, int in_fd, int out_fd,
+                        uint8_t *in_buf, uint8_t *out_buf,
+                        error_function on_error, void *err_context);
+extern bool write_fully(int fd, uint8_t const *buf, size_t len,
+                        error_function on_error, void *err_context);
+
+/*
+ * Same as pump_stream, with reads, the cipher and writes overlapped on
+ * buffers of its own: through io_uring between regular files, through a
+ * reader and a writer thread otherwise.
+ */
+extern bool pipeline_stream(blowfish_stream *stream, int in_fd, int out_fd,
+                            error_function on_error, void *err_context);
+
+/*
+ * Encrypts or decrypts every regular file in `paths`, and every one found
+ * below a directory in it, on `num_threads` threads.  Each result is
+ * written next to its input: encrypting appends `suffix` and decrypting
+ * removes it, or appends ".out" when the name does not end with it.
+ * With `iv_prefix` every file carries its own IV in its first block,
+ * generated at random when encrypting.  Existing outputs are only
+ * replaced with `force`, and an input that another input would be
+ * written to is skipped.  Prints a line per file and a summary, and
+ * returns false when any file failed.
+ */
+struct batch_options {
+    bool encrypt;
+    bool force;
+    bool iv_prefix;
+    unsigned num_threads;
+    char const *suffix;
+};
+
+extern bool run_batch(blowfish_state const *state,
+                      struct batch_options const *options, char *const *paths,
+                      size_t num_paths);
+
+/*
+ * Text encodings for record mode and the prompts.  Decoding needs at most
+ * `len` bytes of output and encoding exactly encoded_size() characters.
+ * Output is not NUL terminated.
+ */
+enum text_encoding {
+    ENCODING_HEX,
+    ENCODING_BASE64,
+};
+
+extern bool decode_text(enum text_encoding encoding, char const *text,
+                        size_t len, uint8_t *out, size_t *out_len);
+extern size_t encoded_size(enum text_encoding encoding, size_t len);
+extern size_t encode_text(enum text_encoding encoding, uint8_t const *in,
+                          size_t len, char *out);
+extern bool hex_decode(char const *text, size_t len, uint8_t *out,
+                       size_t *out_len);
+extern size_t hex_encode(uint8_t const *in, size_t len, char *out);
+/* number of hex digits at the start of the NUL terminated `text` */
+extern size_t hex_span(char const *text);
+
+/*
+ * Record mode: every line of `in_path` is an encoded message, optionally
+ * preceded by an encoded IV and a colon.  Each record is processed from
+ * the initial IV, or from its own, and written as one encoded line to
+ * `out_path`, keeping the IV prefix when encrypting.  A record that fails
+ * produces an empty line and a message on stderr.  Refuses an output that
+ * is the input file.  Returns false when any record failed.
+ */
+extern bool run_records(blowfish_state *state, bool encrypt,
+                        enum text_encoding encoding, char const *in_path,
+                        char const *out_path);
+
+/*
+ * Command line shared by bf-encrypt and bf-decrypt:
+ *
+ *   [-i INPUT] [-o OUTPUT] [-r hex|base64] [-b PATH]... [-j THREADS]
+ *   [-s SUFFIX] [-p] MODE KEY [IV]
+ *
+ * -b names a file, a directory or, with a leading '@', a file listing
+ * paths one per line.  Exits with a usage message on errors.
+ */
+struct cli_options {
+    char const *in_path;
+    char const *out_path;
+    bool records;
+    enum text_encoding encoding;
+    char **batch_paths;
+    size_t num_batch_paths;
+    struct batch_options batch;
+    blowfish_mode mode;
+    uint8_t *key;
+    size_t key_len;
+    uint8_t *iv;
+    size_t iv_len;
+};
+
+extern void parse_options_or_fail(int argc, char *argv[], bool encrypt,
+                                  struct cli_options *options);
+extern void free_options(struct cli_options *options);
+
 #endif /*!BLOWFISH_8BIT_CLI_LIB_H*/
@@ -0,0 +1,583 @@
+/*
+ * Overlapped I/O for stream mode.
+ *
+ * The file is cut into PIPELINE_DEPTH slots that cycle through reading,
+ * encrypting and writing, so the disk is busy while the CPU works on an
+ * earlier slot.  The cipher itself still sees the slots strictly in file
+ * order because the chaining state runs across all of them.
+ *
+ * Between regular files the reads and writes go through io_uring, with
+ * every slot's buffers registered once and all reads issued up front at
+ * their file offsets.  The ring is driven through the raw system calls
+ * so that there is no liburing dependency.  Anything else - pipes,
+ * terminals, kernels without io_uring or with it disabled - goes through
+ * a reader thread and a writer thread handing slots to the caller.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blowfish.h"
+#include "cli-lib.h"
+
+#ifdef __linux__
+#    include <linux/io_uring.h>
+#    include <stdatomic.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <sys/uio.h>
+#    ifdef __NR_io_uring_setup
+#        define HAVE_IO_URING 1
+#    endif
+#endif
+
+#define PIPELINE_DEPTH 8
+#define SLOT_SIZE ((size_t)256 * 1024)
+
+enum slot_state {
+    SLOT_IDLE,
+    SLOT_READING,
+    SLOT_READ,
+    SLOT_PROCESSED,
+    SLOT_WRITING,
+};
+
+struct slot {
+    uint8_t *in;
+    uint8_t *out;
+    size_t in_len;
+    size_t want;
+    size_t out_len;
+    size_t written;
+    uint64_t in_offset;
+    uint64_t out_offset;
+    enum slot_state state;
+    bool eof;
+};
+
+struct pipeline {
+    blowfish_stream *stream;
+    int in_fd;
+    int out_fd;
+    struct slot slots[PIPELINE_DEPTH];
+    char error[BLOWFISH_ERROR_SIZE];
+    bool failed;
+};
+
+static void
+fail(struct pipeline *pipeline, char const *what, int error)
+{
+    if (!pipeline->failed) {
+        blowfish_error_to_buffer(pipeline->error, "%s failed: %s", what,
+                                 strerror(error));
+        pipeline->failed = true;
+    }
+}
+
+/* Runs the next slot through the cipher, or finishes at the end of input */
+static bool
+process_slot(blowfish_stream *stream, struct slot *slot, char *error)
+{
+    slot->written = 0;
+    if (slot->eof) {
+        return blowfish_stream_finish(stream, slot->out,
+                                      SLOT_SIZE + PAGE_ALIGNMENT,
+                                      &slot->out_len, blowfish_error_to_buffer,
+                                      error);
+    }
+    return blowfish_stream_update(stream, slot->in, slot->in_len, slot->out,
+                                  SLOT_SIZE + PAGE_ALIGNMENT, &slot->out_len,
+                                  blowfish_error_to_buffer, error);
+}
+
+#ifdef HAVE_IO_URING
+
+struct uring {
+    int fd;
+    unsigned entries;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    unsigned pending;
+    bool fixed;
+};
+
+static void
+close_ring(struct uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED
+        && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+static bool
+open_ring(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array
+                       + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes
+                       + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+                      ? ring->sq_ring
+                      : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+        || ring->sqes == MAP_FAILED)
+    {
+        close_ring(ring);
+        return false;
+    }
+
+    sq = (char *)ring->sq_ring;
+    cq = (char *)ring->cq_ring;
+    ring->sq_head = (_Atomic unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+/* Registers the slot buffers so the kernel does not map them per request */
+static void
+register_buffers(struct uring *ring, struct pipeline *pipeline)
+{
+    struct iovec iov[2 * PIPELINE_DEPTH];
+
+    for (size_t i = 0; i < PIPELINE_DEPTH; ++i) {
+        iov[2 * i].iov_base = pipeline->slots[i].in;
+        iov[2 * i].iov_len = SLOT_SIZE;
+        iov[2 * i + 1].iov_base = pipeline->slots[i].out;
+        iov[2 * i + 1].iov_len = SLOT_SIZE + PAGE_ALIGNMENT;
+    }
+    /* fails under a small RLIMIT_MEMLOCK, plain requests work regardless */
+    ring->fixed = syscall(__NR_io_uring_register, ring->fd,
+                          IORING_REGISTER_BUFFERS, iov, 2 * PIPELINE_DEPTH)
+               == 0;
+}
+
+/* The ring has an entry per slot and a slot has one request at a time */
+static void
+queue_request(struct uring *ring, struct pipeline *pipeline, size_t index,
+              bool write)
+{
+    struct slot *slot = &pipeline->slots[index];
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    unsigned entry = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[entry];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (write) {
+        sqe->opcode = ring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = pipeline->out_fd;
+        sqe->addr = (uint64_t)(uintptr_t)(slot->out + slot->written);
+        sqe->len = (uint32_t)(slot->out_len - slot->written);
+        sqe->off = slot->out_offset + slot->written;
+        sqe->buf_index = (uint16_t)(2 * index + 1);
+        slot->state = SLOT_WRITING;
+    } else {
+        sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = pipeline->in_fd;
+        sqe->addr = (uint64_t)(uintptr_t)(slot->in + slot->in_len);
+        sqe->len = (uint32_t)(slot->want - slot->in_len);
+        sqe->off = slot->in_offset + slot->in_len;
+        sqe->buf_index = (uint16_t)(2 * index);
+        slot->state = SLOT_READING;
+    }
+    sqe->user_data = index;
+    ring->sq_array[entry] = entry;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ++ring->pending;
+}
+
+static bool
+submit_and_wait(struct uring *ring, struct pipeline *pipeline)
+{
+    int submitted;
+
+    do {
+        submitted = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pending,
+                                 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (submitted < 0 && errno == EINTR);
+    if (submitted < 0) {
+        fail(pipeline, "io_uring_enter", errno);
+        return false;
+    }
+    ring->pending -= (unsigned)submitted;
+    return true;
+}
+
+/* Handles one completion, returning the number of requests it requeued */
+static size_t
+complete(struct uring *ring, struct pipeline *pipeline, size_t index,
+         int result)
+{
+    struct slot *slot = &pipeline->slots[index];
+    bool write = slot->state == SLOT_WRITING;
+
+    if (result == -EINTR || result == -EAGAIN) {
+        result = 0; /* nothing moved, ask again */
+    } else if (result < 0) {
+        fail(pipeline, write ? "write" : "read", -result);
+        slot->state = SLOT_IDLE;
+        return 0;
+    } else if (result == 0 && !write) {
+        blowfish_error_to_buffer(pipeline->error, "input shrank while reading");
+        pipeline->failed = true;
+        slot->state = SLOT_IDLE;
+        return 0;
+    }
+
+    if (write) {
+        slot->written += (size_t)result;
+        if (slot->written == slot->out_len) {
+            slot->state = SLOT_IDLE;
+            return 0;
+        }
+    } else {
+        slot->in_len += (size_t)result;
+        if (slot->in_len == slot->want) {
+            slot->state = SLOT_READ;
+            return 0;
+        }
+    }
+    if (pipeline->failed) {
+        slot->state = SLOT_IDLE;
+        return 0;
+    }
+    queue_request(ring, pipeline, index, write); /* short transfer */
+    return 1;
+}
+
+static bool
+run_uring(struct pipeline *pipeline, uint64_t size)
+{
+    struct uring ring;
+    uint64_t read_offset = 0, write_offset = 0;
+    size_t next_read = 0, next_crypt = 0, in_flight = 0;
+    struct slot *last;
+
+    if (!open_ring(&ring, PIPELINE_DEPTH)) {
+        return false;
+    }
+    register_buffers(&ring, pipeline);
+
+    for (;;) {
+        /* the cipher takes slots in file order as their reads complete */
+        while (!pipeline->failed
+               && pipeline->slots[next_crypt % PIPELINE_DEPTH].state
+                      == SLOT_READ)
+        {
+            size_t index = next_crypt++ % PIPELINE_DEPTH;
+            struct slot *slot = &pipeline->slots[index];
+            if (!process_slot(pipeline->stream, slot, pipeline->error)) {
+                pipeline->failed = true;
+                slot->state = SLOT_IDLE;
+            } else if (slot->out_len == 0) {
+                slot->state = SLOT_IDLE;
+            } else {
+                slot->out_offset = write_offset;
+                write_offset += slot->out_len;
+                queue_request(&ring, pipeline, index, true);
+                ++in_flight;
+            }
+        }
+
+        /* and reads go out in the same order as soon as a slot is free */
+        while (!pipeline->failed && read_offset < size
+               && pipeline->slots[next_read % PIPELINE_DEPTH].state
+                      == SLOT_IDLE)
+        {
+            struct slot *slot = &pipeline->slots[next_read % PIPELINE_DEPTH];
+            slot->in_offset = read_offset;
+            slot->in_len = 0;
+            slot->want = size - read_offset < SLOT_SIZE
+                           ? (size_t)(size - read_offset)
+                           : SLOT_SIZE;
+            read_offset += slot->want;
+            queue_request(&ring, pipeline, next_read++ % PIPELINE_DEPTH, false);
+            ++in_flight;
+        }
+        if (in_flight == 0 || !submit_and_wait(&ring, pipeline)) {
+            break;
+        }
+
+        unsigned head = atomic_load_explicit(ring.cq_head,
+                                             memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring.cq_tail,
+                                             memory_order_acquire);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            in_flight += complete(&ring, pipeline, (size_t)cqe->user_data,
+                                  cqe->res);
+            --in_flight;
+        }
+        atomic_store_explicit(ring.cq_head, head, memory_order_release);
+    }
+
+    close_ring(&ring);
+    if (pipeline->failed) {
+        return true;
+    }
+
+    /* padding, or the held back unit, goes out with a plain write */
+    last = &pipeline->slots[0];
+    last->eof = true;
+    if (!process_slot(pipeline->stream, last, pipeline->error)) {
+        pipeline->failed = true;
+    } else if (last->out_len > 0) {
+        if (lseek(pipeline->out_fd, (off_t)write_offset, SEEK_SET) < 0) {
+            fail(pipeline, "seek", errno);
+        } else if (!write_fully(pipeline->out_fd, last->out, last->out_len,
+                                blowfish_error_to_buffer, pipeline->error))
+        {
+            pipeline->failed = true;
+        }
+    }
+    return true;
+}
+
+#endif /* HAVE_IO_URING */
+
+/*
+ * The thread pipeline: every stage walks the slots in order and waits
+ * for the one before it under a single lock.  Slots are large, so the
+ * lock is taken a few times per 256 KiB.
+ */
+struct relay {
+    struct pipeline *pipeline;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static struct slot *
+wait_for(struct relay *relay, size_t seq, enum slot_state state)
+{
+    struct slot *slot = &relay->pipeline->slots[seq % PIPELINE_DEPTH];
+
+    pthread_mutex_lock(&relay->lock);
+    while (slot->state != state && !relay->pipeline->failed) {
+        pthread_cond_wait(&relay->changed, &relay->lock);
+    }
+    if (relay->pipeline->failed) {
+        slot = NULL;
+    }
+    pthread_mutex_unlock(&relay->lock);
+    return slot;
+}
+
+static void
+hand_on(struct relay *relay, struct slot *slot, enum slot_state state)
+{
+    pthread_mutex_lock(&relay->lock);
+    if (slot != NULL) {
+        slot->state = state;
+    }
+    pthread_cond_broadcast(&relay->changed);
+    pthread_mutex_unlock(&relay->lock);
+}
+
+static void
+relay_failed(struct relay *relay, char const *error)
+{
+    pthread_mutex_lock(&relay->lock);
+    if (!relay->pipeline->failed) {
+        blowfish_error_to_buffer(relay->pipeline->error, "%s", error);
+        relay->pipeline->failed = true;
+    }
+    pthread_cond_broadcast(&relay->changed);
+    pthread_mutex_unlock(&relay->lock);
+}
+
+static void *
+read_slots(void *arg)
+{
+    struct relay *relay = (struct relay *)arg;
+    char error[BLOWFISH_ERROR_SIZE];
+    struct slot *slot;
+
+    for (size_t seq = 0; (slot = wait_for(relay, seq, SLOT_IDLE)) != NULL;
+         ++seq)
+    {
+        ssize_t nread;
+        do {
+            nread = read(relay->pipeline->in_fd, slot->in, SLOT_SIZE);
+        } while (nread < 0 && errno == EINTR);
+        if (nread < 0) {
+            blowfish_error_to_buffer(error, "read failed: %s",
+                                     strerror(errno));
+            relay_failed(relay, error);
+            break;
+        }
+        slot->in_len = (size_t)nread;
+        slot->eof = nread == 0;
+        hand_on(relay, slot, SLOT_READ);
+        if (slot->eof) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *
+write_slots(void *arg)
+{
+    struct relay *relay = (struct relay *)arg;
+    char error[BLOWFISH_ERROR_SIZE];
+    struct slot *slot;
+
+    for (size_t seq = 0;
+         (slot = wait_for(relay, seq, SLOT_PROCESSED)) != NULL; ++seq)
+    {
+        bool eof = slot->eof;
+        if (!write_fully(relay->pipeline->out_fd, slot->out, slot->out_len,
+                         blowfish_error_to_buffer, error))
+        {
+            relay_failed(relay, error);
+            break;
+        }
+        hand_on(relay, slot, SLOT_IDLE);
+        if (eof) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void
+run_threads(struct pipeline *pipeline)
+{
+    struct relay relay = {.pipeline = pipeline};
+    pthread_t reader, writer;
+    struct slot *slot;
+
+    pthread_mutex_init(&relay.lock, NULL);
+    pthread_cond_init(&relay.changed, NULL);
+    if (pthread_create(&reader, NULL, read_slots, &relay) != 0) {
+        fail(pipeline, "pthread_create", EAGAIN);
+    } else {
+        if (pthread_create(&writer, NULL, write_slots, &relay) != 0) {
+            relay_failed(&relay, "pthread_create failed");
+        } else {
+            for (size_t seq = 0;
+                 (slot = wait_for(&relay, seq, SLOT_READ)) != NULL; ++seq)
+            {
+                bool eof = slot->eof;
+                char error[BLOWFISH_ERROR_SIZE];
+                if (!process_slot(pipeline->stream, slot, error)) {
+                    relay_failed(&relay, error);
+                    break;
+                }
+                hand_on(&relay, slot, SLOT_PROCESSED);
+                if (eof) {
+                    break;
+                }
+            }
+            pthread_join(writer, NULL);
+        }
+        pthread_join(reader, NULL);
+    }
+    pthread_cond_destroy(&relay.changed);
+    pthread_mutex_destroy(&relay.lock);
+}
+
+bool
+pipeline_stream(blowfish_stream *stream, int in_fd, int out_fd,
+                error_function on_error, void *err_context)
+{
+    struct pipeline pipeline;
+    uint8_t *buffers;
+    struct stat in_info, out_info;
+    bool done = false;
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.stream = stream;
+    pipeline.in_fd = in_fd;
+    pipeline.out_fd = out_fd;
+    buffers = aligned_alloc(PAGE_ALIGNMENT,
+                            PIPELINE_DEPTH * (2 * SLOT_SIZE + PAGE_ALIGNMENT));
+    if (buffers == NULL) {
+        on_error(err_context, "failed to allocate stream buffers");
+        return false;
+    }
+    for (size_t i = 0; i < PIPELINE_DEPTH; ++i) {
+        uint8_t *base = buffers + i * (2 * SLOT_SIZE + PAGE_ALIGNMENT);
+        pipeline.slots[i].in = base;
+        pipeline.slots[i].out = base + SLOT_SIZE;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#ifdef HAVE_IO_URING
+    /* offsets only mean something for regular files */
+    if (fstat(in_fd, &in_info) == 0 && S_ISREG(in_info.st_mode)
+        && fstat(out_fd, &out_info) == 0 && S_ISREG(out_info.st_mode)
+        && lseek(in_fd, 0, SEEK_CUR) == 0 && lseek(out_fd, 0, SEEK_CUR) == 0)
+    {
+        done = run_uring(&pipeline, (uint64_t)in_info.st_size);
+    }
+#else
+    (void)in_info;
+    (void)out_info;
+#endif
+    if (!done) {
+        run_threads(&pipeline);
+    }
+
+    free(buffers);
+    if (pipeline.failed) {
+        on_error(err_context, "%s", pipeline.error);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,266 @@
+/*
+ * Record mode for the command line tools.
+ *
+ * Lines are read through a large stdio buffer and results are collected
+ * in a buffer of our own that goes out with one write() per megabyte.
+ * The decode and result buffers only grow, so a steady stream of
+ * records does not allocate.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "blowfish.h"
+#include "cli-lib.h"
+
+#define IO_BUFFER_SIZE ((size_t)1024 * 1024)
+
+struct writer {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+struct records {
+    blowfish_state *state;
+    bool encrypt;
+    enum text_encoding encoding;
+    uint8_t initial_iv[BLOWFISH_BLOCK_SIZE]; /* the one on the command line */
+    size_t initial_iv_len;
+    struct writer out;
+    uint8_t *message;
+    size_t message_size;
+    uint8_t *result;
+    size_t result_size;
+};
+
+static bool
+flush_writer(struct writer *writer)
+{
+    bool ok = write_fully(writer->fd, (uint8_t const *)writer->buf,
+                          writer->len, &report_error, stderr);
+    writer->len = 0;
+    return ok;
+}
+
+/* Returns room for `len` more characters, flushing or growing as needed */
+static char *
+reserve(struct writer *writer, size_t len)
+{
+    if (writer->len + len > writer->size && !flush_writer(writer)) {
+        return NULL;
+    }
+    if (len > writer->size) {
+        char *buf = realloc(writer->buf, len);
+        if (buf == NULL) {
+            report_error(stderr, "failed to allocate %zu bytes", len);
+            return NULL;
+        }
+        writer->buf = buf;
+        writer->size = len;
+    }
+    return writer->buf + writer->len;
+}
+
+static bool
+grow(uint8_t **buf, size_t *size, size_t needed)
+{
+    if (needed > *size) {
+        uint8_t *bigger = realloc(*buf, needed);
+        if (bigger == NULL) {
+            return false;
+        }
+        *buf = bigger;
+        *size = needed;
+    }
+    return true;
+}
+
+/* Processes one record into `records->result`, returning its length */
+static bool
+crypt_record(struct records *records, char const *line, size_t len,
+             char const *iv_text, size_t iv_len, size_t *result_len,
+             char *error)
+{
+    blowfish_state *state = records->state;
+    uint8_t iv[2 * BLOWFISH_BLOCK_SIZE]; /* room for any decoded length */
+    size_t msg_len, decoded_iv_len;
+
+    /* a record's own IV replaces the initial one, so put it back */
+    if (iv_text == NULL) {
+        if (!blowfish_set_iv(state,
+                             records->initial_iv_len ? records->initial_iv
+                                                     : NULL,
+                             records->initial_iv_len, blowfish_error_to_buffer,
+                             error))
+        {
+            return false;
+        }
+    } else if (iv_len > sizeof(iv)
+               || !decode_text(records->encoding, iv_text, iv_len, iv,
+                               &decoded_iv_len)
+               || !blowfish_set_iv(state, iv, decoded_iv_len,
+                                   blowfish_error_to_buffer, error))
+    {
+        if (error[0] == '\0') {
+            blowfish_error_to_buffer(error, "invalid initialization vector");
+        }
+        return false;
+    }
+
+    if (!grow(&records->message, &records->message_size, len + 1)
+        || !grow(&records->result, &records->result_size,
+                 len + BLOWFISH_BLOCK_SIZE))
+    {
+        blowfish_error_to_buffer(error, "out of memory");
+        return false;
+    }
+    if (!decode_text(records->encoding, line, len, records->message,
+                     &msg_len))
+    {
+        blowfish_error_to_buffer(error, "record is not valid %s",
+                                 records->encoding == ENCODING_HEX ? "hex"
+                                                                   : "base64");
+        return false;
+    }
+    if (records->encrypt) {
+        return blowfish_encrypt_into(state, records->message, msg_len,
+                                     records->result, records->result_size,
+                                     result_len, blowfish_error_to_buffer,
+                                     error);
+    }
+    return blowfish_decrypt_into(state, records->message, msg_len,
+                                 records->result, records->result_size,
+                                 result_len, blowfish_error_to_buffer, error);
+}
+
+/* Writes the result line for `line`, empty when the record failed */
+static bool
+process_record(struct records *records, char *line, size_t len,
+               size_t number, bool *failed)
+{
+    char error[BLOWFISH_ERROR_SIZE] = "";
+    char *colon = memchr(line, ':', len);
+    char const *iv_text = NULL;
+    size_t iv_len = 0, result_len = 0;
+    char *out;
+
+    if (colon != NULL) {
+        iv_text = line;
+        iv_len = (size_t)(colon - line);
+        len -= iv_len + 1;
+        line = colon + 1;
+    }
+
+    if (!crypt_record(records, line, len, iv_text, iv_len, &result_len,
+                      error))
+    {
+        fprintf(stderr, "ERROR: record %zu: %s\n", number, error);
+        *failed = true;
+        result_len = 0;
+        iv_text = NULL;
+    }
+
+    /* encryption keeps the IV so that the line can be decrypted again */
+    if (!records->encrypt) {
+        iv_text = NULL;
+    }
+    out = reserve(&records->out,
+                  (iv_text ? iv_len + 1 : 0)
+                      + encoded_size(records->encoding, result_len) + 1);
+    if (out == NULL) {
+        return false;
+    }
+    if (iv_text != NULL) {
+        memcpy(out, iv_text, iv_len);
+        out[iv_len] = ':';
+        out += iv_len + 1;
+    }
+    out += encode_text(records->encoding, records->result, result_len, out);
+    *out++ = '\n';
+    records->out.len = (size_t)(out - records->out.buf);
+    return true;
+}
+
+bool
+run_records(blowfish_state *state, bool encrypt, enum text_encoding encoding,
+            char const *in_path, char const *out_path)
+{
+    struct records records;
+    FILE *in;
+    char *line = NULL;
+    size_t line_size = 0, number = 0;
+    ssize_t line_len;
+    bool ok = true, failed = false;
+
+    memset(&records, 0, sizeof(records));
+    records.state = state;
+    records.encrypt = encrypt;
+    records.encoding = encoding;
+    if (state->mode != MODE_ECB) {
+        memcpy(records.initial_iv, state->initial_iv,
+               sizeof(records.initial_iv));
+        records.initial_iv_len = sizeof(records.initial_iv);
+    }
+
+    in = in_path == NULL || strcmp(in_path, "-") == 0 ? stdin
+                                                     : fopen(in_path, "r");
+    if (in == NULL) {
+        report_error(stderr, "failed to open %s: %s", in_path,
+                     strerror(errno));
+        return false;
+    }
+    setvbuf(in, NULL, _IOFBF, IO_BUFFER_SIZE);
+    /* not truncated until it is known not to be the input */
+    records.out.fd = open_or_default(out_path, O_WRONLY | O_CREAT,
+                                     STDOUT_FILENO);
+    records.out.buf = malloc(IO_BUFFER_SIZE);
+    records.out.size = IO_BUFFER_SIZE;
+    if (records.out.fd < 0 || records.out.buf == NULL) {
+        ok = false;
+    } else if (same_file(fileno(in), records.out.fd)) {
+        fprintf(stderr, "ERROR: input and output are the same file\n");
+        ok = false;
+    } else if (records.out.fd != STDOUT_FILENO
+               && ftruncate(records.out.fd, 0) != 0)
+    {
+        report_error(stderr, "failed to truncate %s: %s", out_path,
+                     strerror(errno));
+        ok = false;
+    }
+
+    while (ok && (line_len = getline(&line, &line_size, in)) > 0) {
+        ++number;
+        while (line_len > 0
+               && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+        {
+            --line_len;
+        }
+        ok = process_record(&records, line, (size_t)line_len, number,
+                            &failed);
+    }
+    if (ok && ferror(in)) {
+        report_error(stderr, "read failed: %s", strerror(errno));
+        ok = false;
+    }
+    if (records.out.fd >= 0) {
+        ok = flush_writer(&records.out) && ok;
+        if (records.out.fd > STDERR_FILENO) {
+            close(records.out.fd);
+        }
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    free(line);
+    free(records.out.buf);
+    free(records.message);
+    free(records.result);
+    return ok && !failed;
+}
@@ -9,21 +9,35 @@
 int
 main(int argc, char *argv[])
 {
-    uint8_t *key, *iv;
-    size_t key_len, iv_len;
-
-    if (argc != 3 && argc != 4) {
-        fprintf(stderr, "Usage: %s MODE KEY [IV]\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    blowfish_mode mode = get_mode_or_fail(argv[1]);
-    key = from_hex_or_fail(argv[2], &key_len);
-    iv = from_hex_or_fail(argv[3], &iv_len);
+    struct cli_options options;
+    int status = EXIT_SUCCESS;
 
+    parse_options_or_fail(argc, argv, false, &options);
     blowfish_state *state =
-        blowfish_new(key, key_len, iv, iv_len, mode, 0, &report_error, stderr);
-    if (state != NULL) {
+        blowfish_new(options.key, options.key_len, options.iv, options.iv_len,
+                     options.mode, 0, &report_error, stderr);
+    if (state == NULL) {
+        status = EXIT_FAILURE;
+    } else if (options.num_batch_paths > 0) {
+        if (!run_batch(state, &options.batch, options.batch_paths,
+                       options.num_batch_paths))
+        {
+            status = EXIT_FAILURE;
+        }
+        blowfish_free(state);
+    } else if (options.records) {
+        if (!run_records(state, false, options.encoding, options.in_path,
+                         options.out_path))
+        {
+            status = EXIT_FAILURE;
+        }
+        blowfish_free(state);
+    } else if (options.in_path != NULL || options.out_path != NULL) {
+        if (!stream_file(state, false, options.in_path, options.out_path)) {
+            status = EXIT_FAILURE;
+        }
+        blowfish_free(state);
+    } else {
         printf("Hex Ciphertext: ");
         fflush(stdout);
         while (true) {
@@ -39,7 +53,7 @@ main(int argc, char *argv[])
                                  &report_error, stderr);
             if (plaintext) {
                 hexdump(stdout, plaintext, plain_len);
-                free(plaintext);
+                blowfish_release(plaintext);
             }
             free(ciphertext);
 
@@ -49,10 +63,7 @@ main(int argc, char *argv[])
         }
         blowfish_free(state);
     }
-    free(key);
-    if (iv) {
-        free(iv);
-    }
+    free_options(&options);
 
-    return 0;
+    return status;
 }
@@ -8,19 +8,36 @@
 int
 main(int argc, char *argv[])
 {
-    if (argc != 3 && argc != 4) {
-        fprintf(stderr, "Usage: %s MODE KEY [IV]\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
+    struct cli_options options;
+    int status = EXIT_SUCCESS;
 
-    size_t key_len, iv_len;
-    blowfish_mode mode = get_mode_or_fail(argv[1]);
-    uint8_t *key = from_hex_or_fail(argv[2], &key_len);
-    uint8_t *iv = from_hex_or_fail(argv[3], &iv_len);
+    parse_options_or_fail(argc, argv, true, &options);
     blowfish_state *state =
-        blowfish_new(key, key_len, iv, iv_len, mode, 0, &report_error, stderr);
+        blowfish_new(options.key, options.key_len, options.iv, options.iv_len,
+                     options.mode, 0, &report_error, stderr);
     char plaintext[512];
-    if (state != NULL) {
+    if (state == NULL) {
+        status = EXIT_FAILURE;
+    } else if (options.num_batch_paths > 0) {
+        if (!run_batch(state, &options.batch, options.batch_paths,
+                       options.num_batch_paths))
+        {
+            status = EXIT_FAILURE;
+        }
+        blowfish_free(state);
+    } else if (options.records) {
+        if (!run_records(state, true, options.encoding, options.in_path,
+                         options.out_path))
+        {
+            status = EXIT_FAILURE;
+        }
+        blowfish_free(state);
+    } else if (options.in_path != NULL || options.out_path != NULL) {
+        if (!stream_file(state, true, options.in_path, options.out_path)) {
+            status = EXIT_FAILURE;
+        }
+        blowfish_free(state);
+    } else {
         printf("Plain text: ");
         fflush(stdout);
         while (fgets(&plaintext[0], sizeof(plaintext), stdin)) {
@@ -33,7 +50,7 @@ main(int argc, char *argv[])
                 &report_error, stderr);
             if (ciphertext) {
                 hexdump(stdout, ciphertext, cipher_len);
-                free(ciphertext);
+                blowfish_release(ciphertext);
             }
 
             printf("Plain text: ");
@@ -42,10 +59,7 @@ main(int argc, char *argv[])
         }
         blowfish_free(state);
     }
-    free(key);
-    if (iv) {
-        free(iv);
-    }
+    free_options(&options);
 
-    return 0;
+    return status;
 }
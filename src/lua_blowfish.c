@@ -1,39 +1,205 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#    include <sys/eventfd.h>
+#endif
 
 #include <lauxlib.h>
 
+#include "blowfish-internal.h"
 #include "blowfish.h"
 
+#if LUA_VERSION_NUM >= 502
+#    define lua_objlen(L, i) lua_rawlen(L, (i))
+#    define lua_setfenv(L, i) lua_setuservalue(L, (i))
+#endif
+
 static const char TABLE_NAME[] = "Blowfish.state";
+static const char JOB_TABLE_NAME[] = "Blowfish.job";
+static const char STREAM_TABLE_NAME[] = "Blowfish.stream";
+static const char BUFFER_TABLE_NAME[] = "Blowfish.buffer";
+static const char SCHEDULE_TABLE_NAME[] = "Blowfish.schedule";
+
+/*
+ * An encrypt or decrypt call running on the thread pool.  The job works
+ * on a snapshot of the keychain so the keychain may be used, or
+ * collected, while it runs.  It is owned by both the worker and the Lua
+ * handle and freed by whichever lets go last.  `fd` becomes readable
+ * once `done` is set.
+ */
+struct async_job {
+    blowfish_state state;
+    struct bf_task task;
+    _Atomic int refs;
+    _Atomic bool done;
+    bool encrypt;
+    bool ok;
+    int fd[2]; /* an eventfd uses fd[0] for both ends */
+    uint8_t *buf;
+    size_t len; /* input length, output length once done */
+    size_t buf_size;
+    char error[BLOWFISH_ERROR_SIZE];
+};
+
+/*
+ * A message processed in pieces.  Like a job it works on its own copy of
+ * the keychain, so every stream starts from the keychain's IV and does
+ * not disturb other calls.  `state` comes first so the userdata can be
+ * aligned for it.
+ */
+struct lua_stream {
+    blowfish_state state;
+    blowfish_stream stream;
+};
+
+/* Mutable bytes that keychains write into instead of creating strings */
+struct lua_buffer {
+    size_t capacity;
+    size_t len;
+    uint8_t data[];
+};
+
+/*
+ * A reference to a named schedule in the process-wide registry.  Other
+ * Lua states reach the same schedule through its name.  Keychains bound
+ * to it keep the handle alive through their environment table.
+ */
+struct lua_schedule {
+    blowfish_schedule const *schedule;
+    char name[];
+};
+
+/*
+ * Process-wide so that forked workers inherit the mapping, and shared by
+ * every Lua state, so set under a lock.  Once open it is never closed.
+ */
+static pthread_mutex_t shared_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static blowfish_cache *shared_cache = NULL;
+static char shared_cache_name[256];
+
+static blowfish_cache *current_cache(void);
+static inline blowfish_state *align_state(void *);
 static inline blowfish_state *extract_state(lua_State *);
+static inline struct lua_schedule *extract_schedule(lua_State *, int);
+static void keep_schedule(lua_State *, int);
 static void on_error(void *, char const *, ...);
 static void return_error(void *, char const *, ...);
 
 static int new_blowfish(lua_State *);
+static int use_shared_cache(lua_State *);
+static int threads(lua_State *);
+static int stats(lua_State *);
+static int track_latency(lua_State *);
+static int new_buffer(lua_State *);
+static int new_schedule(lua_State *);
 static int decrypt(lua_State *);
+static int decrypt_async(lua_State *);
+static int decrypt_into(lua_State *);
+static int decrypt_many(lua_State *);
+static int decrypt_slices(lua_State *);
 static int encrypt(lua_State *);
+static int encrypt_async(lua_State *);
+static int encrypt_into(lua_State *);
+static int encrypt_many(lua_State *);
+static int encrypt_slices(lua_State *);
+static int rekey(lua_State *);
 static int reset(lua_State *);
+static int set_iv(lua_State *);
+static int stream(lua_State *);
 static int to_string(lua_State *);
 static int enable_pkcs7_padding(lua_State *L);
 static int disable_pkcs7_padding(lua_State *L);
+static int job_fd(lua_State *);
+static int job_ready(lua_State *);
+static int job_result(lua_State *);
+static int job_gc(lua_State *);
+static int stream_update(lua_State *);
+static int stream_finish(lua_State *);
+static int stream_gc(lua_State *);
+static int buffer_capacity(lua_State *);
+static int buffer_clear(lua_State *);
+static int buffer_len(lua_State *);
+static int buffer_set(lua_State *);
+static int buffer_sub(lua_State *);
+static int buffer_tostring(lua_State *);
+static int schedule_name(lua_State *);
+static int schedule_gc(lua_State *);
 
 static const struct luaL_Reg functions[] = {
+    {"buffer", new_buffer},
     {"new", new_blowfish},
+    {"schedule", new_schedule},
+    {"stats", stats},
+    {"threads", threads},
+    {"track_latency", track_latency},
+    {"use_shared_cache", use_shared_cache},
     {NULL, NULL},
 };
 
 static const struct luaL_Reg methods[] = {
     {"decrypt", decrypt},
+    {"decrypt_async", decrypt_async},
+    {"decrypt_into", decrypt_into},
+    {"decrypt_many", decrypt_many},
+    {"decrypt_slices", decrypt_slices},
     {"disable_pkcs7_padding", disable_pkcs7_padding},
     {"enable_pkcs7_padding", enable_pkcs7_padding},
     {"encrypt", encrypt},
+    {"encrypt_async", encrypt_async},
+    {"encrypt_into", encrypt_into},
+    {"encrypt_many", encrypt_many},
+    {"encrypt_slices", encrypt_slices},
+    {"rekey", rekey},
     {"reset", reset},
+    {"set_iv", set_iv},
+    {"stream", stream},
     {"__tostring", to_string},
     {NULL, NULL},
 };
 
+static const struct luaL_Reg job_methods[] = {
+    {"fd", job_fd},
+    {"ready", job_ready},
+    {"result", job_result},
+    {"__gc", job_gc},
+    {NULL, NULL},
+};
+
+static const struct luaL_Reg stream_methods[] = {
+    {"finish", stream_finish},
+    {"update", stream_update},
+    {"__gc", stream_gc},
+    {NULL, NULL},
+};
+
+static const struct luaL_Reg buffer_methods[] = {
+    {"capacity", buffer_capacity},
+    {"clear", buffer_clear},
+    {"len", buffer_len},
+    {"set", buffer_set},
+    {"sub", buffer_sub},
+    {"tostring", buffer_tostring},
+    {"__len", buffer_len},
+    {"__tostring", buffer_tostring},
+    {NULL, NULL},
+};
+
+static const struct luaL_Reg schedule_methods[] = {
+    {"name", schedule_name},
+    {"__gc", schedule_gc},
+    {"__tostring", schedule_name},
+    {NULL, NULL},
+};
+
 static const struct {
     blowfish_mode mode;
     char const *label;
@@ -51,6 +217,34 @@ luaopen_blowfish(lua_State *L)
     lua_settable(L, -3);               /* metatable.__index = metatable */
     luaL_openlib(L, NULL, methods, 0); /* load methods into metatable */
 
+    luaL_newmetatable(L, JOB_TABLE_NAME);
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, job_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, STREAM_TABLE_NAME);
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, stream_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, BUFFER_TABLE_NAME);
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, buffer_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, SCHEDULE_TABLE_NAME);
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    luaL_openlib(L, NULL, schedule_methods, 0);
+    lua_pop(L, 1);
+
     /* open the exported table, add the functions, then the enum constants */
     luaL_openlib(L, "blowfish", functions, 0);
     for (size_t i = 0; i < sizeof(labels) / sizeof(labels[0]); ++i) {
@@ -65,22 +259,32 @@ luaopen_blowfish(lua_State *L)
 static int
 new_blowfish(lua_State *L)
 {
-    char const *key, *iv;
-    size_t key_len, iv_len;
+    char const *key = NULL, *iv;
+    size_t key_len = 0, iv_len;
     lua_Integer mode, segment_size;
     bool enable_padding = true;
+    blowfish_schedule const *schedule = NULL;
+    blowfish_cache *cache;
+    size_t state_size = sizeof(blowfish_state);
 
     mode = luaL_checkinteger(L, 1);
-    key = luaL_checklstring(L, 2, &key_len);
+    if (lua_isuserdata(L, 2)) {
+        schedule = extract_schedule(L, 2)->schedule;
+        state_size = BLOWFISH_SHARED_STATE_SIZE;
+    } else {
+        key = luaL_checklstring(L, 2, &key_len);
+    }
     iv = luaL_optlstring(L, 3, NULL, &iv_len);
     segment_size = luaL_optinteger(L, 4, 8);
     if (!lua_isnil(L, 5)) {
         enable_padding = lua_tonumber(L, 5);
     }
 
-    luaL_argcheck(L, key_len > 0, 2, "non-empty key required");
-    luaL_argcheck(L, key_len >= 4 && key_len <= 56, 2,
-                  "key length must be between 4 and 56 bytes");
+    if (key != NULL) {
+        luaL_argcheck(L, key_len > 0, 2, "non-empty key required");
+        luaL_argcheck(L, key_len >= 4 && key_len <= 56, 2,
+                      "key length must be between 4 and 56 bytes");
+    }
     switch (mode) {
     case MODE_CBC:
     case MODE_CFB:
@@ -109,26 +313,327 @@ new_blowfish(lua_State *L)
         break;
     }
 
+    /* a context bound to the shared cache has no room for its own keys */
+    if (schedule == NULL && (cache = current_cache()) != NULL) {
+        schedule = blowfish_cache_acquire(cache, (uint8_t *)key, key_len,
+                                          on_error, L);
+        if (schedule != NULL) {
+            state_size = BLOWFISH_SHARED_STATE_SIZE;
+        }
+    }
+
+    /* userdata is not cache-line aligned so leave room to align it */
     blowfish_state *state =
-        (blowfish_state *)lua_newuserdata(L, sizeof(blowfish_state));
-    if (blowfish_init(state, (uint8_t *)key, (size_t)key_len, (uint8_t *)iv,
-                      (size_t)iv_len, (blowfish_mode)mode, (int)segment_size,
-                      on_error, L))
+        align_state(lua_newuserdata(L, state_size + BLOWFISH_ALIGNMENT - 1));
+    if (schedule != NULL
+            ? blowfish_init_with_schedule(state, schedule, (uint8_t *)iv,
+                                          (size_t)iv_len, (blowfish_mode)mode,
+                                          (int)segment_size, on_error, L)
+            : blowfish_init(state, (uint8_t *)key, (size_t)key_len,
+                            (uint8_t *)iv, (size_t)iv_len, (blowfish_mode)mode,
+                            (int)segment_size, on_error, L))
     {
         state->pkcs7padding = enable_padding;
         luaL_getmetatable(L, TABLE_NAME);
         lua_setmetatable(L, -2);
+        if (key == NULL) {
+            keep_schedule(L, 2);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static blowfish_cache *
+current_cache(void)
+{
+    blowfish_cache *cache;
+
+    pthread_mutex_lock(&shared_cache_lock);
+    cache = shared_cache;
+    pthread_mutex_unlock(&shared_cache_lock);
+    return cache;
+}
+
+static int
+use_shared_cache(lua_State *L)
+{
+    size_t name_len;
+    char const *name = luaL_checklstring(L, 1, &name_len);
+    lua_Integer slots = luaL_optinteger(L, 2, 0);
+    char error[BLOWFISH_ERROR_SIZE] = "";
+
+    luaL_argcheck(L, name_len < sizeof(shared_cache_name), 1,
+                  "cache name is too long");
+    luaL_argcheck(L, slots >= 0, 2, "slot count cannot be negative");
+
+    /* nothing that can raise a Lua error while the lock is held */
+    pthread_mutex_lock(&shared_cache_lock);
+    if (shared_cache != NULL) {
+        if (strcmp(name, shared_cache_name) != 0) {
+            blowfish_error_to_buffer(error,
+                                     "shared key cache %s is already in use",
+                                     shared_cache_name);
+        }
+    } else {
+        shared_cache = blowfish_cache_open(name, (size_t)slots,
+                                           blowfish_error_to_buffer, error);
+        if (shared_cache != NULL) {
+            memcpy(shared_cache_name, name, name_len + 1);
+        }
+    }
+    pthread_mutex_unlock(&shared_cache_lock);
+
+    if (error[0] != '\0') {
+        return_error(L, "%s", error);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+threads(lua_State *L)
+{
+    lua_Integer count = luaL_checkinteger(L, 1);
+
+    luaL_argcheck(L, count >= 0 && count <= BLOWFISH_MAX_THREADS, 1,
+                  "thread count out of range");
+    blowfish_threads_stop();
+    if (count > 0
+        && !blowfish_threads_start((unsigned)count, return_error, L))
+    {
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Sets t[key] to a table of the counts by direction of each mode */
+static void
+push_by_mode(lua_State *L, char const *key, uint64_t const values[][2])
+{
+    lua_newtable(L);
+    for (size_t i = 0; i < sizeof(labels) / sizeof(labels[0]); ++i) {
+        if (labels[i].mode == MODE_CTR) {
+            continue; /* not implemented */
+        }
+        lua_newtable(L);
+        lua_pushnumber(L, (lua_Number)values[labels[i].mode][1]);
+        lua_setfield(L, -2, "encrypt");
+        lua_pushnumber(L, (lua_Number)values[labels[i].mode][0]);
+        lua_setfield(L, -2, "decrypt");
+        lua_setfield(L, -2, labels[i].label);
+    }
+    lua_setfield(L, -2, key);
+}
+
+static void
+push_histogram(lua_State *L, char const *key,
+               blowfish_histogram const *histogram)
+{
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)histogram->count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, (lua_Number)histogram->sum_ns);
+    lua_setfield(L, -2, "sum_ns");
+    lua_newtable(L);
+    for (int i = 0; i < BLOWFISH_STATS_BUCKETS; ++i) {
+        lua_pushnumber(L, (lua_Number)histogram->buckets[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "buckets");
+    lua_setfield(L, -2, key);
+}
+
+static int
+stats(lua_State *L)
+{
+    static char const *const formats[] = {"table", "prometheus", NULL};
+    bool prometheus = luaL_checkoption(L, 1, "table", formats) == 1;
+    blowfish_stats snapshot;
+
+    blowfish_stats_snapshot(&snapshot);
+    if (prometheus) {
+        size_t len = blowfish_stats_prometheus(&snapshot, NULL, 0);
+        char *text = lua_newuserdata(L, len + 1); /* collected with L */
+
+        blowfish_stats_prometheus(&snapshot, text, len + 1);
+        lua_pushlstring(L, text, len);
         return 1;
     }
+
+    lua_newtable(L);
+    push_by_mode(L, "operations", snapshot.operations);
+    push_by_mode(L, "bytes", snapshot.bytes);
+    lua_pushnumber(L, (lua_Number)snapshot.key_expansions);
+    lua_setfield(L, -2, "key_expansions");
+    lua_pushnumber(L, (lua_Number)snapshot.padding_failures);
+    lua_setfield(L, -2, "padding_failures");
+    lua_pushnumber(L, (lua_Number)snapshot.allocations);
+    lua_setfield(L, -2, "allocations");
+    lua_newtable(L);
+    push_histogram(L, "encrypt", &snapshot.latency[BLOWFISH_LATENCY_ENCRYPT]);
+    push_histogram(L, "decrypt", &snapshot.latency[BLOWFISH_LATENCY_DECRYPT]);
+    push_histogram(L, "key_setup",
+                   &snapshot.latency[BLOWFISH_LATENCY_KEY_SETUP]);
+    lua_setfield(L, -2, "latency");
+    return 1;
+}
+
+static int
+track_latency(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TBOOLEAN);
+    blowfish_stats_track_latency(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int
+new_schedule(lua_State *L)
+{
+    size_t name_len, key_len;
+    char const *name = luaL_checklstring(L, 1, &name_len);
+    char const *key = luaL_optlstring(L, 2, NULL, &key_len);
+    struct lua_schedule *self;
+
+    /* the handle owns the reference from here on so errors cannot leak it */
+    self = (struct lua_schedule *)lua_newuserdata(L, sizeof(*self) + name_len
+                                                         + 1);
+    self->schedule = NULL;
+    memcpy(self->name, name, name_len + 1);
+    luaL_getmetatable(L, SCHEDULE_TABLE_NAME);
+    lua_setmetatable(L, -2);
+
+    self->schedule =
+        key != NULL ? blowfish_schedule_acquire(name, (uint8_t const *)key,
+                                                key_len, return_error, L)
+                    : blowfish_schedule_find(name, return_error, L);
+    return self->schedule != NULL ? 1 : 2;
+}
+
+static inline struct lua_schedule *
+extract_schedule(lua_State *L, int index)
+{
+    struct lua_schedule *self =
+        (struct lua_schedule *)luaL_checkudata(L, index, SCHEDULE_TABLE_NAME);
+    luaL_argcheck(L, self != NULL && self->schedule != NULL, index,
+                  "`Blowfish.schedule' expected");
+    return self;
+}
+
+/* Ties the schedule handle at `handle` to the userdata on top */
+static void
+keep_schedule(lua_State *L, int handle)
+{
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, handle);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+}
+
+static int
+schedule_name(lua_State *L)
+{
+    lua_pushstring(L, extract_schedule(L, 1)->name);
+    return 1;
+}
+
+static int
+schedule_gc(lua_State *L)
+{
+    struct lua_schedule *self =
+        (struct lua_schedule *)luaL_checkudata(L, 1, SCHEDULE_TABLE_NAME);
+    blowfish_schedule_release(self->schedule);
+    self->schedule = NULL;
     return 0;
 }
 
+static inline blowfish_state *
+align_state(void *ptr)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+    addr = (addr + BLOWFISH_ALIGNMENT - 1)
+         & ~(uintptr_t)(BLOWFISH_ALIGNMENT - 1);
+    return (blowfish_state *)addr;
+}
+
 static inline blowfish_state *
 extract_state(lua_State *L)
 {
     void *maybe_state = luaL_checkudata(L, 1, TABLE_NAME);
     luaL_argcheck(L, maybe_state != NULL, 1, "`Blowfish.state' expected");
-    return (blowfish_state *)maybe_state;
+    return align_state(maybe_state);
+}
+
+/*
+ * Runs `crypt` straight into the storage of the result string.  Lua 5.1
+ * and LuaJIT cannot size a buffer up front, so results that do not fit
+ * the buffer's own storage are written to a scratch userdata and copied
+ * by lua_pushlstring: two collected allocations and a copy.  The PKCS#7
+ * length is only known afterwards, so the string is cut to whatever
+ * `crypt` produced.
+ */
+typedef bool (*crypt_function)(blowfish_state *, uint8_t const *, size_t,
+                               uint8_t *, size_t, size_t *, error_function,
+                               void *);
+
+static int
+push_result(lua_State *L, blowfish_state *state, crypt_function crypt,
+            char const *msg, size_t msg_len, size_t out_size)
+{
+    luaL_Buffer buffer;
+    size_t out_len;
+    char *out;
+
+#if LUA_VERSION_NUM >= 502
+    out = luaL_buffinitsize(L, &buffer, out_size);
+    if (!crypt(state, (uint8_t const *)msg, msg_len, (uint8_t *)out,
+               out_size, &out_len, return_error, L))
+    {
+        return 2;
+    }
+    luaL_pushresultsize(&buffer, out_len);
+#else
+    if (out_size <= LUAL_BUFFERSIZE) {
+        luaL_buffinit(L, &buffer);
+        out = luaL_prepbuffer(&buffer);
+        if (!crypt(state, (uint8_t const *)msg, msg_len, (uint8_t *)out,
+                   out_size, &out_len, return_error, L))
+        {
+            return 2;
+        }
+        luaL_addsize(&buffer, out_len);
+        luaL_pushresult(&buffer);
+    } else {
+        /* scratch userdata so the collector accounts for the memory */
+        out = (char *)lua_newuserdata(L, out_size);
+        if (!crypt(state, (uint8_t const *)msg, msg_len, (uint8_t *)out,
+                   out_size, &out_len, return_error, L))
+        {
+            return 2;
+        }
+        lua_pushlstring(L, out, out_len);
+    }
+#endif
+    return 1;
+}
+
+/* Installs the IV at `index`, pushing nil and a message on failure */
+static bool
+install_iv(lua_State *L, blowfish_state *state, int index)
+{
+    size_t iv_len;
+    char const *iv = lua_tolstring(L, index, &iv_len);
+
+    if (iv == NULL) {
+        return_error(L, "initialization vector must be a string, got %s",
+                     lua_typename(L, lua_type(L, index)));
+        return false;
+    }
+    return blowfish_set_iv(state, (uint8_t const *)iv, iv_len, return_error,
+                           L);
 }
 
 static int
@@ -136,8 +641,7 @@ decrypt(lua_State *L)
 {
     blowfish_state *state = extract_state(L);
     char const *msg;
-    uint8_t *decrypted;
-    size_t msg_len, dec_len;
+    size_t msg_len;
 
     if (!lua_isstring(L, 2)) {
         lua_pushnil(L);
@@ -148,20 +652,15 @@ decrypt(lua_State *L)
     }
 
     msg = lua_tolstring(L, 2, &msg_len);
+    if (!lua_isnoneornil(L, 3) && !install_iv(L, state, 3)) {
+        return 2;
+    }
     if (msg_len == 0) {
         lua_pushnil(L);
-    } else {
-        decrypted = blowfish_decrypt(state, (uint8_t const *)&msg[0], msg_len,
-                                     &dec_len, return_error, L);
-        if (decrypted != NULL) {
-            lua_pushlstring(L, (char const *)decrypted, dec_len);
-            free(decrypted);
-        } else {
-            return 2;
-        }
+        return 1;
     }
-
-    return 1;
+    return push_result(L, state, blowfish_decrypt_into, msg, msg_len,
+                       msg_len);
 }
 
 static int
@@ -185,8 +684,7 @@ encrypt(lua_State *L)
 {
     blowfish_state *state = extract_state(L);
     char const *msg;
-    uint8_t *encrypted;
-    size_t msg_len, enc_len;
+    size_t msg_len;
 
     if (!lua_isstring(L, 2)) {
         lua_pushnil(L);
@@ -197,22 +695,740 @@ encrypt(lua_State *L)
     }
 
     msg = lua_tolstring(L, 2, &msg_len);
+    if (!lua_isnoneornil(L, 3) && !install_iv(L, state, 3)) {
+        return 2;
+    }
     if (msg_len == 0) {
         lua_pushnil(L);
+        return 1;
+    }
+    return push_result(L, state, blowfish_encrypt_into, msg, msg_len,
+                       blowfish_encrypted_size(state, msg_len));
+}
+
+/*
+ * Processes every string in the array at index 2, resetting the context
+ * before each one and installing the matching entry of the optional IV
+ * array at index 3.  Results and error messages are stored in two tables
+ * under the index of the element they belong to.
+ */
+static int
+crypt_many(lua_State *L, bool encrypt)
+{
+    blowfish_state *state = extract_state(L);
+    bool with_ivs = !lua_isnoneornil(L, 3);
+    uint8_t initial_iv[BLOWFISH_BLOCK_SIZE];
+    int count, results, errors, top;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (with_ivs) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    lua_settop(L, 3);
+    memcpy(initial_iv, state->initial_iv, sizeof(initial_iv));
+    count = (int)lua_objlen(L, 2);
+    lua_createtable(L, count, 0);
+    results = lua_gettop(L);
+    lua_newtable(L);
+    errors = lua_gettop(L);
+    top = lua_gettop(L);
+
+    for (int i = 1; i <= count; ++i) {
+        char const *msg;
+        size_t msg_len;
+
+        lua_rawgeti(L, 2, i);
+        if (!lua_isstring(L, -1)) {
+            lua_pushfstring(L, "string expected, got %s",
+                            lua_typename(L, lua_type(L, -1)));
+            lua_rawseti(L, errors, i);
+            lua_settop(L, top);
+            continue;
+        }
+        msg = lua_tolstring(L, -1, &msg_len);
+
+        /* a message without an IV of its own uses the keychain's */
+        memcpy(state->initial_iv, initial_iv, sizeof(initial_iv));
+        blowfish_reset(state);
+        if (with_ivs) {
+            lua_rawgeti(L, 3, i);
+            if (!lua_isnil(L, -1) && !install_iv(L, state, -1)) {
+                lua_rawseti(L, errors, i); /* message above the nil */
+                lua_settop(L, top);
+                continue;
+            }
+        }
+
+        if (msg_len > 0) {
+            if (push_result(L, state,
+                            encrypt ? blowfish_encrypt_into
+                                    : blowfish_decrypt_into,
+                            msg, msg_len,
+                            encrypt ? blowfish_encrypted_size(state, msg_len)
+                                    : msg_len)
+                == 1)
+            {
+                lua_rawseti(L, results, i);
+            } else {
+                lua_rawseti(L, errors, i); /* message above the nil */
+            }
+        }
+        lua_settop(L, top);
+    }
+    memcpy(state->initial_iv, initial_iv, sizeof(initial_iv));
+    blowfish_reset(state);
+
+    return 2;
+}
+
+static int
+decrypt_many(lua_State *L)
+{
+    return crypt_many(L, false);
+}
+
+static int
+encrypt_many(lua_State *L)
+{
+    return crypt_many(L, true);
+}
+
+/*
+ * Copies a keychain along with its schedule, so that the copy does not
+ * depend on a shared schedule staying alive.
+ */
+static void
+copy_state(blowfish_state *copy, blowfish_state const *state)
+{
+    memcpy(copy, state, BLOWFISH_SHARED_STATE_SIZE);
+    memcpy(&copy->schedule, state->ks, sizeof(copy->schedule));
+    copy->ks = &copy->schedule;
+}
+
+/*
+ * Iterators that process a message `slice` bytes at a time so that the
+ * caller can yield between slices.  Unlike a stream they advance the
+ * keychain itself, so the result matches a single call.  Every slice but
+ * the last is a whole number of units and is processed without padding.
+ * The last slice is never shorter than a unit so that it holds the
+ * padding when decrypting.
+ */
+#define DEFAULT_SLICE_SIZE (64 * 1024)
+
+static bool
+encrypt_slice_into(blowfish_state *state, uint8_t const *msg, size_t msg_len,
+                   uint8_t *out, size_t out_size, size_t *out_len,
+                   error_function on_error, void *err_context)
+{
+    bool padding = state->pkcs7padding;
+    bool ok;
+
+    state->pkcs7padding = false;
+    ok = blowfish_encrypt_into(state, msg, msg_len, out, out_size, out_len,
+                               on_error, err_context);
+    state->pkcs7padding = padding;
+    return ok;
+}
+
+static bool
+decrypt_slice_into(blowfish_state *state, uint8_t const *msg, size_t msg_len,
+                   uint8_t *out, size_t out_size, size_t *out_len,
+                   error_function on_error, void *err_context)
+{
+    bool padding = state->pkcs7padding;
+    bool ok;
+
+    state->pkcs7padding = false;
+    ok = blowfish_decrypt_into(state, msg, msg_len, out, out_size, out_len,
+                               on_error, err_context);
+    state->pkcs7padding = padding;
+    return ok;
+}
+
+/* upvalues: keychain, message, offset, slice size, encrypt flag */
+static int
+next_slice(lua_State *L)
+{
+    blowfish_state *state =
+        align_state(lua_touserdata(L, lua_upvalueindex(1)));
+    size_t msg_len, offset, slice, unit, len;
+    char const *msg = lua_tolstring(L, lua_upvalueindex(2), &msg_len);
+    bool encrypt = lua_toboolean(L, lua_upvalueindex(5));
+    bool last;
+    int results;
+
+    offset = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+    slice = (size_t)lua_tointeger(L, lua_upvalueindex(4));
+    if (offset >= msg_len) {
+        return 0;
+    }
+
+    unit = state->mode == MODE_CFB ? state->segment_size / 8
+                                   : BLOWFISH_BLOCK_SIZE;
+    len = msg_len - offset;
+    last = len <= slice + unit;
+    if (!last) {
+        len = slice;
+    }
+
+    if (last) {
+        results = push_result(L, state,
+                              encrypt ? blowfish_encrypt_into
+                                      : blowfish_decrypt_into,
+                              msg + offset, len,
+                              encrypt ? blowfish_encrypted_size(state, len)
+                                      : len);
     } else {
-        encrypted = blowfish_encrypt(state, (uint8_t const *)&msg[0], msg_len,
-                                     &enc_len, return_error, L);
-        if (encrypted) {
-            lua_pushlstring(L, (char const *)encrypted, enc_len);
-            free(encrypted);
-        } else {
+        results = push_result(L, state,
+                              encrypt ? encrypt_slice_into
+                                      : decrypt_slice_into,
+                              msg + offset, len, len);
+    }
+    if (results != 1) {
+        return lua_error(L); /* a for loop would take nil as the end */
+    }
+
+    lua_pushinteger(L, (lua_Integer)(offset + len));
+    lua_replace(L, lua_upvalueindex(3));
+    return 1;
+}
+
+static int
+slices(lua_State *L, bool encrypt)
+{
+    blowfish_state *state = extract_state(L);
+    lua_Integer slice = luaL_optinteger(L, 3, DEFAULT_SLICE_SIZE);
+    size_t unit = state->mode == MODE_CFB ? state->segment_size / 8
+                                          : BLOWFISH_BLOCK_SIZE;
+
+    luaL_checkstring(L, 2);
+    luaL_argcheck(L, slice > 0, 3, "slice size must be positive");
+    slice -= slice % (lua_Integer)unit;
+    if (slice == 0) {
+        slice = (lua_Integer)unit;
+    }
+
+    lua_settop(L, 2);
+    lua_pushinteger(L, 0);
+    lua_pushinteger(L, slice);
+    lua_pushboolean(L, encrypt);
+    lua_pushcclosure(L, next_slice, 5);
+    return 1;
+}
+
+static int
+decrypt_slices(lua_State *L)
+{
+    return slices(L, false);
+}
+
+static int
+encrypt_slices(lua_State *L)
+{
+    return slices(L, true);
+}
+
+static void
+release_job(struct async_job *job)
+{
+    if (atomic_fetch_sub(&job->refs, 1) == 1) {
+        close(job->fd[0]);
+        if (job->fd[1] != job->fd[0]) {
+            close(job->fd[1]);
+        }
+        free(job->buf);
+        memset(&job->state, 0, sizeof(job->state)); /* key material */
+        free(job);
+    }
+}
+
+/* Runs on a worker thread, or inline when the pool is not running */
+static void
+run_job(void *arg, size_t index)
+{
+    struct async_job *job = (struct async_job *)arg;
+    size_t out_len;
+    ssize_t rc;
+
+    (void)index;
+    if (job->encrypt) {
+        job->ok = blowfish_encrypt_into(&job->state, job->buf, job->len,
+                                        job->buf, job->buf_size, &out_len,
+                                        blowfish_error_to_buffer, job->error);
+    } else {
+        job->ok = blowfish_decrypt_into(&job->state, job->buf, job->len,
+                                        job->buf, job->buf_size, &out_len,
+                                        blowfish_error_to_buffer, job->error);
+    }
+    job->len = out_len;
+    atomic_store_explicit(&job->done, true, memory_order_release);
+
+#ifdef __linux__
+    uint64_t one = 1;
+    rc = write(job->fd[1], &one, sizeof(one));
+#else
+    rc = write(job->fd[1], "", 1);
+#endif
+    (void)rc; /* the handle checks `done`, the fd is only a wakeup */
+    release_job(job);
+}
+
+static bool
+open_job_fd(struct async_job *job)
+{
+#ifdef __linux__
+    job->fd[0] = job->fd[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return job->fd[0] >= 0;
+#else
+    if (pipe(job->fd) != 0) {
+        return false;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(job->fd[i], F_SETFD, FD_CLOEXEC);
+        fcntl(job->fd[i], F_SETFL, O_NONBLOCK);
+    }
+    return true;
+#endif
+}
+
+static int
+submit_job(lua_State *L, bool encrypt)
+{
+    blowfish_state *state = extract_state(L);
+    struct async_job **handle, *job;
+    char const *msg;
+    size_t msg_len;
+
+    if (!lua_isstring(L, 2)) {
+        lua_pushnil(L);
+        return_error(L, "bad argument #1 to '%s' (string expected, got %s)",
+                     encrypt ? "encrypt_async" : "decrypt_async",
+                     lua_typename(L, lua_type(L, 2)));
+        return 2;
+    }
+    msg = lua_tolstring(L, 2, &msg_len);
+    if (msg_len == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* the handle owns the job from here on so errors cannot leak it */
+    handle = (struct async_job **)lua_newuserdata(L, sizeof(*handle));
+    *handle = NULL;
+    luaL_getmetatable(L, JOB_TABLE_NAME);
+    lua_setmetatable(L, -2);
+
+    job = (struct async_job *)aligned_alloc(BLOWFISH_ALIGNMENT, sizeof(*job));
+    if (job == NULL) {
+        return_error(L, "failed to allocate job");
+        return 2;
+    }
+    copy_state(&job->state, state);
+    job->encrypt = encrypt;
+    job->ok = false;
+    job->len = msg_len;
+    job->buf_size = encrypt ? blowfish_encrypted_size(state, msg_len) : 0;
+    if (job->buf_size < msg_len) {
+        job->buf_size = msg_len; /* the job reports why it cannot encrypt */
+    }
+    job->buf = (uint8_t *)malloc(job->buf_size);
+    if (job->buf == NULL || !open_job_fd(job)) {
+        return_error(L, "failed to set up job: %s", strerror(errno));
+        free(job->buf);
+        free(job);
+        return 2;
+    }
+    memcpy(job->buf, msg, msg_len);
+    job->error[0] = '\0';
+    atomic_init(&job->done, false);
+    atomic_init(&job->refs, 2);
+    *handle = job;
+
+    job->task.fn = run_job;
+    job->task.arg = job;
+    if (!bf_submit(&job->task)) {
+        run_job(job, 0);
+    }
+    return 1;
+}
+
+static int
+decrypt_async(lua_State *L)
+{
+    return submit_job(L, false);
+}
+
+static int
+encrypt_async(lua_State *L)
+{
+    return submit_job(L, true);
+}
+
+static inline struct async_job *
+extract_job(lua_State *L)
+{
+    struct async_job **handle =
+        (struct async_job **)luaL_checkudata(L, 1, JOB_TABLE_NAME);
+    luaL_argcheck(L, handle != NULL && *handle != NULL, 1,
+                  "`Blowfish.job' expected");
+    return *handle;
+}
+
+static int
+job_fd(lua_State *L)
+{
+    lua_pushinteger(L, extract_job(L)->fd[0]);
+    return 1;
+}
+
+static int
+job_ready(lua_State *L)
+{
+    struct async_job *job = extract_job(L);
+    lua_pushboolean(L,
+                    atomic_load_explicit(&job->done, memory_order_acquire));
+    return 1;
+}
+
+static int
+job_result(lua_State *L)
+{
+    struct async_job *job = extract_job(L);
+    struct pollfd wait_for = {job->fd[0], POLLIN, 0};
+
+    while (!atomic_load_explicit(&job->done, memory_order_acquire)) {
+        if (poll(&wait_for, 1, -1) < 0 && errno != EINTR) {
+            return_error(L, "failed to wait for job: %s", strerror(errno));
             return 2;
         }
     }
+    if (!job->ok) {
+        return_error(L, "%s", job->error);
+        return 2;
+    }
+    lua_pushlstring(L, (char const *)job->buf, job->len);
+    return 1;
+}
+
+static int
+job_gc(lua_State *L)
+{
+    struct async_job **handle =
+        (struct async_job **)luaL_checkudata(L, 1, JOB_TABLE_NAME);
+    if (*handle != NULL) {
+        release_job(*handle);
+        *handle = NULL;
+    }
+    return 0;
+}
+
+static int
+stream(lua_State *L)
+{
+    static char const *const directions[] = {"decrypt", "encrypt", NULL};
+    blowfish_state *state = extract_state(L);
+    bool encrypt = luaL_checkoption(L, 2, NULL, directions) == 1;
+    struct lua_stream *self;
+
+    lua_settop(L, 3);
+    self = (struct lua_stream *)align_state(
+        lua_newuserdata(L, sizeof(*self) + BLOWFISH_ALIGNMENT - 1));
+    copy_state(&self->state, state);
+    blowfish_reset(&self->state);
+    luaL_getmetatable(L, STREAM_TABLE_NAME);
+    lua_setmetatable(L, -2);
+
+    if (!lua_isnoneornil(L, 3)) {
+        size_t iv_len;
+        char const *iv = luaL_checklstring(L, 3, &iv_len);
+        blowfish_set_iv(&self->state, (uint8_t const *)iv, iv_len, on_error,
+                        L);
+    }
+    blowfish_stream_init(&self->stream, &self->state, encrypt, on_error, L);
+    return 1;
+}
+
+static inline struct lua_stream *
+extract_stream(lua_State *L)
+{
+    void *maybe_stream = luaL_checkudata(L, 1, STREAM_TABLE_NAME);
+    luaL_argcheck(L, maybe_stream != NULL, 1, "`Blowfish.stream' expected");
+    return (struct lua_stream *)align_state(maybe_stream);
+}
+
+/* crypt_function adapters, `state` is the first member of a lua_stream */
+static bool
+update_into(blowfish_state *state, uint8_t const *msg, size_t msg_len,
+            uint8_t *out, size_t out_size, size_t *out_len,
+            error_function on_error, void *err_context)
+{
+    return blowfish_stream_update(&((struct lua_stream *)state)->stream, msg,
+                                  msg_len, out, out_size, out_len, on_error,
+                                  err_context);
+}
+
+static bool
+finish_into(blowfish_state *state, uint8_t const *msg, size_t msg_len,
+            uint8_t *out, size_t out_size, size_t *out_len,
+            error_function on_error, void *err_context)
+{
+    (void)msg;
+    (void)msg_len;
+    return blowfish_stream_finish(&((struct lua_stream *)state)->stream, out,
+                                  out_size, out_len, on_error, err_context);
+}
+
+static int
+stream_update(lua_State *L)
+{
+    struct lua_stream *self = extract_stream(L);
+    char const *chunk;
+    size_t chunk_len;
+
+    if (!lua_isstring(L, 2)) {
+        lua_pushnil(L);
+        return_error(L,
+                     "bad argument #1 to 'update' (string expected, got %s)",
+                     lua_typename(L, lua_type(L, 2)));
+        return 2;
+    }
+    chunk = lua_tolstring(L, 2, &chunk_len);
+    return push_result(L, &self->state, update_into, chunk, chunk_len,
+                       self->stream.buffered + chunk_len);
+}
+
+/* Flushes the stream, which then starts over for the next message */
+static int
+stream_finish(lua_State *L)
+{
+    struct lua_stream *self = extract_stream(L);
+    int results = push_result(L, &self->state, finish_into, NULL, 0,
+                              BLOWFISH_BLOCK_SIZE);
+
+    blowfish_reset(&self->state);
+    return results;
+}
+
+static int
+stream_gc(lua_State *L)
+{
+    struct lua_stream *self = extract_stream(L);
+    memset(self, 0, sizeof(*self)); /* key material */
+    return 0;
+}
+
+static int
+new_buffer(lua_State *L)
+{
+    lua_Integer capacity = luaL_checkinteger(L, 1);
+    struct lua_buffer *self;
 
+    luaL_argcheck(L, capacity >= 0, 1, "capacity cannot be negative");
+    self = (struct lua_buffer *)lua_newuserdata(L, sizeof(*self)
+                                                       + (size_t)capacity);
+    self->capacity = (size_t)capacity;
+    self->len = 0;
+    luaL_getmetatable(L, BUFFER_TABLE_NAME);
+    lua_setmetatable(L, -2);
     return 1;
 }
 
+static inline struct lua_buffer *
+extract_buffer(lua_State *L, int index)
+{
+    void *maybe_buffer = luaL_checkudata(L, index, BUFFER_TABLE_NAME);
+    luaL_argcheck(L, maybe_buffer != NULL, index, "`Blowfish.buffer' expected");
+    return (struct lua_buffer *)maybe_buffer;
+}
+
+static int
+buffer_capacity(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)extract_buffer(L, 1)->capacity);
+    return 1;
+}
+
+static int
+buffer_clear(lua_State *L)
+{
+    extract_buffer(L, 1)->len = 0;
+    return 0;
+}
+
+static int
+buffer_len(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)extract_buffer(L, 1)->len);
+    return 1;
+}
+
+static int
+buffer_set(lua_State *L)
+{
+    struct lua_buffer *self = extract_buffer(L, 1);
+    size_t len;
+    char const *bytes = luaL_checklstring(L, 2, &len);
+
+    luaL_argcheck(L, len <= self->capacity, 2,
+                  "string does not fit the buffer");
+    memcpy(self->data, bytes, len);
+    self->len = len;
+    return 0;
+}
+
+/* Same index rules as string.sub */
+static int
+buffer_sub(lua_State *L)
+{
+    struct lua_buffer *self = extract_buffer(L, 1);
+    lua_Integer len = (lua_Integer)self->len;
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+
+    if (i < 0) {
+        i = i + len + 1;
+    }
+    if (j < 0) {
+        j = j + len + 1;
+    }
+    if (i < 1) {
+        i = 1;
+    }
+    if (j > len) {
+        j = len;
+    }
+    if (i > j) {
+        lua_pushliteral(L, "");
+    } else {
+        lua_pushlstring(L, (char const *)self->data + i - 1,
+                        (size_t)(j - i + 1));
+    }
+    return 1;
+}
+
+static int
+buffer_tostring(lua_State *L)
+{
+    struct lua_buffer *self = extract_buffer(L, 1);
+    lua_pushlstring(L, (char const *)self->data, self->len);
+    return 1;
+}
+
+/*
+ * Encrypts or decrypts the string or buffer at index 3 into the buffer at
+ * index 2, or the buffer's own contents when there is no third argument.
+ * Returns the new length of the buffer, which is empty after a failure.
+ */
+static int
+crypt_into(lua_State *L, bool encrypt)
+{
+    blowfish_state *state = extract_state(L);
+    struct lua_buffer *out = extract_buffer(L, 2);
+    uint8_t const *msg;
+    size_t msg_len, out_len;
+    bool ok;
+
+    if (lua_isnoneornil(L, 3)) {
+        msg = out->data;
+        msg_len = out->len;
+    } else if (lua_isuserdata(L, 3)) {
+        struct lua_buffer *in = extract_buffer(L, 3);
+        msg = in->data;
+        msg_len = in->len;
+    } else {
+        msg = (uint8_t const *)luaL_checklstring(L, 3, &msg_len);
+    }
+
+    if (encrypt) {
+        ok = blowfish_encrypt_into(state, msg, msg_len, out->data,
+                                   out->capacity, &out_len, return_error, L);
+    } else {
+        ok = blowfish_decrypt_into(state, msg, msg_len, out->data,
+                                   out->capacity, &out_len, return_error, L);
+    }
+    out->len = out_len; /* emptied on failure */
+    if (!ok) {
+        return 2;
+    }
+    lua_pushinteger(L, (lua_Integer)out_len);
+    return 1;
+}
+
+static int
+decrypt_into(lua_State *L)
+{
+    return crypt_into(L, false);
+}
+
+static int
+encrypt_into(lua_State *L)
+{
+    return crypt_into(L, true);
+}
+
+/*
+ * Reinitializes a keychain in place, with a key or a schedule handle.  A
+ * keychain that was bound to a shared schedule has no room for a private
+ * one, so it can only move to keys that the shared cache can hold.
+ */
+static int
+rekey(lua_State *L)
+{
+    blowfish_state *state = extract_state(L);
+    size_t key_len = 0, iv_len = 0;
+    char const *key = NULL;
+    char const *iv = luaL_optlstring(L, 3, NULL, &iv_len);
+    lua_Integer mode = luaL_optinteger(L, 4, state->mode);
+    size_t room = lua_objlen(L, 1)
+                - (size_t)((char *)state - (char *)lua_touserdata(L, 1));
+    blowfish_schedule const *schedule = NULL;
+    blowfish_cache *cache;
+    uint8_t current_iv[BLOWFISH_BLOCK_SIZE];
+    bool padding = state->pkcs7padding;
+    bool ok;
+
+    /* keep the current IV unless the mode stops or starts using one */
+    if (iv == NULL && mode != MODE_ECB && state->mode != MODE_ECB) {
+        memcpy(current_iv, state->initial_iv, sizeof(current_iv));
+        iv = (char const *)current_iv;
+        iv_len = sizeof(current_iv);
+    }
+
+    if (lua_isuserdata(L, 2)) {
+        schedule = extract_schedule(L, 2)->schedule;
+    } else {
+        key = luaL_checklstring(L, 2, &key_len);
+        if ((cache = current_cache()) != NULL) {
+            schedule = blowfish_cache_acquire(cache, (uint8_t *)key, key_len,
+                                              on_error, L);
+        }
+    }
+    if (schedule != NULL) {
+        ok = blowfish_init_with_schedule(
+            state, schedule, (uint8_t *)iv, iv_len, (blowfish_mode)mode,
+            (int)state->segment_size, on_error, L);
+        if (ok && room >= sizeof(blowfish_state)) {
+            memset(&state->schedule, 0, sizeof(state->schedule)); /* old key */
+        }
+    } else if (room < sizeof(blowfish_state)) {
+        return luaL_error(L, "keychain has no room for its own schedule, "
+                             "cannot rekey");
+    } else {
+        ok = blowfish_init(state, (uint8_t *)key, key_len, (uint8_t *)iv,
+                           iv_len, (blowfish_mode)mode,
+                           (int)state->segment_size, on_error, L);
+    }
+
+    if (ok) {
+        state->pkcs7padding = padding;
+        if (key == NULL) {
+            lua_pushvalue(L, 1);
+            keep_schedule(L, 2);
+        }
+    }
+    return 0;
+}
+
 static int
 reset(lua_State *L)
 {
@@ -221,6 +1437,17 @@ reset(lua_State *L)
     return 0;
 }
 
+static int
+set_iv(lua_State *L)
+{
+    blowfish_state *state = extract_state(L);
+    size_t iv_len;
+    char const *iv = luaL_checklstring(L, 2, &iv_len);
+
+    blowfish_set_iv(state, (uint8_t const *)iv, iv_len, on_error, L);
+    return 0;
+}
+
 static int
 to_string(lua_State *L)
 {
@@ -0,0 +1,697 @@
+/*
+ * bf-server: encrypts and decrypts for local clients over a Unix domain
+ * socket with keys that are expanded once at startup.
+ *
+ * A single epoll loop owns every connection.  Each time around it reads
+ * whatever has arrived, turns every complete request from every ready
+ * connection into one batch and hands the batch to blowfish_*_batch,
+ * which spreads it over the library's worker threads.  Results are
+ * written straight into space reserved in the connection's output buffer,
+ * so a request costs no allocation once the buffers have grown.
+ *
+ * Requests take contexts bound to the shared schedules, which are never
+ * copied.  See server-protocol.h for the framing.
+ */
+#define _GNU_SOURCE 1 /* accept4 */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "blowfish.h"
+#include "cli-lib.h"
+#include "server-protocol.h"
+
+#define MAX_EVENTS 64
+#define MAX_KEYS 256
+#define NO_JOB SIZE_MAX /* the request failed before it became a job */
+#define INITIAL_BUFFER_SIZE ((size_t)64 * 1024)
+#define MAX_BACKLOG ((size_t)8 * 1024 * 1024)
+#define CONTEXT_STRIDE                                                        \
+    ((BLOWFISH_SHARED_STATE_SIZE + BLOWFISH_ALIGNMENT - 1)                    \
+     & ~(size_t)(BLOWFISH_ALIGNMENT - 1))
+
+struct connection {
+    int fd;
+    uint8_t *in;
+    size_t in_len;
+    size_t in_size;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_size;
+    uint32_t events;
+    size_t first_request; /* this round's requests and input */
+    size_t end_request;
+    size_t consumed;
+    bool eof;
+    bool ready;
+    struct connection *next_ready;
+    struct connection *prev;
+    struct connection *next;
+};
+
+struct request {
+    struct connection *conn;
+    uint32_t id;
+    bool encrypt;
+    size_t job;
+    size_t out_offset;
+    char error[BLOWFISH_ERROR_SIZE];
+};
+
+struct server {
+    int epoll_fd;
+    int listen_fd;
+    blowfish_state *keys[MAX_KEYS];
+    size_t num_keys;
+    struct connection *connections;
+    struct connection *ready;
+    struct request *requests;
+    blowfish_job *jobs;
+    blowfish_job *batch;
+    uint8_t *contexts;
+    size_t num_requests;
+    size_t capacity;
+};
+
+static volatile sig_atomic_t stopping;
+
+static void
+stop(int signal_number)
+{
+    (void)signal_number;
+    stopping = 1;
+}
+
+static uint32_t
+get_u32(uint8_t const *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8
+         | p[3];
+}
+
+static void
+put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static bool
+grow_buffer(uint8_t **buf, size_t *size, size_t needed)
+{
+    size_t new_size = *size ? *size : INITIAL_BUFFER_SIZE;
+    uint8_t *bigger;
+
+    if (needed <= *size) {
+        return true;
+    }
+    while (new_size < needed) {
+        new_size *= 2;
+    }
+    if ((bigger = realloc(*buf, new_size)) == NULL) {
+        return false;
+    }
+    *buf = bigger;
+    *size = new_size;
+    return true;
+}
+
+static void
+mark_ready(struct server *server, struct connection *conn)
+{
+    if (!conn->ready) {
+        conn->ready = true;
+        conn->next_ready = server->ready;
+        server->ready = conn;
+    }
+}
+
+/* Reads while paused for nothing, writes while output is pending */
+static void
+update_events(struct server *server, struct connection *conn)
+{
+    struct epoll_event event = {.data.ptr = conn};
+
+    if (!conn->eof && conn->out_len - conn->out_sent < MAX_BACKLOG) {
+        event.events |= EPOLLIN;
+    }
+    if (conn->out_sent < conn->out_len) {
+        event.events |= EPOLLOUT;
+    }
+    if (event.events != conn->events) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = event.events;
+    }
+}
+
+static void
+close_connection(struct server *server, struct connection *conn)
+{
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        server->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    close(conn->fd); /* also removes it from the epoll set */
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+static void
+accept_connections(struct server *server)
+{
+    int fd;
+
+    while ((fd = accept4(server->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC))
+           >= 0)
+    {
+        struct connection *conn = calloc(1, sizeof(*conn));
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+
+        if (conn == NULL
+            || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        conn->next = server->connections;
+        if (conn->next != NULL) {
+            conn->next->prev = conn;
+        }
+        server->connections = conn;
+    }
+}
+
+static void
+read_available(struct server *server, struct connection *conn)
+{
+    size_t limit = SERVER_REQUEST_SIZE + SERVER_MAX_BODY;
+
+    while (!conn->eof && conn->out_len - conn->out_sent < MAX_BACKLOG) {
+        ssize_t nread;
+        if (conn->in_len == conn->in_size
+            && (conn->in_size >= limit
+                || !grow_buffer(&conn->in, &conn->in_size, conn->in_len + 1)))
+        {
+            break; /* full, read the rest once a request is consumed */
+        }
+        nread = read(conn->fd, conn->in + conn->in_len,
+                     conn->in_size - conn->in_len);
+        if (nread > 0) {
+            conn->in_len += (size_t)nread;
+        } else if (nread == 0 || (errno != EINTR && errno != EAGAIN)) {
+            conn->eof = true;
+        } else if (errno == EAGAIN) {
+            break;
+        }
+    }
+    mark_ready(server, conn);
+}
+
+static void
+flush_output(struct connection *conn)
+{
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent,
+                            conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent > 0) {
+            conn->out_sent += (size_t)sent;
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            conn->eof = true;
+            conn->out_len = conn->out_sent; /* the peer is gone */
+        }
+    }
+    if (conn->out_sent == conn->out_len) {
+        conn->out_len = conn->out_sent = 0;
+    }
+}
+
+static bool
+reserve_requests(struct server *server, size_t needed)
+{
+    size_t capacity = server->capacity ? server->capacity : 64;
+    struct request *requests;
+    blowfish_job *jobs, *batch;
+    uint8_t *contexts;
+
+    if (needed <= server->capacity) {
+        return true;
+    }
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    if ((requests = realloc(server->requests, capacity * sizeof(*requests)))
+        != NULL)
+    {
+        server->requests = requests;
+    }
+    if ((jobs = realloc(server->jobs, capacity * sizeof(*jobs))) != NULL) {
+        server->jobs = jobs;
+    }
+    if ((batch = realloc(server->batch, capacity * sizeof(*batch))) != NULL) {
+        server->batch = batch;
+    }
+    contexts = aligned_alloc(BLOWFISH_ALIGNMENT, capacity * CONTEXT_STRIDE);
+    if (requests == NULL || jobs == NULL || batch == NULL || contexts == NULL) {
+        free(contexts);
+        return false;
+    }
+
+    /* the requests collected so far move along with their contexts */
+    if (server->num_requests > 0) {
+        memcpy(contexts, server->contexts,
+               server->num_requests * CONTEXT_STRIDE);
+    }
+    for (size_t i = 0; i < server->num_requests; ++i) {
+        if (jobs[i].context != NULL) {
+            jobs[i].context = (blowfish_state *)(contexts + i * CONTEXT_STRIDE);
+        }
+    }
+    free(server->contexts);
+    server->contexts = contexts;
+    server->capacity = capacity;
+    return true;
+}
+
+/*
+ * Sets up a request from the frame at `frame`.  Failures that only affect
+ * this request are left in its error for the response.
+ */
+static void
+prepare_request(struct server *server, struct request *request,
+                uint8_t const *frame, blowfish_job *job,
+                blowfish_state *context)
+{
+    uint32_t length = get_u32(frame);
+    uint8_t op = frame[8], mode = frame[9], flags = frame[10];
+    unsigned key = (unsigned)frame[12] << 8 | frame[13];
+    uint8_t const *body = frame + SERVER_REQUEST_SIZE;
+    uint8_t const *iv = NULL;
+
+    request->id = get_u32(frame + 4);
+    request->encrypt = op == SERVER_OP_ENCRYPT;
+    request->error[0] = '\0';
+    memset(job, 0, sizeof(*job));
+    if (op != SERVER_OP_ENCRYPT && op != SERVER_OP_DECRYPT) {
+        blowfish_error_to_buffer(request->error, "unknown operation %d",
+                                 (int)op);
+        return;
+    }
+    if (key >= server->num_keys) {
+        blowfish_error_to_buffer(request->error, "no key with index %d",
+                                 (int)key);
+        return;
+    }
+    if (flags & SERVER_FLAG_IV) {
+        if (length < BLOWFISH_BLOCK_SIZE) {
+            blowfish_error_to_buffer(request->error,
+                                     "body is too short for its IV");
+            return;
+        }
+        iv = body;
+        body += BLOWFISH_BLOCK_SIZE;
+        length -= BLOWFISH_BLOCK_SIZE;
+    }
+    if (!blowfish_init_with_schedule(context, server->keys[key]->ks, iv,
+                                     iv ? BLOWFISH_BLOCK_SIZE : 0,
+                                     (blowfish_mode)mode, frame[11],
+                                     blowfish_error_to_buffer, request->error))
+    {
+        return;
+    }
+    context->pkcs7padding = (flags & SERVER_FLAG_PADDING) != 0;
+
+    job->context = context;
+    job->input = body;
+    job->input_len = length;
+    job->output_size = request->encrypt
+                         ? blowfish_encrypted_size(context, length)
+                         : length;
+}
+
+/*
+ * Takes every complete request from `conn` into the round and reserves
+ * output space for their responses.
+ */
+static bool
+collect_requests(struct server *server, struct connection *conn,
+                 size_t *consumed)
+{
+    size_t offset = 0, first = server->num_requests, reserved;
+
+    while (conn->in_len - offset >= SERVER_REQUEST_SIZE) {
+        uint8_t const *frame = conn->in + offset;
+        size_t length = get_u32(frame);
+        struct request *request;
+
+        if (length > SERVER_MAX_BODY) {
+            conn->eof = true; /* cannot be framed, drop the connection */
+            conn->in_len = offset;
+            break;
+        }
+        if (conn->in_len - offset < SERVER_REQUEST_SIZE + length) {
+            break;
+        }
+        if (!reserve_requests(server, server->num_requests + 1)) {
+            server->num_requests = first;
+            return false;
+        }
+        request = &server->requests[server->num_requests];
+        request->conn = conn;
+        request->job = NO_JOB; /* set by run_jobs */
+        prepare_request(server, request, frame,
+                        &server->jobs[server->num_requests],
+                        (blowfish_state *)(server->contexts
+                                           + server->num_requests
+                                                 * CONTEXT_STRIDE));
+        ++server->num_requests;
+        offset += SERVER_REQUEST_SIZE + length;
+    }
+    *consumed = offset;
+
+    /* responses are written into the connection's buffer in place */
+    reserved = conn->out_len;
+    for (size_t i = first; i < server->num_requests; ++i) {
+        blowfish_job *job = &server->jobs[i];
+        size_t size = job->output_size > BLOWFISH_ERROR_SIZE
+                        ? job->output_size
+                        : BLOWFISH_ERROR_SIZE;
+        server->requests[i].out_offset = reserved;
+        reserved += SERVER_RESPONSE_SIZE + size;
+    }
+    if (!grow_buffer(&conn->out, &conn->out_size, reserved)) {
+        server->num_requests = first;
+        return false;
+    }
+    for (size_t i = first; i < server->num_requests; ++i) {
+        server->jobs[i].output = conn->out + server->requests[i].out_offset
+                               + SERVER_RESPONSE_SIZE;
+    }
+    return true;
+}
+
+/*
+ * Runs the round as two batches, encryption then decryption, each spread
+ * over the worker threads.  Requests that failed to set up are skipped.
+ */
+static void
+run_jobs(struct server *server)
+{
+    size_t n = server->num_requests, num_encrypt = 0, num_jobs;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (server->requests[i].encrypt && server->jobs[i].context != NULL) {
+            server->requests[i].job = num_encrypt;
+            server->batch[num_encrypt++] = server->jobs[i];
+        }
+    }
+    num_jobs = num_encrypt;
+    for (size_t i = 0; i < n; ++i) {
+        if (!server->requests[i].encrypt && server->jobs[i].context != NULL) {
+            server->requests[i].job = num_jobs;
+            server->batch[num_jobs++] = server->jobs[i];
+        }
+    }
+    blowfish_encrypt_batch(server->batch, num_encrypt);
+    blowfish_decrypt_batch(server->batch + num_encrypt, num_jobs - num_encrypt);
+}
+
+static void
+write_responses(struct server *server, struct connection *conn, size_t first,
+                size_t end)
+{
+    size_t pos = conn->out_len;
+
+    for (size_t i = first; i < end; ++i) {
+        struct request *request = &server->requests[i];
+        uint8_t header[SERVER_RESPONSE_SIZE] = {0};
+        char const *error = request->error;
+        uint8_t const *body = NULL;
+        size_t len = 0;
+        uint8_t status = SERVER_STATUS_ERROR;
+
+        if (request->job != NO_JOB) {
+            blowfish_job const *job = &server->batch[request->job];
+            if (job->ok) {
+                body = job->output;
+                len = job->output_len;
+                status = SERVER_STATUS_OK;
+            } else {
+                error = job->error;
+            }
+        }
+        if (status == SERVER_STATUS_ERROR) {
+            body = (uint8_t const *)error;
+            len = strlen(error);
+        }
+        put_u32(header, (uint32_t)len);
+        put_u32(header + 4, request->id);
+        header[8] = status;
+        /* results only ever move down, ahead of the next one */
+        memmove(conn->out + pos + SERVER_RESPONSE_SIZE, body, len);
+        memcpy(conn->out + pos, header, sizeof(header));
+        pos += SERVER_RESPONSE_SIZE + len;
+    }
+    conn->out_len = pos;
+}
+
+/* Answers everything that arrived on the ready connections as one batch */
+static void
+serve_ready(struct server *server)
+{
+    struct connection *ready = server->ready, *conn, *next;
+
+    server->ready = NULL;
+    server->num_requests = 0;
+    for (conn = ready; conn != NULL; conn = conn->next_ready) {
+        conn->first_request = server->num_requests;
+        if (!collect_requests(server, conn, &conn->consumed)) {
+            fprintf(stderr, "ERROR: out of memory, dropping a connection\n");
+            conn->eof = true;
+            conn->consumed = conn->in_len;
+        }
+        conn->end_request = server->num_requests;
+    }
+    run_jobs(server);
+
+    for (conn = ready; conn != NULL; conn = next) {
+        next = conn->next_ready;
+        conn->ready = false;
+        if (conn->end_request > conn->first_request) {
+            write_responses(server, conn, conn->first_request,
+                            conn->end_request);
+        }
+        memmove(conn->in, conn->in + conn->consumed,
+                conn->in_len - conn->consumed);
+        conn->in_len -= conn->consumed;
+        flush_output(conn);
+        if (conn->eof && conn->out_sent == conn->out_len) {
+            close_connection(server, conn);
+        } else {
+            update_events(server, conn);
+        }
+    }
+}
+
+static void
+serve(struct server *server)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!stopping) {
+        int num_events = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+        if (num_events < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "ERROR: epoll_wait failed: %s\n",
+                        strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < num_events; ++i) {
+            struct connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(server);
+                continue;
+            }
+            /* connections are only closed by serve_ready */
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_available(server, conn);
+            }
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                conn->eof = true;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_output(conn);
+            }
+            mark_ready(server, conn);
+        }
+        serve_ready(server);
+    }
+}
+
+static int
+listen_on(char const *path)
+{
+    struct sockaddr_un addr;
+    struct stat info;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path); /* left behind by an earlier server */
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot listen on %s: %s\n", path,
+                strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static void
+usage_and_exit(char const *program)
+{
+    fprintf(stderr, "Usage: %s [-j THREADS] -k KEY [-k KEY]... SOCKET\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+static bool
+add_key(struct server *server, char const *hex)
+{
+    size_t key_len;
+    uint8_t *key = from_hex_or_fail(hex, &key_len);
+    blowfish_state *state;
+
+    if (key == NULL) {
+        return false;
+    }
+    state = blowfish_new(key, key_len, NULL, 0, MODE_ECB, 0, &report_error,
+                         stderr);
+    memset(key, 0, key_len);
+    free(key);
+    if (state == NULL) {
+        return false;
+    }
+    server->keys[server->num_keys++] = state;
+    return true;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct server server;
+    struct sigaction action;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned num_threads = num_cpus > 1 ? (unsigned)num_cpus : 1;
+    int opt, status = EXIT_FAILURE;
+
+    memset(&server, 0, sizeof(server));
+    while ((opt = getopt(argc, argv, "j:k:")) != -1) {
+        switch (opt) {
+        case 'j':
+            num_threads = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            if (server.num_keys == MAX_KEYS) {
+                fprintf(stderr, "ERROR: at most %d keys\n", MAX_KEYS);
+                exit(EXIT_FAILURE);
+            }
+            if (!add_key(&server, optarg)) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage_and_exit(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || server.num_keys == 0) {
+        usage_and_exit(argv[0]);
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop; /* no SA_RESTART, epoll_wait has to return */
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the loop thread takes a share of every batch */
+    if (num_threads > BLOWFISH_MAX_THREADS) {
+        num_threads = BLOWFISH_MAX_THREADS;
+    }
+    if (num_threads > 1
+        && !blowfish_threads_start(num_threads - 1, &report_error, stderr))
+    {
+        num_threads = 1;
+    }
+
+    server.listen_fd = listen_on(argv[optind]);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.listen_fd >= 0 && server.epoll_fd >= 0
+        && epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event)
+               == 0)
+    {
+        fprintf(stderr, "serving %zu keys on %s with %u threads\n",
+                server.num_keys, argv[optind], num_threads);
+        serve(&server);
+        status = EXIT_SUCCESS;
+    }
+
+    while (server.connections != NULL) {
+        close_connection(&server, server.connections);
+    }
+    if (server.listen_fd >= 0) {
+        close(server.listen_fd);
+        unlink(argv[optind]);
+    }
+    if (server.epoll_fd >= 0) {
+        close(server.epoll_fd);
+    }
+    blowfish_threads_stop();
+    for (size_t i = 0; i < server.num_keys; ++i) {
+        blowfish_free(server.keys[i]);
+    }
+    free(server.requests);
+    free(server.jobs);
+    free(server.batch);
+    free(server.contexts);
+    return status;
+}
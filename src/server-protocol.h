@@ -0,0 +1,45 @@
+#ifndef BLOWFISH_8BIT_SERVER_PROTOCOL_H
+#define BLOWFISH_8BIT_SERVER_PROTOCOL_H
+
+/*
+ * Framing used by bf-server.  Every integer is in network byte order.
+ *
+ * Request, followed by `length` bytes of body:
+ *
+ *   0  uint32  length      body bytes, the IV included
+ *   4  uint32  id          echoed in the response
+ *   8  uint8   op          SERVER_OP_ENCRYPT or SERVER_OP_DECRYPT
+ *   9  uint8   mode        blowfish_mode
+ *  10  uint8   flags       SERVER_FLAG_*
+ *  11  uint8   segment     CFB segment size in bits, zero for the default
+ *  12  uint16  key         index of a key given to the server
+ *  14  uint16  reserved    zero
+ *
+ * With SERVER_FLAG_IV the body starts with the initialization vector and
+ * the message follows it.
+ *
+ * Response, followed by `length` bytes of result, or of the error message
+ * when `status` is SERVER_STATUS_ERROR:
+ *
+ *   0  uint32  length
+ *   4  uint32  id
+ *   8  uint8   status
+ *   9  uint8   reserved[3]
+ *
+ * Requests may be pipelined.  The responses on a connection come back in
+ * request order.
+ */
+#define SERVER_REQUEST_SIZE 16
+#define SERVER_RESPONSE_SIZE 12
+#define SERVER_MAX_BODY ((size_t)16 * 1024 * 1024)
+
+#define SERVER_OP_ENCRYPT 1
+#define SERVER_OP_DECRYPT 2
+
+#define SERVER_FLAG_PADDING 0x01
+#define SERVER_FLAG_IV 0x02
+
+#define SERVER_STATUS_OK 0
+#define SERVER_STATUS_ERROR 1
+
+#endif /* !BLOWFISH_8BIT_SERVER_PROTOCOL_H */
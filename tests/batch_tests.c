@@ -0,0 +1,143 @@
+#include <string.h>
+
+#include "blowfish.h"
+#include "test-lib.h"
+
+#define NUM_JOBS 500
+#define MAX_RECORD 300
+
+static uint8_t records[NUM_JOBS][MAX_RECORD];
+static uint8_t ivs[NUM_JOBS][BLOWFISH_BLOCK_SIZE];
+static uint8_t ciphers[NUM_JOBS][MAX_RECORD + BLOWFISH_BLOCK_SIZE];
+static uint8_t plains[NUM_JOBS][MAX_RECORD + BLOWFISH_BLOCK_SIZE];
+static blowfish_job jobs[NUM_JOBS];
+
+static size_t
+record_len(size_t i)
+{
+    return (i * 37) % MAX_RECORD + 1;
+}
+
+static void
+test_batch_round_trip(blowfish_state const *context)
+{
+    for (size_t i = 0; i < NUM_JOBS; ++i) {
+        jobs[i].context = context;
+        jobs[i].iv = &ivs[i][0];
+        jobs[i].input = &records[i][0];
+        jobs[i].input_len = record_len(i);
+        jobs[i].output = &ciphers[i][0];
+        jobs[i].output_size = sizeof(ciphers[i]);
+    }
+    assert_true(blowfish_encrypt_batch(jobs, NUM_JOBS) == 0,
+                "encryption batch should not fail");
+
+    /* each job must match a context freshly initialized with its IV */
+    for (size_t i = 0; i < NUM_JOBS; ++i) {
+        blowfish_state state;
+        assert_true(blowfish_init(&state, &EIGHT_BYTES[0],
+                                  sizeof(EIGHT_BYTES), &ivs[i][0],
+                                  sizeof(ivs[i]), MODE_CBC, 0, &on_error,
+                                  HERE),
+                    "blowfish_init failed unexpectedly");
+        assert_encrypted_value(&state, &records[i][0], record_len(i),
+                               &ciphers[i][0], jobs[i].output_len, HERE);
+        jobs[i].input = &ciphers[i][0];
+        jobs[i].input_len = jobs[i].output_len;
+        jobs[i].output = &plains[i][0];
+        jobs[i].output_size = sizeof(plains[i]);
+    }
+
+    assert_true(blowfish_decrypt_batch(jobs, NUM_JOBS) == 0,
+                "decryption batch should not fail");
+    for (size_t i = 0; i < NUM_JOBS; ++i) {
+        assert_true(jobs[i].ok && jobs[i].output_len == record_len(i),
+                    "decrypted record has the wrong length");
+        assert_bytes_equal(&plains[i][0], &records[i][0], record_len(i),
+                           "record decrypted incorrectly", __FILE__,
+                           __LINE__);
+    }
+}
+
+static void
+test_batch_errors(blowfish_state const *context)
+{
+    blowfish_job bad[3];
+
+    memset(bad, 0, sizeof(bad));
+    bad[0].context = NULL;
+    bad[1].context = context;
+    bad[1].input = &ciphers[0][0];
+    bad[1].input_len = 3; /* not a whole block */
+    bad[1].output = &plains[0][0];
+    bad[1].output_size = sizeof(plains[0]);
+    bad[2].context = context;
+    bad[2].input = &ciphers[1][0];
+    bad[2].input_len = jobs[1].input_len;
+    bad[2].output = &plains[1][0];
+    bad[2].output_size = 1; /* too small */
+
+    assert_true(blowfish_decrypt_batch(bad, 3) == 3,
+                "every broken job should be reported");
+    for (size_t i = 0; i < 3; ++i) {
+        assert_true(!bad[i].ok && bad[i].error[0] != '\0',
+                    "failed jobs should carry an error message");
+    }
+}
+
+static void
+test_in_place()
+{
+    uint8_t buffer[sizeof(SIXTY_FOUR_BYTES) + BLOWFISH_BLOCK_SIZE];
+    blowfish_state state;
+    size_t len;
+
+    blowfish_init(&state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                  &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), MODE_CFB, 0,
+                  &on_error, HERE);
+    assert_true(blowfish_encrypted_size(&state, sizeof(SIXTY_FOUR_BYTES))
+                    == sizeof(SIXTY_FOUR_BYTES) + 1,
+                "CFB8 pads with a single byte");
+
+    memcpy(buffer, SIXTY_FOUR_BYTES, sizeof(SIXTY_FOUR_BYTES));
+    assert_true(blowfish_encrypt_into(&state, buffer, sizeof(SIXTY_FOUR_BYTES),
+                                      buffer, sizeof(buffer), &len, &on_error,
+                                      HERE),
+                "in-place encryption failed");
+    blowfish_reset(&state);
+    assert_true(blowfish_decrypt_into(&state, buffer, len, buffer,
+                                      sizeof(buffer), &len, &on_error, HERE),
+                "in-place decryption failed");
+    assert_true(len == sizeof(SIXTY_FOUR_BYTES),
+                "in-place decryption has the wrong length");
+    assert_bytes_equal(buffer, SIXTY_FOUR_BYTES, len,
+                       "in-place round trip failed", __FILE__, __LINE__);
+}
+
+int
+main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
+{
+    blowfish_state context;
+
+    for (size_t i = 0; i < NUM_JOBS; ++i) {
+        for (size_t j = 0; j < MAX_RECORD; ++j) {
+            records[i][j] = (uint8_t)(i + j * 7);
+        }
+        for (size_t j = 0; j < BLOWFISH_BLOCK_SIZE; ++j) {
+            ivs[i][j] = (uint8_t)(i * 13 + j);
+        }
+    }
+    blowfish_init(&context, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                  &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                  &on_error, HERE);
+
+    test_batch_round_trip(&context); /* on the calling thread */
+    assert_true(blowfish_threads_start(4, &on_error, HERE),
+                "blowfish_threads_start failed unexpectedly");
+    test_batch_round_trip(&context);
+    test_batch_errors(&context);
+    blowfish_threads_stop();
+    test_in_place();
+
+    return error_counter;
+}
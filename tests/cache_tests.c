@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blowfish.h"
+#include "test-lib.h"
+
+static char cache_name[64];
+
+static void
+assert_same_cipher(blowfish_state *state, struct error_context *context)
+{
+    blowfish_state expected;
+    uint8_t *actual;
+    size_t actual_len;
+
+    assert_condition(blowfish_init(&expected, &EIGHT_BYTES[0],
+                                   sizeof(EIGHT_BYTES), &EIGHT_BYTES[0],
+                                   sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                                   &on_error, context),
+                     "blowfish_init failed unexpectedly", context->file,
+                     context->line_no);
+    actual = blowfish_encrypt(&expected, &SIXTY_FOUR_BYTES[0],
+                              sizeof(SIXTY_FOUR_BYTES), &actual_len,
+                              &on_error, context);
+    assert_encrypted_value(state, &SIXTY_FOUR_BYTES[0],
+                           sizeof(SIXTY_FOUR_BYTES), actual, actual_len,
+                           context);
+    blowfish_release(actual);
+}
+
+static void
+test_cache_sharing()
+{
+    blowfish_cache *first = blowfish_cache_open(cache_name, 8, &on_error, HERE);
+    blowfish_cache *second;
+    blowfish_schedule const *schedule, *other;
+    blowfish_state state;
+
+    assert_true(first != NULL, "blowfish_cache_open failed unexpectedly");
+    schedule = blowfish_cache_acquire(first, &EIGHT_BYTES[0],
+                                      sizeof(EIGHT_BYTES), &on_error, HERE);
+    assert_true(schedule != NULL, "first acquire should insert the key");
+    assert_true(blowfish_cache_acquire(first, &EIGHT_BYTES[0],
+                                       sizeof(EIGHT_BYTES), &on_error, HERE)
+                    == schedule,
+                "second acquire should find the same schedule");
+
+    /* a second mapping stands in for another worker process */
+    second = blowfish_cache_open(cache_name, 0, &on_error, HERE);
+    assert_true(second != NULL, "attaching to the cache failed");
+    other = blowfish_cache_acquire(second, &EIGHT_BYTES[0],
+                                   sizeof(EIGHT_BYTES), &on_error, HERE);
+    assert_true(other != NULL && other != schedule,
+                "attached cache should map the schedule");
+    assert_true(memcmp(other, schedule, sizeof(*schedule)) == 0,
+                "attached cache should see the expanded schedule");
+
+    assert_true(blowfish_init_cached(&state, second, &EIGHT_BYTES[0],
+                                     sizeof(EIGHT_BYTES), &EIGHT_BYTES[0],
+                                     sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                                     &on_error, HERE),
+                "blowfish_init_cached failed unexpectedly");
+    assert_true(state.ks == other, "cached context should not copy the keys");
+    assert_same_cipher(&state, HERE);
+
+    blowfish_cache_close(second);
+    blowfish_cache_close(first);
+}
+
+static void
+test_cache_overflow()
+{
+    blowfish_cache *cache = blowfish_cache_open(cache_name, 0, NULL, NULL);
+    blowfish_state state;
+    size_t inserted = 0;
+
+    assert_true(cache != NULL, "blowfish_cache_open failed unexpectedly");
+    assert_true(blowfish_cache_acquire(cache, NULL, 0, NULL, NULL) == NULL,
+                "cache should validate the key");
+    for (size_t i = 4; i <= 56; ++i) {
+        inserted += blowfish_cache_acquire(cache, &SIXTY_FOUR_BYTES[1], i,
+                                           &on_error, HERE)
+                 != NULL;
+    }
+    assert_true(inserted == 7, "cache should fill every remaining slot");
+
+    /* a full cache falls back to a private schedule */
+    assert_true(blowfish_init_cached(&state, cache, &SIXTY_FOUR_BYTES[8], 8,
+                                     &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                                     MODE_CBC, 0, &on_error, HERE),
+                "blowfish_init_cached failed unexpectedly");
+    assert_true(state.ks == &state.schedule,
+                "overflow should expand the key privately");
+    blowfish_cache_close(cache);
+}
+
+int
+main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
+{
+    snprintf(cache_name, sizeof(cache_name), "/blowfish-test-%ld",
+             (long)getpid());
+    blowfish_cache_unlink(cache_name);
+    assert_true(blowfish_cache_open("no-slash", 0, NULL, NULL) == NULL,
+                "cache names must start with a slash");
+
+    test_cache_sharing();
+    test_cache_overflow();
+
+    blowfish_cache_unlink(cache_name);
+    return error_counter;
+}
@@ -78,7 +78,9 @@ static void
 test_cbc_decryption()
 {
     uint8_t incorrectly_padded[sizeof(plaintext) + BLOWFISH_BLOCK_SIZE];
+    uint8_t padding_only[BLOWFISH_BLOCK_SIZE];
     blowfish_state state;
+    size_t len;
 
     assert_true(blowfish_init(&state, &key[0], sizeof(key), &init_vector[0],
                               sizeof(init_vector), MODE_CBC, 0, &on_error,
@@ -98,6 +100,34 @@ test_cbc_decryption()
     assert_decryption_fails(&state, &incorrectly_padded[0],
                             sizeof(incorrectly_padded), HERE);
 
+    /* a block of nothing but padding is what an empty message encrypts to */
+    blowfish_reset(&state);
+    assert_true(blowfish_encrypt_into(&state, NULL, 0, &padding_only[0],
+                                      sizeof(padding_only), &len, &on_error,
+                                      HERE),
+                "encrypting an empty message failed unexpectedly");
+    assert_true(len == sizeof(padding_only), "expected one padding block");
+    blowfish_reset(&state);
+    assert_true(blowfish_decrypt_into(&state, &padding_only[0], len,
+                                      &padding_only[0], sizeof(padding_only),
+                                      &len, &on_error, HERE),
+                "decrypting a padding block failed unexpectedly");
+    assert_true(len == 0, "a padding block should decrypt to nothing");
+
+    /* padding never spans more than one block, as in a stream */
+    memset(&incorrectly_padded, 2 * BLOWFISH_BLOCK_SIZE,
+           sizeof(incorrectly_padded));
+    state.pkcs7padding = false;
+    blowfish_reset(&state);
+    assert_true(blowfish_encrypt_into(&state, &incorrectly_padded[0],
+                                      2 * BLOWFISH_BLOCK_SIZE,
+                                      &incorrectly_padded[0],
+                                      sizeof(incorrectly_padded), &len,
+                                      &on_error, HERE),
+                "encrypting without padding failed unexpectedly");
+    state.pkcs7padding = true;
+    assert_decryption_fails(&state, &incorrectly_padded[0], len, HERE);
+
     state.pkcs7padding = false;
     assert_decryption_fails(&state, &ciphertext[0], 13, HERE);
 }
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "blowfish.h"
@@ -11,6 +12,8 @@ create_and_destroy_context()
     blowfish_state *s = blowfish_new(&key[0], sizeof(key), &key[0], sizeof(key),
                                      MODE_CBC, 0, &on_error, HERE);
     assert_true(s != NULL, "blowfish_new failed unexpectedly");
+    assert_true(((uintptr_t)s % BLOWFISH_ALIGNMENT) == 0,
+                "contexts should be cache line aligned");
     blowfish_free(s);
 }
 
@@ -56,6 +59,139 @@ test_context_reset()
                 "IV should be restored on reset");
 }
 
+static void
+test_set_iv()
+{
+    blowfish_state state, expected;
+    uint8_t const *other_iv = &SIXTY_FOUR_BYTES[8];
+    uint8_t *cipher;
+    size_t cipher_len;
+
+    blowfish_init(&state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                  &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), MODE_CBC, 0, &on_error,
+                  HERE);
+    blowfish_init(&expected, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), other_iv,
+                  BLOWFISH_BLOCK_SIZE, MODE_CBC, 0, &on_error, HERE);
+    cipher = blowfish_encrypt(&expected, &SIXTY_FOUR_BYTES[0],
+                              sizeof(SIXTY_FOUR_BYTES), &cipher_len, &on_error,
+                              HERE);
+
+    /* leave chaining state behind that set_iv has to discard */
+    blowfish_release(blowfish_encrypt(&state, &SIXTY_FOUR_BYTES[0],
+                                      sizeof(SIXTY_FOUR_BYTES), &cipher_len,
+                                      &on_error, HERE));
+    assert_true(blowfish_set_iv(&state, other_iv, BLOWFISH_BLOCK_SIZE,
+                                &on_error, HERE),
+                "blowfish_set_iv failed unexpectedly");
+    assert_encrypted_value(&state, &SIXTY_FOUR_BYTES[0],
+                           sizeof(SIXTY_FOUR_BYTES), cipher, cipher_len, HERE);
+    blowfish_reset(&state);
+    assert_true(memcmp(state.iv, other_iv, sizeof(state.iv)) == 0,
+                "reset should return to the new IV");
+
+    assert_false(blowfish_set_iv(&state, other_iv, 4, NULL, NULL),
+                 "IV must be a whole block");
+    blowfish_release(cipher);
+}
+
+static void
+test_arena_contexts()
+{
+    blowfish_arena *arena = blowfish_arena_new(2, &on_error, HERE);
+    blowfish_state *first, *second;
+
+    assert_true(arena != NULL, "blowfish_arena_new failed unexpectedly");
+    first = blowfish_arena_new_state(arena, &EIGHT_BYTES[0],
+                                     sizeof(EIGHT_BYTES), &EIGHT_BYTES[0],
+                                     sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                                     &on_error, HERE);
+    assert_true(first != NULL, "blowfish_arena_new_state failed unexpectedly");
+    assert_true(((uintptr_t)first % BLOWFISH_ALIGNMENT) == 0,
+                "arena contexts should be cache line aligned");
+    second = blowfish_arena_new_state(arena, &EIGHT_BYTES[0],
+                                      sizeof(EIGHT_BYTES), NULL, 0, MODE_ECB,
+                                      0, &on_error, HERE);
+    assert_true(second != NULL, "blowfish_arena_new_state failed unexpectedly");
+    assert_true(
+        memcmp(first->ks->P, second->ks->P, sizeof(first->ks->P)) == 0,
+        "arena contexts should expand keys like blowfish_new");
+    assert_true(blowfish_arena_new_state(arena, &EIGHT_BYTES[0],
+                                         sizeof(EIGHT_BYTES), NULL, 0,
+                                         MODE_ECB, 0, NULL, NULL)
+                    == NULL,
+                "arena capacity should be enforced");
+
+    blowfish_arena_release(arena, first);
+    assert_true(blowfish_arena_new_state(arena, &EIGHT_BYTES[0],
+                                         sizeof(EIGHT_BYTES), NULL, 0,
+                                         MODE_ECB, 0, &on_error, HERE)
+                    == first,
+                "released arena slots should be reused");
+    blowfish_arena_free(arena);
+}
+
+static struct {
+    size_t allocations;
+    size_t releases;
+} alloc_counts;
+
+static void *
+counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    (void)ud;
+    (void)osize;
+    if (nsize == 0) {
+        alloc_counts.releases += (ptr != NULL);
+        free(ptr);
+        return NULL;
+    }
+    ++alloc_counts.allocations;
+    return realloc(ptr, nsize);
+}
+
+static void
+test_allocator_hooks()
+{
+    blowfish_state *s;
+    uint8_t *first, *second;
+    size_t len;
+
+    blowfish_set_allocator(&counting_alloc, NULL);
+    s = blowfish_new(&EIGHT_BYTES[0], sizeof(EIGHT_BYTES), NULL, 0, MODE_ECB,
+                     0, &on_error, HERE);
+    assert_true(s != NULL, "blowfish_new failed unexpectedly");
+    assert_true(((uintptr_t)s % BLOWFISH_ALIGNMENT) == 0,
+                "hooked contexts should be cache line aligned");
+    assert_true(alloc_counts.allocations == 1,
+                "contexts should come from the global allocator");
+
+    first = blowfish_encrypt(s, &SIXTY_FOUR_BYTES[0], 16, &len, &on_error,
+                             HERE);
+    assert_true(alloc_counts.allocations == 2,
+                "output buffers should come from the global allocator");
+    blowfish_release(first);
+    assert_true(alloc_counts.releases == 0, "released buffers are pooled");
+    second = blowfish_encrypt(s, &SIXTY_FOUR_BYTES[0], 16, &len, &on_error,
+                              HERE);
+    assert_true(second == first && alloc_counts.allocations == 2,
+                "pooled buffers should be reused");
+    blowfish_release(second);
+
+    blowfish_set_context_allocator(s, &counting_alloc, &alloc_counts);
+    first = blowfish_encrypt(s, &SIXTY_FOUR_BYTES[0], 16, &len, &on_error,
+                             HERE);
+    assert_true(first != second && alloc_counts.allocations == 3,
+                "output buffers should come from the context allocator");
+    blowfish_release(first);
+    assert_true(alloc_counts.releases == 1,
+                "context allocator buffers are not pooled");
+
+    blowfish_free(s);
+    blowfish_set_allocator(NULL, NULL);
+    assert_true(alloc_counts.allocations == alloc_counts.releases,
+                "every allocation should be released");
+}
+
 int
 main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
 {
@@ -64,6 +200,9 @@ main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
     create_and_destroy_context();
     test_basic_parameter_checking();
     test_context_reset();
+    test_set_iv();
+    test_arena_contexts();
+    test_allocator_hooks();
 
     return error_counter;
 }
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "blowfish.h"
+#include "test-lib.h"
+
+#define MESSAGE_SIZE (64 * 1024 + 37)
+
+static uint8_t message[MESSAGE_SIZE];
+
+struct mode_case {
+    blowfish_mode mode;
+    int segment_size;
+};
+
+static struct mode_case const MODES[] = {
+    {MODE_CBC, 0}, {MODE_CFB, 8}, {MODE_CFB, 64}, {MODE_ECB, 0}, {MODE_OFB, 0},
+};
+
+static void
+init_state(blowfish_state *state, struct mode_case const *mode,
+           struct error_context *context)
+{
+    bool with_iv = mode->mode != MODE_ECB;
+    assert_condition(blowfish_init(state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                                   with_iv ? &EIGHT_BYTES[0] : NULL,
+                                   with_iv ? sizeof(EIGHT_BYTES) : 0,
+                                   mode->mode, mode->segment_size, &on_error,
+                                   context),
+                     "blowfish_init failed unexpectedly", context->file,
+                     context->line_no);
+}
+
+/* Encrypts `message` on the calling thread only */
+static uint8_t *
+sequential_cipher(struct mode_case const *mode, size_t *cipher_len)
+{
+    blowfish_state state;
+    uint8_t *cipher;
+
+    blowfish_threads_stop();
+    init_state(&state, mode, HERE);
+    cipher = blowfish_encrypt(&state, &message[0], sizeof(message), cipher_len,
+                              &on_error, HERE);
+    assert_true(blowfish_threads_start(4, &on_error, HERE),
+                "blowfish_threads_start failed unexpectedly");
+    return cipher;
+}
+
+static void
+test_matches_sequential()
+{
+    for (size_t i = 0; i < sizeof(MODES) / sizeof(MODES[0]); ++i) {
+        blowfish_state state;
+        size_t cipher_len;
+        uint8_t *cipher = sequential_cipher(&MODES[i], &cipher_len);
+
+        init_state(&state, &MODES[i], HERE);
+        assert_encrypted_value(&state, &message[0], sizeof(message), cipher,
+                               cipher_len, HERE);
+        init_state(&state, &MODES[i], HERE);
+        assert_decrypted_value(&state, cipher, cipher_len, &message[0],
+                               sizeof(message), HERE);
+        blowfish_release(cipher);
+    }
+}
+
+static void
+test_chaining_across_calls()
+{
+    struct mode_case const cbc = {MODE_CBC, 0};
+    blowfish_state state;
+    size_t cipher_len, first_len, second_len;
+    uint8_t *cipher = sequential_cipher(&cbc, &cipher_len);
+    uint8_t *first, *second;
+    size_t split = 32 * 1024 + 8;
+
+    /* the second call has to pick up the chain where the first left it */
+    init_state(&state, &cbc, HERE);
+    state.pkcs7padding = false;
+    first = blowfish_decrypt(&state, cipher, split, &first_len, &on_error,
+                             HERE);
+    state.pkcs7padding = true;
+    second = blowfish_decrypt(&state, cipher + split, cipher_len - split,
+                              &second_len, &on_error, HERE);
+    assert_true(first_len + second_len == sizeof(message),
+                "split decryption has the wrong length");
+    assert_bytes_equal(first, &message[0], first_len,
+                       "first half decrypted incorrectly", __FILE__, __LINE__);
+    assert_bytes_equal(second, &message[split], second_len,
+                       "second half decrypted incorrectly", __FILE__,
+                       __LINE__);
+    assert_bytes_equal(state.iv, cipher + cipher_len - BLOWFISH_BLOCK_SIZE,
+                       BLOWFISH_BLOCK_SIZE, "IV should be the last block",
+                       __FILE__, __LINE__);
+
+    blowfish_release(second);
+    blowfish_release(first);
+    blowfish_release(cipher);
+}
+
+static void
+test_limits()
+{
+    struct mode_case const ecb = {MODE_ECB, 0};
+    blowfish_state state;
+    size_t cipher_len;
+    uint8_t *cipher = sequential_cipher(&ecb, &cipher_len);
+
+    assert_false(blowfish_threads_start(2, NULL, NULL),
+                 "starting a running pool should fail");
+    assert_false(blowfish_threads_start(0, NULL, NULL),
+                 "a pool needs at least one thread");
+
+    blowfish_set_max_parallelism(2);
+    init_state(&state, &ecb, HERE);
+    assert_decrypted_value(&state, cipher, cipher_len, &message[0],
+                           sizeof(message), HERE);
+    blowfish_set_max_parallelism(0);
+
+    /* tiny chunks make every worker take part */
+    blowfish_set_parallel_threshold(BLOWFISH_BLOCK_SIZE);
+    init_state(&state, &ecb, HERE);
+    state.pkcs7padding = false;
+    assert_decrypted_value(&state, cipher, 2 * BLOWFISH_BLOCK_SIZE,
+                           &message[0], 2 * BLOWFISH_BLOCK_SIZE, HERE);
+    blowfish_set_parallel_threshold(1024);
+
+    blowfish_release(cipher);
+}
+
+int
+main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
+{
+    for (size_t i = 0; i < sizeof(message); ++i) {
+        message[i] = (uint8_t)(i * 31 + (i >> 8));
+    }
+    blowfish_set_parallel_threshold(1024);
+    assert_true(blowfish_threads_start(4, &on_error, HERE),
+                "blowfish_threads_start failed unexpectedly");
+
+    test_matches_sequential();
+    test_chaining_across_calls();
+    test_limits();
+
+    blowfish_threads_stop();
+    return error_counter;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blowfish.h"
+#include "cli-lib.h"
+#include "test-lib.h"
+
+static uint8_t const RECORD_IV[BLOWFISH_BLOCK_SIZE] = {
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+};
+static uint8_t const HELLO[] = "HelloWorld";
+
+static void
+write_file(char const *path, char const *text)
+{
+    FILE *fp = fopen(path, "w");
+    assert_true(fp != NULL && fputs(text, fp) >= 0 && fclose(fp) == 0,
+                "failed to write the input file");
+}
+
+static size_t
+read_file(char const *path, char *buf, size_t size)
+{
+    FILE *fp = fopen(path, "r");
+    size_t len = 0;
+
+    assert_true(fp != NULL, "failed to open the output file");
+    if (fp != NULL) {
+        len = fread(buf, 1, size - 1, fp);
+        fclose(fp);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* The hex line `HELLO` encrypts to from `iv` */
+static void
+expected_line(uint8_t const *iv, char *line)
+{
+    blowfish_state state;
+    uint8_t cipher[2 * BLOWFISH_BLOCK_SIZE];
+    size_t cipher_len = 0;
+
+    blowfish_init(&state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), iv,
+                  BLOWFISH_BLOCK_SIZE, MODE_CBC, 0, &on_error, HERE);
+    assert_true(blowfish_encrypt_into(&state, HELLO, sizeof(HELLO) - 1,
+                                      cipher, sizeof(cipher), &cipher_len,
+                                      &on_error, HERE),
+                "blowfish_encrypt_into failed unexpectedly");
+    line[hex_encode(cipher, cipher_len, line)] = '\0';
+}
+
+/* Records without an IV start from the initial one, whatever came before */
+static void
+test_mixed_ivs(char const *in_path, char const *out_path)
+{
+    blowfish_state state;
+    char initial[64], own[64], expected[512], actual[512];
+
+    write_file(in_path, "8899aabbccddeeff:48656c6c6f576f726c64\n"
+                        "48656c6c6f576f726c64\n"
+                        "8899aabbccddeeff:48656c6c6f576f726c64\n"
+                        "48656c6c6f576f726c64\n");
+    blowfish_init(&state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                  &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                  &on_error, HERE);
+    assert_true(run_records(&state, true, ENCODING_HEX, in_path, out_path),
+                "run_records failed unexpectedly");
+
+    expected_line(&EIGHT_BYTES[0], initial);
+    expected_line(RECORD_IV, own);
+    snprintf(expected, sizeof(expected),
+             "8899aabbccddeeff:%s\n%s\n8899aabbccddeeff:%s\n%s\n", own,
+             initial, own, initial);
+    read_file(out_path, actual, sizeof(actual));
+    assert_true(strcmp(actual, expected) == 0,
+                "records without an IV must use the initial one");
+}
+
+static void
+test_same_file(char const *path)
+{
+    blowfish_state state;
+    char actual[64];
+
+    write_file(path, "48656c6c6f576f726c64\n");
+    blowfish_init(&state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                  &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                  &on_error, HERE);
+    assert_false(run_records(&state, true, ENCODING_HEX, path, path),
+                 "run_records must refuse to write over its input");
+    read_file(path, actual, sizeof(actual));
+    assert_true(strcmp(actual, "48656c6c6f576f726c64\n") == 0,
+                "the input must be left alone");
+}
+
+int
+main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
+{
+    char in_path[] = "/tmp/records_tests_in_XXXXXX";
+    char out_path[] = "/tmp/records_tests_out_XXXXXX";
+    int in_fd = mkstemp(in_path), out_fd = mkstemp(out_path);
+
+    if (in_fd < 0 || out_fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(in_fd);
+    close(out_fd);
+
+    test_mixed_ivs(in_path, out_path);
+    test_same_file(in_path);
+
+    unlink(in_path);
+    unlink(out_path);
+    return error_counter;
+}
@@ -0,0 +1,102 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "blowfish.h"
+#include "test-lib.h"
+
+#define NUM_THREADS 8
+
+static uint8_t const OTHER_KEY[] = {'a', 'n', 'o', 't', 'h', 'e', 'r'};
+
+static void
+test_sharing()
+{
+    blowfish_schedule const *schedule, *again, *found;
+    blowfish_state expected, state;
+    uint8_t *cipher;
+    size_t cipher_len;
+
+    schedule = blowfish_schedule_acquire("shared", &EIGHT_BYTES[0],
+                                         sizeof(EIGHT_BYTES), &on_error, HERE);
+    assert_true(schedule != NULL, "first acquire should expand the key");
+    again = blowfish_schedule_acquire("shared", &EIGHT_BYTES[0],
+                                      sizeof(EIGHT_BYTES), &on_error, HERE);
+    found = blowfish_schedule_find("shared", &on_error, HERE);
+    assert_true(again == schedule && found == schedule,
+                "later callers should get the same schedule");
+
+    blowfish_init(&expected, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                  &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                  &on_error, HERE);
+    cipher = blowfish_encrypt(&expected, &SIXTY_FOUR_BYTES[0],
+                              sizeof(SIXTY_FOUR_BYTES), &cipher_len,
+                              &on_error, HERE);
+    assert_true(blowfish_init_with_schedule(&state, schedule, &EIGHT_BYTES[0],
+                                            sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                                            &on_error, HERE),
+                "binding to the schedule failed unexpectedly");
+    assert_encrypted_value(&state, &SIXTY_FOUR_BYTES[0],
+                           sizeof(SIXTY_FOUR_BYTES), cipher, cipher_len, HERE);
+    blowfish_release(cipher);
+
+    blowfish_schedule_release(found);
+    blowfish_schedule_release(again);
+    blowfish_schedule_release(schedule);
+    assert_true(blowfish_schedule_find("shared", NULL, NULL) == NULL,
+                "the last release should remove the schedule");
+}
+
+static void
+test_conflicting_key()
+{
+    blowfish_schedule const *schedule =
+        blowfish_schedule_acquire("conflict", &EIGHT_BYTES[0],
+                                  sizeof(EIGHT_BYTES), &on_error, HERE);
+
+    assert_true(blowfish_schedule_acquire("conflict", &OTHER_KEY[0],
+                                          sizeof(OTHER_KEY), NULL, NULL)
+                    == NULL,
+                "a name should not be reused for another key");
+    assert_true(blowfish_schedule_acquire("other", &OTHER_KEY[0], 2, NULL,
+                                          NULL)
+                    == NULL,
+                "short keys should be rejected");
+    blowfish_schedule_release(schedule);
+}
+
+static void *
+acquire_and_release(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < 1000; ++i) {
+        blowfish_schedule const *schedule = blowfish_schedule_acquire(
+            "threads", &OTHER_KEY[0], sizeof(OTHER_KEY), &on_error, HERE);
+        blowfish_schedule_release(schedule);
+    }
+    return NULL;
+}
+
+static void
+test_threads()
+{
+    pthread_t threads[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_create(&threads[i], NULL, acquire_and_release, NULL);
+    }
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    assert_true(blowfish_schedule_find("threads", NULL, NULL) == NULL,
+                "every reference should have been released");
+}
+
+int
+main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
+{
+    test_sharing();
+    test_conflicting_key();
+    test_threads();
+
+    return error_counter;
+}
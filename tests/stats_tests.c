@@ -0,0 +1,253 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blowfish.h"
+#include "test-lib.h"
+
+#define NUM_THREADS 8
+#define CALLS_PER_THREAD 1000
+
+static void
+ignore_error(void *context, char const *fmt, ...)
+{
+    (void)context;
+    (void)fmt;
+}
+
+static uint64_t
+histogram_total(blowfish_histogram const *histogram)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < BLOWFISH_STATS_BUCKETS; ++i) {
+        total += histogram->buckets[i];
+    }
+    return total;
+}
+
+static void
+test_counters()
+{
+    blowfish_stats before, after;
+    blowfish_state *state;
+    uint8_t out[64 + BLOWFISH_BLOCK_SIZE], plain[64 + BLOWFISH_BLOCK_SIZE];
+    size_t out_len, plain_len;
+
+    blowfish_stats_snapshot(&before);
+    state = blowfish_new(&EIGHT_BYTES[0], sizeof(EIGHT_BYTES), &EIGHT_BYTES[0],
+                         sizeof(EIGHT_BYTES), MODE_CBC, 0, &on_error, HERE);
+    blowfish_encrypt_into(state, &SIXTY_FOUR_BYTES[0], 64, out, sizeof(out),
+                          &out_len, &on_error, HERE);
+    blowfish_reset(state);
+    blowfish_decrypt_into(state, out, out_len, plain, sizeof(plain),
+                          &plain_len, &on_error, HERE);
+    blowfish_reset(state);
+    out[out_len - 1] ^= 0x55; /* corrupt the padding */
+    assert_false(blowfish_decrypt_into(state, out, out_len, plain,
+                                       sizeof(plain), &plain_len,
+                                       &ignore_error, NULL),
+                 "corrupted padding should fail");
+    blowfish_free(state);
+    blowfish_stats_snapshot(&after);
+
+    assert_true(after.operations[MODE_CBC][1]
+                        - before.operations[MODE_CBC][1]
+                    == 1,
+                "one encryption should be counted");
+    assert_true(after.bytes[MODE_CBC][1] - before.bytes[MODE_CBC][1] == 64,
+                "encrypted bytes should be the plaintext length");
+    assert_true(after.operations[MODE_CBC][0]
+                        - before.operations[MODE_CBC][0]
+                    == 1,
+                "only the successful decryption should be counted");
+    assert_true(after.bytes[MODE_CBC][0] - before.bytes[MODE_CBC][0]
+                    == out_len,
+                "decrypted bytes should be the ciphertext length");
+    assert_true(after.key_expansions - before.key_expansions == 1,
+                "blowfish_new should expand the key once");
+    assert_true(after.padding_failures - before.padding_failures == 1,
+                "the corrupted padding should be counted");
+    assert_true(after.allocations - before.allocations == 1,
+                "blowfish_new should allocate the context");
+    assert_true(after.latency[BLOWFISH_LATENCY_ENCRYPT].count
+                    == before.latency[BLOWFISH_LATENCY_ENCRYPT].count,
+                "latency should not be recorded unless tracked");
+}
+
+static void
+test_latency()
+{
+    static blowfish_latency_kind const kinds[] = {
+        BLOWFISH_LATENCY_ENCRYPT, BLOWFISH_LATENCY_KEY_SETUP};
+    blowfish_stats stats;
+    blowfish_state state;
+    uint8_t out[64];
+    size_t out_len;
+
+    blowfish_stats_track_latency(true);
+    blowfish_init(&state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), NULL, 0,
+                  MODE_ECB, 0, &on_error, HERE);
+    state.pkcs7padding = false;
+    blowfish_encrypt_into(&state, &SIXTY_FOUR_BYTES[0], 64, out, sizeof(out),
+                          &out_len, &on_error, HERE);
+    blowfish_stats_track_latency(false);
+    blowfish_stats_snapshot(&stats);
+
+    for (int i = 0; i < 2; ++i) {
+        blowfish_histogram const *histogram = &stats.latency[kinds[i]];
+        assert_true(histogram->count == 1, "one call should be timed");
+        assert_true(histogram_total(histogram) == histogram->count,
+                    "every timed call should be in a bucket");
+        assert_true(histogram->sum_ns > 0, "the call should take some time");
+    }
+}
+
+static void
+test_streams()
+{
+    blowfish_stats before, after;
+    blowfish_state state;
+    blowfish_stream stream;
+    uint8_t out[64 + BLOWFISH_BLOCK_SIZE];
+    size_t out_len, total = 0;
+
+    blowfish_init(&state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                  &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), MODE_OFB, 0,
+                  &on_error, HERE);
+    blowfish_stats_snapshot(&before);
+    blowfish_stream_init(&stream, &state, true, &on_error, HERE);
+    for (size_t offset = 0; offset < 64; offset += 16) {
+        blowfish_stream_update(&stream, &SIXTY_FOUR_BYTES[offset], 16,
+                               out + total, sizeof(out) - total, &out_len,
+                               &on_error, HERE);
+        total += out_len;
+    }
+    blowfish_stats_snapshot(&after);
+    assert_true(after.operations[MODE_OFB][1]
+                    == before.operations[MODE_OFB][1],
+                "updates should not count as operations");
+
+    blowfish_stream_finish(&stream, out + total, sizeof(out) - total,
+                           &out_len, &on_error, HERE);
+    blowfish_stats_snapshot(&after);
+    assert_true(after.operations[MODE_OFB][1]
+                        - before.operations[MODE_OFB][1]
+                    == 1,
+                "a finished stream should be one operation");
+    assert_true(after.bytes[MODE_OFB][1] - before.bytes[MODE_OFB][1] == 64,
+                "every update should count its bytes");
+
+    /* chunks that complete a buffered block still count in full */
+    blowfish_init(&state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                  &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), MODE_CBC, 0,
+                  &on_error, HERE);
+    blowfish_stats_snapshot(&before);
+    blowfish_stream_init(&stream, &state, true, &on_error, HERE);
+    total = 0;
+    for (size_t offset = 0; offset < 64; offset += 5) {
+        size_t n = 64 - offset < 5 ? 64 - offset : 5;
+        blowfish_stream_update(&stream, &SIXTY_FOUR_BYTES[offset], n,
+                               out + total, sizeof(out) - total, &out_len,
+                               &on_error, HERE);
+        total += out_len;
+    }
+    blowfish_stream_finish(&stream, out + total, sizeof(out) - total,
+                           &out_len, &on_error, HERE);
+    blowfish_stats_snapshot(&after);
+    assert_true(after.bytes[MODE_CBC][1] - before.bytes[MODE_CBC][1] == 64,
+                "unaligned updates should count all of their bytes");
+}
+
+static void *
+encrypt_blocks(void *arg)
+{
+    blowfish_state *state = arg;
+    uint8_t out[BLOWFISH_BLOCK_SIZE];
+    size_t out_len;
+
+    for (int i = 0; i < CALLS_PER_THREAD; ++i) {
+        blowfish_encrypt_into(state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), out,
+                              sizeof(out), &out_len, &on_error, HERE);
+    }
+    return NULL;
+}
+
+static void
+test_exited_threads()
+{
+    blowfish_state states[NUM_THREADS];
+    pthread_t threads[NUM_THREADS];
+    blowfish_stats before, after;
+
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        blowfish_init(&states[i], &EIGHT_BYTES[0], sizeof(EIGHT_BYTES), NULL,
+                      0, MODE_ECB, 0, &on_error, HERE);
+        states[i].pkcs7padding = false;
+    }
+    blowfish_stats_snapshot(&before);
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_create(&threads[i], NULL, encrypt_blocks, &states[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    blowfish_stats_snapshot(&after);
+
+    assert_true(after.operations[MODE_ECB][1] - before.operations[MODE_ECB][1]
+                    == NUM_THREADS * CALLS_PER_THREAD,
+                "calls of exited threads should be kept");
+    assert_true(after.bytes[MODE_ECB][1] - before.bytes[MODE_ECB][1]
+                    == NUM_THREADS * CALLS_PER_THREAD * BLOWFISH_BLOCK_SIZE,
+                "bytes of exited threads should be kept");
+}
+
+static void
+test_prometheus()
+{
+    blowfish_stats stats;
+    size_t len;
+    char small[16];
+    char *text;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.operations[MODE_OFB][0] = 42;
+    stats.latency[BLOWFISH_LATENCY_DECRYPT].count = 3;
+    stats.latency[BLOWFISH_LATENCY_DECRYPT].buckets[10] = 3;
+
+    len = blowfish_stats_prometheus(&stats, NULL, 0);
+    text = malloc(len + 1);
+    assert_true(blowfish_stats_prometheus(&stats, text, len + 1) == len,
+                "the length should not depend on the buffer");
+    assert_true(strlen(text) == len, "the text should be complete");
+    assert_true(strstr(text, "blowfish_operations_total{mode=\"OFB\","
+                             "direction=\"decrypt\"} 42\n")
+                    != NULL,
+                "operations should be labelled by mode and direction");
+    assert_true(strstr(text, "blowfish_latency_seconds_bucket{op=\"decrypt\","
+                             "le=\"1.024e-06\"} 3\n")
+                    != NULL,
+                "buckets should be cumulative with bounds in seconds");
+    assert_true(strstr(text, "blowfish_latency_seconds_count{op=\"decrypt\"}"
+                             " 3\n")
+                    != NULL,
+                "histograms should have a count");
+    assert_true(strstr(text, "mode=\"CTR\"") == NULL,
+                "unimplemented modes should be left out");
+
+    assert_true(blowfish_stats_prometheus(&stats, small, sizeof(small)) == len
+                    && strlen(small) == sizeof(small) - 1,
+                "a short buffer should hold a terminated prefix");
+    free(text);
+}
+
+int
+main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
+{
+    test_counters();
+    test_latency();
+    test_streams();
+    test_exited_threads();
+    test_prometheus();
+
+    return error_counter;
+}
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "blowfish.h"
+#include "test-lib.h"
+
+#define MESSAGE_SIZE 1000
+
+static uint8_t message[MESSAGE_SIZE];
+static uint8_t streamed[MESSAGE_SIZE + BLOWFISH_BLOCK_SIZE];
+
+struct mode_case {
+    blowfish_mode mode;
+    int segment_size;
+};
+
+static struct mode_case const MODES[] = {
+    {MODE_CBC, 0}, {MODE_CFB, 8}, {MODE_CFB, 32}, {MODE_ECB, 0}, {MODE_OFB, 0},
+};
+
+static void
+init_state(blowfish_state *state, struct mode_case const *mode,
+           struct error_context *context)
+{
+    bool with_iv = mode->mode != MODE_ECB;
+    assert_condition(blowfish_init(state, &EIGHT_BYTES[0], sizeof(EIGHT_BYTES),
+                                   with_iv ? &EIGHT_BYTES[0] : NULL,
+                                   with_iv ? sizeof(EIGHT_BYTES) : 0,
+                                   mode->mode, mode->segment_size, &on_error,
+                                   context),
+                     "blowfish_init failed unexpectedly", context->file,
+                     context->line_no);
+}
+
+/* Feeds `in` to a stream in uneven chunks and returns the output length */
+static size_t
+run_stream(blowfish_state *state, bool encrypt, uint8_t const *in,
+           size_t len, size_t chunk)
+{
+    blowfish_stream stream;
+    size_t total = 0, out_len;
+
+    assert_true(blowfish_stream_init(&stream, state, encrypt, &on_error, HERE),
+                "blowfish_stream_init failed unexpectedly");
+    for (size_t offset = 0; offset < len; offset += chunk, ++chunk) {
+        size_t n = len - offset < chunk ? len - offset : chunk;
+        assert_true(blowfish_stream_update(&stream, in + offset, n,
+                                           streamed + total,
+                                           sizeof(streamed) - total, &out_len,
+                                           &on_error, HERE),
+                    "blowfish_stream_update failed unexpectedly");
+        total += out_len;
+    }
+    assert_true(blowfish_stream_finish(&stream, streamed + total,
+                                       sizeof(streamed) - total, &out_len,
+                                       &on_error, HERE),
+                "blowfish_stream_finish failed unexpectedly");
+    return total + out_len;
+}
+
+static void
+test_matches_whole_message(bool padding)
+{
+    for (size_t i = 0; i < sizeof(MODES) / sizeof(MODES[0]); ++i) {
+        for (size_t chunk = 1; chunk < 20; chunk += 6) {
+            blowfish_state state;
+            size_t cipher_len, plain_len;
+            size_t msg_len = padding ? sizeof(message) - 3 : sizeof(message);
+            uint8_t *cipher;
+
+            init_state(&state, &MODES[i], HERE);
+            state.pkcs7padding = padding;
+            cipher = blowfish_encrypt(&state, &message[0], msg_len,
+                                      &cipher_len, &on_error, HERE);
+
+            init_state(&state, &MODES[i], HERE);
+            state.pkcs7padding = padding;
+            assert_true(run_stream(&state, true, message, msg_len, chunk)
+                            == cipher_len,
+                        "streamed ciphertext has the wrong length");
+            assert_bytes_equal(streamed, cipher, cipher_len,
+                               "streamed encryption differs", __FILE__,
+                               __LINE__);
+
+            init_state(&state, &MODES[i], HERE);
+            state.pkcs7padding = padding;
+            plain_len = run_stream(&state, false, cipher, cipher_len, chunk);
+            assert_true(plain_len == msg_len,
+                        "streamed plaintext has the wrong length");
+            assert_bytes_equal(streamed, message, msg_len,
+                               "streamed decryption differs", __FILE__,
+                               __LINE__);
+            blowfish_release(cipher);
+        }
+    }
+}
+
+static void
+test_holds_back_final_block()
+{
+    blowfish_state state;
+    blowfish_stream stream;
+    uint8_t cipher[3 * BLOWFISH_BLOCK_SIZE];
+    size_t out_len;
+
+    init_state(&state, &MODES[0], HERE);
+    blowfish_stream_init(&stream, &state, false, &on_error, HERE);
+    blowfish_stream_update(&stream, cipher, 2 * BLOWFISH_BLOCK_SIZE, streamed,
+                           sizeof(streamed), &out_len, &on_error, HERE);
+    assert_true(out_len == BLOWFISH_BLOCK_SIZE,
+                "the final block should be held back");
+    blowfish_stream_update(&stream, cipher, 3, streamed, sizeof(streamed),
+                           &out_len, &on_error, HERE);
+    assert_true(out_len == BLOWFISH_BLOCK_SIZE,
+                "more input should release the held block");
+    blowfish_stream_update(&stream, cipher, 5, streamed, sizeof(streamed),
+                           &out_len, &on_error, HERE);
+    assert_true(out_len == 0, "the completed block should be held back");
+}
+
+static void
+test_truncated_input()
+{
+    blowfish_state state;
+    blowfish_stream stream;
+    size_t out_len;
+
+    init_state(&state, &MODES[0], HERE);
+    blowfish_stream_init(&stream, &state, false, &on_error, HERE);
+    blowfish_stream_update(&stream, message, 12, streamed, sizeof(streamed),
+                           &out_len, &on_error, HERE);
+    assert_false(blowfish_stream_finish(&stream, streamed, sizeof(streamed),
+                                        &out_len, NULL, NULL),
+                 "a partial final block should be rejected");
+
+    state.pkcs7padding = false;
+    blowfish_stream_init(&stream, &state, true, &on_error, HERE);
+    blowfish_stream_update(&stream, message, 12, streamed, sizeof(streamed),
+                           &out_len, &on_error, HERE);
+    assert_false(blowfish_stream_finish(&stream, streamed, sizeof(streamed),
+                                        &out_len, NULL, NULL),
+                 "unpadded encryption needs whole blocks");
+}
+
+int
+main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
+{
+    for (size_t i = 0; i < sizeof(message); ++i) {
+        message[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    test_matches_whole_message(true);
+    test_matches_whole_message(false);
+    test_holds_back_final_block();
+    test_truncated_input();
+
+    return error_counter;
+}
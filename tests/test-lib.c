@@ -82,7 +82,7 @@ assert_encrypted_value(blowfish_state *state, uint8_t const *plaintext,
         assert_bytes_equal(actual, ciphertext, cipher_len,
                            "encryption produced unexpected result",
                            context->file, context->line_no);
-        free(actual);
+        blowfish_release(actual);
     }
 }
 
@@ -129,7 +129,7 @@ assert_decrypted_value(blowfish_state *state, uint8_t const *ciphertext,
         assert_bytes_equal(actual, plaintext, plain_len,
                            "decryption produced unexpected result",
                            context->file, context->line_no);
-        free(actual);
+        blowfish_release(actual);
     }
 }
 